@@ -0,0 +1,377 @@
+/* himasm
+ * assembles effects for the lamps (see embed/main/vm.c), checks
+ * them with the same verifier the lamps and the server use, and
+ * prints them as hex, writes them out, or hands them to a server
+ * to run on every lamp. one instruction to a line:
+ *
+ *	; a slow rainbow
+ *		i push 16 mul t push 10 div add
+ *	loop:	...
+ *		jz done
+ *
+ * labels end in a colon and are only ever jumped forward to,
+ * numbers are decimal or 0x hex, and push picks its own width
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "libhim.h"
+
+#define LINEMAX		256
+#define LABELMAX	32
+#define LABELS		VM_CODEMAX
+
+/* what follows a mnemonic */
+#define ARG_NONE	0
+#define ARG_NUMBER	1
+#define ARG_LABEL	2
+
+/* how long we give a server to take a program */
+#define SEND_TIMEOUT_MS	5000
+
+struct mnemonic {
+	const char	*name;
+	uint8_t		 op;
+	int		 arg;
+};
+
+struct label {
+	char		name[LABELMAX];
+	int		pc;
+};
+
+static const struct mnemonic	mnemonics[] = {
+	{ "end", VM_END, ARG_NONE },
+	{ "push", VM_PUSH, ARG_NUMBER },
+	{ "i", VM_I, ARG_NONE },
+	{ "n", VM_N, ARG_NONE },
+	{ "t", VM_T, ARG_NONE },
+	{ "red", VM_RED, ARG_NONE },
+	{ "green", VM_GREEN, ARG_NONE },
+	{ "blue", VM_BLUE, ARG_NONE },
+	{ "add", VM_ADD, ARG_NONE },
+	{ "sub", VM_SUB, ARG_NONE },
+	{ "mul", VM_MUL, ARG_NONE },
+	{ "div", VM_DIV, ARG_NONE },
+	{ "mod", VM_MOD, ARG_NONE },
+	{ "and", VM_AND, ARG_NONE },
+	{ "or", VM_OR, ARG_NONE },
+	{ "xor", VM_XOR, ARG_NONE },
+	{ "shl", VM_SHL, ARG_NONE },
+	{ "shr", VM_SHR, ARG_NONE },
+	{ "min", VM_MIN, ARG_NONE },
+	{ "max", VM_MAX, ARG_NONE },
+	{ "lt", VM_LT, ARG_NONE },
+	{ "eq", VM_EQ, ARG_NONE },
+	{ "scale", VM_SCALE, ARG_NONE },
+	{ "dup", VM_DUP, ARG_NONE },
+	{ "drop", VM_DROP, ARG_NONE },
+	{ "swap", VM_SWAP, ARG_NONE },
+	{ "over", VM_OVER, ARG_NONE },
+	{ "sin", VM_SIN, ARG_NONE },
+	{ "tri", VM_TRI, ARG_NONE },
+	{ "clamp", VM_CLAMP, ARG_NONE },
+	{ "jz", VM_JZ, ARG_LABEL },
+	{ "jmp", VM_JMP, ARG_LABEL },
+};
+
+static const char	*path = "<stdin>";
+static int		 lineno = 0;
+
+static struct label	 labels[LABELS];
+static int		 nlabels = 0;
+
+static uint8_t		 code[VM_CODEMAX];
+static int		 pc = 0;
+
+static void		 assemble(FILE *, int);
+static void		 statement(char *, int);
+static void		 label(const char *, int);
+static int		 lookup(const char *);
+static long		 number(const char *);
+static void		 emit(uint8_t);
+static void		 send(const char *, const char *);
+static void		 usage(void);
+
+static void
+emit(uint8_t byte)
+{
+	if (pc == VM_CODEMAX)
+		errx(1, "%s:%d: longer than %d bytes", path, lineno,
+		    VM_CODEMAX);
+	code[pc++] = byte;
+}
+
+static long
+number(const char *s)
+{
+	char	*end;
+	long	 v;
+
+	errno = 0;
+	v = strtol(s, &end, 0);
+	if (*s == '\0' || *end != '\0' || errno != 0 || v < 0 ||
+	    v > UINT16_MAX)
+		errx(1, "%s:%d: %s isn't a number from 0 to %d", path, lineno,
+		    s, UINT16_MAX);
+	return v;
+}
+
+static int
+lookup(const char *name)
+{
+	int	i;
+
+	for (i = 0; i < nlabels; i++)
+		if (strcmp(labels[i].name, name) == 0) return i;
+	return -1;
+}
+
+/* labels are found on the first pass and used on the second */
+static void
+label(const char *name, int final)
+{
+	if (final) return;
+
+	if (*name == '\0' || strlen(name) >= LABELMAX)
+		errx(1, "%s:%d: bad label", path, lineno);
+	if (lookup(name) >= 0)
+		errx(1, "%s:%d: %s defined twice", path, lineno, name);
+	if (nlabels == LABELS)
+		errx(1, "%s:%d: too many labels", path, lineno);
+
+	strcpy(labels[nlabels].name, name);
+	labels[nlabels++].pc = pc;
+}
+
+static void
+statement(char *line, int final)
+{
+	const struct mnemonic	*m = NULL;
+	char			*word, *colon, *arg;
+	long			 v;
+	size_t			 i;
+	int			 l;
+
+	while ((word = strsep(&line, " \t\r\n")) != NULL) {
+		if (*word == '\0') continue;
+
+		if ((colon = strchr(word, ':')) != NULL) {
+			if (colon[1] != '\0')
+				errx(1, "%s:%d: junk after %s", path, lineno,
+				    word);
+			*colon = '\0';
+			label(word, final);
+			continue;
+		}
+
+		for (i = 0; i < sizeof(mnemonics) / sizeof(*mnemonics); i++)
+			if (strcasecmp(word, mnemonics[i].name) == 0) {
+				m = &mnemonics[i];
+				break;
+			}
+
+		if (m == NULL)
+			errx(1, "%s:%d: no instruction %s", path, lineno, word);
+
+		arg = NULL;
+		if (m->arg != ARG_NONE) {
+			do arg = strsep(&line, " \t\r\n");
+			while (arg != NULL && *arg == '\0');
+
+			if (arg == NULL)
+				errx(1, "%s:%d: %s needs an argument", path,
+				    lineno, m->name);
+		}
+
+		switch (m->arg) {
+		case ARG_NUMBER:
+			if ((v = number(arg)) > UINT8_MAX) {
+				emit(VM_PUSH16);
+				emit(v >> 8);
+				emit(v);
+			} else {
+				emit(VM_PUSH);
+				emit(v);
+			}
+			break;
+		case ARG_LABEL:
+			emit(m->op);
+
+			/* the first pass only needs the size */
+			if (!final) {
+				emit(0);
+				break;
+			}
+
+			if ((l = lookup(arg)) < 0)
+				errx(1, "%s:%d: no label %s", path, lineno, arg);
+
+			v = labels[l].pc - (pc + 1);
+			if (v < 0 || v > UINT8_MAX)
+				errx(1, "%s:%d: %s is behind us or too far ahead",
+				    path, lineno, arg);
+			emit(v);
+			break;
+		default:
+			emit(m->op);
+		}
+
+		m = NULL;
+	}
+}
+
+static void
+assemble(FILE *in, int final)
+{
+	char	line[LINEMAX], *comment;
+
+	pc = 0;
+	lineno = 0;
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		lineno++;
+		if (strchr(line, '\n') == NULL && !feof(in))
+			errx(1, "%s:%d: line too long", path, lineno);
+
+		if ((comment = strchr(line, ';')) != NULL) *comment = '\0';
+		statement(line, final);
+	}
+
+	if (ferror(in)) err(1, "%s", path);
+}
+
+/* through libhim, and wait until it's all gone out */
+static void
+send(const char *host, const char *port)
+{
+	struct him_callbacks	 cb = { 0 };
+	struct him_client	*c;
+	int			 waited = 0;
+
+	if ((c = him_open(host, port, &cb, NULL)) == NULL)
+		err(1, "him_open");
+
+	while (him_state(c) != HIM_CONNECTED) {
+		if (waited > SEND_TIMEOUT_MS)
+			errx(1, "can't reach %s:%s", host, port);
+		him_dispatch(c, 100);
+		waited += 100;
+	}
+
+	if (him_effect(c, code, pc) < 0) err(1, "him_effect");
+
+	while (him_pending(c) > 0) {
+		if (waited > SEND_TIMEOUT_MS)
+			errx(1, "%s:%s isn't taking it", host, port);
+		if (him_dispatch(c, 100) < 0) err(1, "him_dispatch");
+		waited += 100;
+	}
+
+	him_close(c);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-c] [-n leds] [-o output] "
+	    "[-s host [-p port]] [file]\n", program_invocation_short_name);
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct vm	 vm;
+	FILE		*in = stdin, *out;
+	char		*text = NULL;
+	size_t		 size = 0;
+	ssize_t		 len;
+	const char	*output = NULL, *host = NULL, *port = HIM_PORT;
+	const char	*why;
+	int		 ch, i, clear = 0, leds = 16, cost;
+
+	while ((ch = getopt(argc, argv, "cn:o:p:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			clear = 1;
+			break;
+		case 'n':
+			if ((leds = atoi(optarg)) <= 0) errx(1, "bad led count");
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 's':
+			host = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	/* -c sends no program at all, which takes it away */
+	if (clear) {
+		if (argc > 0 || output != NULL || host == NULL) usage();
+		send(host, port);
+		return 0;
+	}
+
+	if (argc > 1) usage();
+	if (argc == 1 && (in = fopen(path = argv[0], "r")) == NULL)
+		err(1, "%s", path);
+
+	/* it's read twice, and stdin may not rewind */
+	if ((len = getdelim(&text, &size, '\0', in)) <= 0) {
+		if (ferror(in)) err(1, "%s", path);
+		errx(1, "%s: no code", path);
+	}
+	if (in != stdin) fclose(in);
+	if ((in = fmemopen(text, len, "r")) == NULL) err(1, "fmemopen");
+
+	/* sizes and labels first, then the code they give us */
+	assemble(in, 0);
+	rewind(in);
+	assemble(in, 1);
+	fclose(in);
+	free(text);
+
+	if ((cost = vm_check(code, pc, &why)) < 0)
+		errx(1, "%s: %s", path, why);
+	if (vm_load(&vm, code, pc, leds, &why) < 0)
+		errx(1, "%s: %d instructions a pixel: %s", path, cost, why);
+
+	fprintf(stderr, "%d bytes, %d instructions a pixel, %d a frame "
+	    "at %d leds\n", pc, cost, cost * leds, leds);
+
+	if (output != NULL) {
+		if ((out = fopen(output, "w")) == NULL) err(1, "%s", output);
+		if (fwrite(code, 1, pc, out) != (size_t)pc || fclose(out) != 0)
+			err(1, "%s", output);
+	} else if (host == NULL) {
+		for (i = 0; i < pc; i++)
+			printf("%02x%s", code[i], (i + 1 == pc) ? "\n" : " ");
+	}
+
+	if (host != NULL) send(host, port);
+	return 0;
+}
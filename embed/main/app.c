@@ -39,17 +39,44 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <FreeRTOS/FreeRTOS.h>
+#include <FreeRTOS/task.h>
+
+#include "esp_attr.h"
+#include "esp_random.h"
+
+#include "frame.h"
 #include "him.h"
 
+/* survives esp_restart, so a hint from the server
+ * carries over the reboot we do when it goes away
+ */
+#define HINT_MAGIC	0x68696d21
+
 LOG_SET_TAG("app");
 
-static int	sockfd = -1;
+static int			sockfd = -1;
+static uint32_t			lampid;
+static RTC_NOINIT_ATTR uint32_t	hintmagic;
+static RTC_NOINIT_ATTR uint32_t	hintwindow;
 
-esp_err_t
-app_init(void)
+static esp_err_t	app_connect(void);
+static void		app_jitter(uint32_t);
+static void		app_readall(void *, size_t);
+static void		app_effect(void);
+
+static void
+app_jitter(uint32_t ms)
+{
+	if (ms > 0) vTaskDelay(pdMS_TO_TICKS(esp_random() % ms) + 1);
+}
+
+static esp_err_t
+app_connect(void)
 {
 	struct hostent		*host;
 	struct sockaddr_in	 sa;
+	uint8_t			 ident[6];
 
 	sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (sockfd < 0) CATCH_RETURN(errno);
@@ -69,15 +96,111 @@ app_init(void)
 	if (connect(sockfd, (struct sockaddr *)&sa,
 	    sizeof(struct sockaddr_in)) < 0) {
 		close(sockfd);
+		sockfd = -1;
+		CATCH_RETURN(errno);
+	}
+
+	/* first thing, say who we are, and that we'll take
+	 * effects as well as colors
+	 */
+	ident[0] = APP_OP_IDENT;
+	ident[1] = lampid >> 24;
+	ident[2] = lampid >> 16;
+	ident[3] = lampid >> 8;
+	ident[4] = lampid;
+	ident[5] = APP_OP_EFFECTS;
+
+	if (write(sockfd, ident, sizeof(ident)) != sizeof(ident)) {
+		close(sockfd);
+		sockfd = -1;
 		CATCH_RETURN(errno);
 	}
 
 	return 0;
 }
 
+esp_err_t
+app_init(void)
+{
+	uint32_t	delay = APP_RETRY_BASE_MS;
+	int		i;
+
+	lampid = fs_read_lampid();
+
+	/* the server told us how far to spread out
+	 * before it went away - respect that first
+	 */
+	if (hintmagic == HINT_MAGIC) {
+		ESP_LOGI(TAG, "backing off within %lus", hintwindow);
+		app_jitter(hintwindow * SCHED_MS_PER_S);
+		hintmagic = 0;
+	}
+
+	/* then back off exponentially, with full jitter,
+	 * rather than hammering a server that's drowning
+	 */
+	for (i = 0; i < APP_RETRIES; i++) {
+		if (app_connect() == 0) return 0;
+
+		ESP_LOGW(TAG, "connect attempt %d failed", i + 1);
+		app_jitter(delay);
+
+		delay *= 2;
+		if (delay > APP_RETRY_MAX_MS) delay = APP_RETRY_MAX_MS;
+	}
+
+	CATCH_RETURN(ESP_FAIL);
+}
+
+/* exactly len bytes, or we're not talking to the server
+ * anymore
+ */
+static void
+app_readall(void *buf, size_t len)
+{
+	uint8_t	*p = buf;
+	ssize_t	 bytesread;
+
+	while (len > 0) {
+		bytesread = read(sockfd, p, len);
+		if (bytesread < 0) CATCH_DIE(errno);
+		else if (bytesread == 0) {
+			ESP_LOGI(TAG, "server closed connection");
+			reboot(NULL);
+		}
+
+		p += bytesread;
+		len -= bytesread;
+	}
+}
+
+/* a length and that much program. one we can't run leaves
+ * the lamp doing what it was
+ */
+static void
+app_effect(void)
+{
+	uint8_t	code[VM_CODEMAX];
+	uint8_t	len;
+
+	app_readall(&len, sizeof(uint8_t));
+	if (len > VM_CODEMAX) {
+		ESP_LOGW(TAG, "effect too long, dropping connection");
+		reboot(NULL);
+	}
+
+	app_readall(code, len);
+	led_program(code, len);
+}
+
 void
 app_readloop(void *arg)
 {
+	/* connecting can take a while if we're backing off,
+	 * so do it here rather than in the event loop
+	 */
+	CATCH_DIE(app_init());
+
 	for (;;) {
 		ssize_t	bytesread;
 		uint8_t	newcolor;
@@ -92,6 +215,18 @@ app_readloop(void *arg)
 			reboot(NULL);
 		}
 
+		if (newcolor == APP_CTL_EFFECT) {
+			app_effect();
+			continue;
+		}
+
+		if (newcolor & APP_CTL_BACKOFF) {
+			hintwindow = newcolor & APP_BACKOFF_MASK;
+			hintmagic = HINT_MAGIC;
+			ESP_LOGI(TAG, "server asked for %lus backoff", hintwindow);
+			continue;
+		}
+
 		ESP_LOGI(TAG, "changing color to %d", newcolor);
 		led_spin(newcolor);
 	}
@@ -102,14 +237,17 @@ app_readloop(void *arg)
 esp_err_t
 app_changecolor(void)
 {
-	uint8_t	newcolor;
+	uint8_t	op = APP_OP_ADVANCE;
 	ssize_t	byteswritten;
 
-	newcolor = led_currentcolor() + 1;
-	if (newcolor >= LED_COLOR_MAX) newcolor = 1;
+	if (sockfd < 0) {
+		ESP_LOGW(TAG, "not connected yet, dropping color change");
+		return ESP_ERR_INVALID_STATE;
+	}
 
-	ESP_LOGI(TAG, "telling the server about candidate new color %d", newcolor);
-	byteswritten = write(sockfd, &newcolor, sizeof(uint8_t));
+	ESP_LOGI(TAG, "asking the server to advance from %d",
+	    led_currentcolor());
+	byteswritten = write(sockfd, &op, sizeof(uint8_t));
 
 	if (byteswritten < 0) CATCH_DIE(errno);
 	else if (byteswritten == 0) {
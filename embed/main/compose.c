@@ -0,0 +1,182 @@
+/* compose.c
+ * layers of per-frame and per-pixel shaders, composited
+ *
+ * (c) jay lang, 2023
+ * redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* a frame is a stack of layers, bottom up. each layer gets a
+ * per-frame callback and a per-pixel shader, both told the time
+ * and how many frames it's been since the layer was set, and
+ * renders into a scratch row. the row then goes onto the frame
+ * so far with the layer's blend mode and opacity
+ *
+ * the engine owns the frame: effects never touch the output,
+ * and nothing here knows how many frames per second it's asked
+ * for or where they go after. it does know when a new frame
+ * can't look any different, so whoever's asking can stop
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "frame.h"
+
+static void		blend(struct pixel *, struct pixel *, int, int,
+			    uint8_t);
+
+/* src onto dst, a whole row at a time through fb.c. src is
+ * the layer's scratch row, and gets used up
+ */
+static void
+blend(struct pixel *dst, struct pixel *src, int n, int mode, uint8_t a)
+{
+	switch (mode) {
+	case COMPOSE_ADD:
+		fb_scale(src, n, a);
+		fb_add(dst, src, n);
+		break;
+	case COMPOSE_MULTIPLY:
+		/* at partial opacity, fade toward leaving things
+		 * as they are: 255 - (255 - src) * a
+		 */
+		if (a != 255) {
+			fb_invert(src, n);
+			fb_scale(src, n, a);
+			fb_invert(src, n);
+		}
+		fb_multiply(dst, src, n);
+		break;
+	case COMPOSE_MAX:
+		fb_scale(src, n, a);
+		fb_max(dst, src, n);
+		break;
+	default:
+		fb_lerp(dst, src, n, a);
+	}
+}
+
+/* scratch holds nleds pixels, and is the caller's so nothing
+ * here has to allocate
+ */
+void
+compose_init(struct compose *c, int nleds, struct pixel *scratch)
+{
+	memset(c, 0, sizeof(struct compose));
+	c->nleds = nleds;
+	c->scratch = scratch;
+}
+
+void
+compose_set(struct compose *c, int z, compose_frame_fn frame,
+    compose_pixel_fn pixel, int mode, uint8_t opacity, void *arg,
+    uint64_t now)
+{
+	struct compose_layer	*l = &c->layers[z];
+
+	l->frame = frame;
+	l->pixel = pixel;
+	l->blend = mode;
+	l->opacity = opacity;
+	l->arg = arg;
+	l->started = now;
+	l->frames = 0;
+	l->active = 1;
+	l->still = 0;
+	c->dirty = 1;
+}
+
+void
+compose_clear(struct compose *c, int z)
+{
+	c->layers[z].active = 0;
+	c->dirty = 1;
+}
+
+/* layer z looks the same every frame until it's set again,
+ * so it alone never needs a new one
+ */
+void
+compose_still(struct compose *c, int z)
+{
+	c->layers[z].still = 1;
+}
+
+/* something a layer reads changed under it */
+void
+compose_touch(struct compose *c)
+{
+	c->dirty = 1;
+}
+
+/* whether the next frame could come out any different from the
+ * last: if not, there's no need to render it at all
+ */
+int
+compose_pending(const struct compose *c)
+{
+	int	z;
+
+	if (c->dirty) return 1;
+
+	for (z = 0; z < COMPOSE_LAYERS; z++)
+		if (c->layers[z].active && !c->layers[z].still) return 1;
+	return 0;
+}
+
+/* the frame for now, at out. nonzero if something was set,
+ * cleared or touched since the last one, so it's new for sure,
+ * however much it looks like the last
+ */
+int
+compose_render(struct compose *c, struct pixel *out, uint64_t now)
+{
+	struct compose_layer	*l;
+	struct compose_time	 t;
+	int			 z, i, dirty = c->dirty;
+
+	memset(out, 0, c->nleds * sizeof(struct pixel));
+	c->dirty = 0;
+
+	for (z = 0; z < COMPOSE_LAYERS; z++) {
+		l = &c->layers[z];
+		if (!l->active) continue;
+
+		t.now = now;
+		t.elapsed = now - l->started;
+		t.frame = l->frames++;
+
+		if (l->frame != NULL) l->frame(l, c->scratch, c->nleds, &t);
+		if (l->pixel != NULL)
+			for (i = 0; i < c->nleds; i++)
+				c->scratch[i] = l->pixel(l, i, &t);
+
+		blend(out, c->scratch, c->nleds, l->blend, l->opacity);
+	}
+
+	return dirty;
+}
@@ -0,0 +1,257 @@
+/* effect.c
+ * solid, blink and spin, as shaders
+ *
+ * (c) jay lang, 2023
+ * redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* the lamp's own effects, as layers for compose.c. each is a
+ * function of how long it's been running, not of how many
+ * frames it's been, so it looks the same at any frame rate:
+ * more frames just sample it more finely. time goes in as 0.16
+ * fixed point fractions of a cycle, and motion as 24.8 fixed
+ * point, so slow effects still move a little every frame
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "frame.h"
+
+#define EFFECT_FRAC		16
+#define EFFECT_ONE		(1 << EFFECT_FRAC)
+
+static uint32_t		effect_cycle(uint64_t, uint32_t);
+static uint8_t		effect_scale(uint32_t);
+static void		effect_indices(struct effect *);
+static uint8_t		effect_gradient(const struct effect *, int);
+
+static struct pixel	solid_pixel(struct compose_layer *, int,
+			    const struct compose_time *);
+static void		blink_frame(struct compose_layer *, struct pixel *,
+			    int, const struct compose_time *);
+static struct pixel	blink_pixel(struct compose_layer *, int,
+			    const struct compose_time *);
+static void		spin_frame(struct compose_layer *, struct pixel *,
+			    int, const struct compose_time *);
+static struct pixel	spin_pixel(struct compose_layer *, int,
+			    const struct compose_time *);
+static struct pixel	program_pixel(struct compose_layer *, int,
+			    const struct compose_time *);
+
+/* how far through a cycle of period us we are at elapsed, as
+ * a fraction of EFFECT_ONE
+ */
+static uint32_t
+effect_cycle(uint64_t elapsed, uint32_t period)
+{
+	return ((elapsed % period) << EFFECT_FRAC) / period;
+}
+
+/* a fraction of EFFECT_ONE, as a level out of 255, rounded */
+static uint8_t
+effect_scale(uint32_t frac)
+{
+	return (frac * 255 + EFFECT_ONE / 2) >> EFFECT_FRAC;
+}
+
+/* which two channels a spin moves between: both halves of a
+ * composite color, or a primary and the one after it
+ */
+static void
+effect_indices(struct effect *e)
+{
+	uint8_t	*packed = (uint8_t *)&e->ref;
+	int	 i;
+
+	for (i = 0; i < 3; i++)
+		if (packed[i] && packed[(i + 1) % 3]) {
+			e->primary = (i + 1) % 3;
+			e->secondary = i;
+			return;
+		}
+
+	for (i = 0; i < 3; i++) if (packed[i]) break;
+	e->secondary = (i + 1) % 3;
+	e->primary = i % 3;
+}
+
+/* the spin's secondary channel around the ring: up to full
+ * over half of it and back down over the other half, in steps
+ * of delta an LED, shifted along by phase
+ */
+static uint8_t
+effect_gradient(const struct effect *e, int i)
+{
+	uint32_t	period = e->period << 8, x;
+
+	x = ((uint32_t)i * e->delta * 256 + e->phase) % period;
+	if (x > period / 2) x = period - x;
+
+	x = (x + 128) >> 8;
+	return (x > 255) ? 255 : x;
+}
+
+static struct pixel
+solid_pixel(struct compose_layer *l, int i, const struct compose_time *t)
+{
+	return ((struct effect *)l->arg)->ref;
+	(void)i;
+	(void)t;
+}
+
+void
+effect_solid(struct compose *c, int z, struct effect *e, struct pixel p,
+    uint64_t now)
+{
+	memset(e, 0, sizeof(struct effect));
+	e->ref = p;
+	compose_set(c, z, NULL, solid_pixel, COMPOSE_OVER, 255, e, now);
+	compose_still(c, z);
+}
+
+/* all the way up in EFFECT_RAMP_US, and back down in as long */
+static void
+blink_frame(struct compose_layer *l, struct pixel *row, int n,
+    const struct compose_time *t)
+{
+	struct effect	*e = (struct effect *)l->arg;
+	uint32_t	 f;
+
+	f = effect_cycle(t->elapsed, 2 * EFFECT_RAMP_US);
+	e->level = effect_scale((f < EFFECT_ONE / 2) ?
+	    2 * f : 2 * (EFFECT_ONE - f));
+
+	(void)row;
+	(void)n;
+}
+
+static struct pixel
+blink_pixel(struct compose_layer *l, int i, const struct compose_time *t)
+{
+	struct effect	*e = (struct effect *)l->arg;
+	struct pixel	 p;
+
+	p.r = (e->ref.r > 0) ? e->level : 0;
+	p.g = (e->ref.g > 0) ? e->level : 0;
+	p.b = (e->ref.b > 0) ? e->level : 0;
+	return p;
+
+	(void)i;
+	(void)t;
+}
+
+void
+effect_blink(struct compose *c, int z, struct effect *e, struct pixel p,
+    uint64_t now)
+{
+	memset(e, 0, sizeof(struct effect));
+	e->ref = p;
+	compose_set(c, z, blink_frame, blink_pixel, COMPOSE_OVER, 255, e, now);
+}
+
+/* ramp the primary channel up over EFFECT_RAMP_US, with the
+ * gradient rising out of it as it nears full, then turn the
+ * gradient EFFECT_SPIN_RATE steps a second
+ */
+static void
+spin_frame(struct compose_layer *l, struct pixel *row, int n,
+    const struct compose_time *t)
+{
+	struct effect	*e = (struct effect *)l->arg;
+	uint64_t	 turning;
+
+	if (t->elapsed < EFFECT_RAMP_US) {
+		e->level = effect_scale((t->elapsed << EFFECT_FRAC) /
+		    EFFECT_RAMP_US);
+		e->phase = 0;
+		return;
+	}
+
+	/* the whole turn, from the start, every time: nothing to
+	 * drift however the frames fall
+	 */
+	turning = t->elapsed - EFFECT_RAMP_US;
+	e->level = 255;
+	e->phase = (turning * EFFECT_SPIN_RATE * 256 / 1000000) %
+	    ((uint64_t)e->period << 8);
+
+	(void)row;
+	(void)n;
+}
+
+static struct pixel
+spin_pixel(struct compose_layer *l, int i, const struct compose_time *t)
+{
+	struct effect	*e = (struct effect *)l->arg;
+	struct pixel	 p = { 0 };
+	uint8_t		*packed = (uint8_t *)&p;
+	int		 v;
+
+	v = e->level + effect_gradient(e, i) - 255;
+	packed[e->primary] = e->level;
+	packed[e->secondary] = (v > 0) ? v : 0;
+	return p;
+
+	(void)t;
+}
+
+void
+effect_spin(struct compose *c, int z, struct effect *e, struct pixel p,
+    uint64_t now)
+{
+	memset(e, 0, sizeof(struct effect));
+	e->ref = p;
+	e->n = c->nleds;
+	e->delta = (e->n >= 2) ? 255 / (e->n / 2) + 1 : 255;
+	e->period = e->delta * e->n;
+	effect_indices(e);
+	compose_set(c, z, spin_frame, spin_pixel, COMPOSE_OVER, 255, e, now);
+}
+
+/* the program sees milliseconds since it was set, and ref,
+ * which can change under it as the lamp's color does
+ */
+static struct pixel
+program_pixel(struct compose_layer *l, int i, const struct compose_time *t)
+{
+	struct effect	*e = (struct effect *)l->arg;
+
+	return vm_run(e->vm, i, e->n, (uint32_t)(t->elapsed / 1000), e->ref);
+}
+
+void
+effect_program(struct compose *c, int z, struct effect *e,
+    const struct vm *vm, struct pixel p, uint64_t now)
+{
+	memset(e, 0, sizeof(struct effect));
+	e->ref = p;
+	e->n = c->nleds;
+	e->vm = vm;
+	compose_set(c, z, NULL, program_pixel, COMPOSE_OVER, 255, e, now);
+	if (!vm->timed) compose_still(c, z);
+}
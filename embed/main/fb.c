@@ -0,0 +1,303 @@
+/* fb.c
+ * kernels over whole frames
+ *
+ * (c) jay lang, 2023
+ * redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* whole-frame kernels on packed g, r, b bytes. they don't care
+ * where pixels start or stop, so each one is a pass over n * 3
+ * bytes: as many as fit in a machine word at a time (SWAR - the
+ * bytes are lanes, kept from carrying into each other), then the
+ * few left over one at a time, the same way. anything that
+ * divides by 255 rounds the way div255 does, so every kernel is
+ * bit for bit what the obvious loop over bytes would be
+ *
+ * multiplying two frames has no good word-at-a-time form, so
+ * fb_multiply is that obvious loop
+ *
+ * on the ESP32-S3, FB_PIE fills through the 128 bit vector
+ * registers instead. everything else stays on words
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frame.h"
+
+typedef uintptr_t	fb_word;
+
+/* 0x0101..., 0x8080... and 0x00ff00ff... for any word size */
+#define FB_ONES		(~(fb_word)0 / 0xff)
+#define FB_HIGH		(FB_ONES * 0x80)
+#define FB_LANES	(~(fb_word)0 / 0xffff * 0xff)
+
+#define FB_FNV_BASIS	0x811c9dc5u
+#define FB_FNV_PRIME	0x01000193u
+
+static fb_word		fb_load(const uint8_t *);
+static void		fb_store(uint8_t *, fb_word);
+static uint8_t		fb_div255(uint32_t);
+static fb_word		fb_lanes255(fb_word);
+
+/* words don't have to be aligned. memcpy is as fast as a load
+ * where that's fine, and safe where it isn't
+ */
+static fb_word
+fb_load(const uint8_t *p)
+{
+	fb_word	w;
+
+	memcpy(&w, p, sizeof(fb_word));
+	return w;
+}
+
+static void
+fb_store(uint8_t *p, fb_word w)
+{
+	memcpy(p, &w, sizeof(fb_word));
+}
+
+/* x / 255, rounded, for anything up to 255 * 255 */
+static uint8_t
+fb_div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+/* fb_div255 on every 16 bit lane at once. nothing up to
+ * 255 * 255 + 128 + 255 overflows a lane
+ */
+static fb_word
+fb_lanes255(fb_word x)
+{
+	x += FB_LANES & (FB_ONES * 0x80);
+	return ((x + ((x >> 8) & FB_LANES)) >> 8) & FB_LANES;
+}
+
+#if defined(FB_PIE) && defined(__XTENSA__)
+/* 48 bytes is both whole pixels and whole vector registers, so
+ * once dst is aligned, three registers of pattern store over and
+ * over
+ */
+static void
+fb_fill_pie(uint8_t *dst, size_t len, struct pixel p, size_t *done)
+{
+	uint8_t	 pattern[48] __attribute__((aligned(16)));
+	uint8_t	*pp = pattern;
+	size_t	 head, blocks, i;
+
+	head = (16 - ((uintptr_t)dst & 15)) & 15;
+	if (len < head + sizeof(pattern)) return;
+
+	/* the pattern starts wherever the head leaves off */
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = ((uint8_t *)&p)[(head + i) % 3];
+
+	for (i = 0; i < head; i++) dst[i] = ((uint8_t *)&p)[i % 3];
+	dst += head;
+	blocks = (len - head) / sizeof(pattern);
+
+	__asm__ __volatile__ (
+	    "ee.vld.128.ip	q0, %[pp], 16\n"
+	    "ee.vld.128.ip	q1, %[pp], 16\n"
+	    "ee.vld.128.ip	q2, %[pp], 16\n"
+	    "loopnez		%[blocks], 1f\n"
+	    "ee.vst.128.ip	q0, %[dst], 16\n"
+	    "ee.vst.128.ip	q1, %[dst], 16\n"
+	    "ee.vst.128.ip	q2, %[dst], 16\n"
+	    "1:\n"
+	    : [pp] "+r" (pp), [dst] "+r" (dst)
+	    : [blocks] "r" (blocks)
+	    : "memory");
+
+	*done = head + blocks * sizeof(pattern);
+}
+#endif
+
+void
+fb_fill(struct pixel *dst, int n, struct pixel p)
+{
+	uint8_t	*d = (uint8_t *)dst, *src = (uint8_t *)&p;
+	fb_word	 w[3];
+	size_t	 len = (size_t)n * 3, i = 0, j;
+
+#if defined(FB_PIE) && defined(__XTENSA__)
+	fb_fill_pie(d, len, p, &i);
+#endif
+
+	/* three words are whole pixels however wide words are */
+	for (j = 0; j < sizeof(w); j++) ((uint8_t *)w)[j] = src[(i + j) % 3];
+	for (; i + sizeof(w) <= len; i += sizeof(w)) memcpy(d + i, w, sizeof(w));
+
+	for (; i < len; i++) d[i] = src[i % 3];
+}
+
+/* dst + src, stuck at 255 */
+void
+fb_add(struct pixel *dst, const struct pixel *src, int n)
+{
+	uint8_t		*d = (uint8_t *)dst;
+	const uint8_t	*s = (const uint8_t *)src;
+	fb_word		 x, y, sum, half, over;
+	size_t		 len = (size_t)n * 3, i = 0;
+	unsigned int	 v;
+
+	for (; i + sizeof(fb_word) <= len; i += sizeof(fb_word)) {
+		x = fb_load(d + i);
+		y = fb_load(s + i);
+
+		/* the low seven bits add without carrying out of the
+		 * byte, and the top bits go in without a carry. a byte
+		 * overflowed if half of it would've been 128 or more
+		 */
+		sum = ((x & ~FB_HIGH) + (y & ~FB_HIGH)) ^ ((x ^ y) & FB_HIGH);
+		half = (x & y) + (((x ^ y) >> 1) & ~FB_HIGH);
+		over = ((half & FB_HIGH) >> 7) * 0xff;
+
+		fb_store(d + i, sum | over);
+	}
+
+	for (; i < len; i++) {
+		v = d[i] + s[i];
+		d[i] = (v > 255) ? 255 : v;
+	}
+}
+
+/* dst * a / 255 */
+void
+fb_scale(struct pixel *dst, int n, uint8_t a)
+{
+	uint8_t	*d = (uint8_t *)dst;
+	fb_word	 x;
+	size_t	 len = (size_t)n * 3, i = 0;
+
+	if (a == 255) return;
+
+	for (; i + sizeof(fb_word) <= len; i += sizeof(fb_word)) {
+		x = fb_load(d + i);
+		fb_store(d + i, fb_lanes255((x & FB_LANES) * a) |
+		    fb_lanes255(((x >> 8) & FB_LANES) * a) << 8);
+	}
+
+	for (; i < len; i++) d[i] = fb_div255(d[i] * a);
+}
+
+/* dst, t / 255 of the way to src */
+void
+fb_lerp(struct pixel *dst, const struct pixel *src, int n, uint8_t t)
+{
+	uint8_t		*d = (uint8_t *)dst;
+	const uint8_t	*s = (const uint8_t *)src;
+	fb_word		 x, y, lo, hi;
+	size_t		 len = (size_t)n * 3, i = 0;
+	uint8_t		 u = 255 - t;
+
+	for (; i + sizeof(fb_word) <= len; i += sizeof(fb_word)) {
+		x = fb_load(d + i);
+		y = fb_load(s + i);
+
+		lo = (x & FB_LANES) * u + (y & FB_LANES) * t;
+		hi = ((x >> 8) & FB_LANES) * u + ((y >> 8) & FB_LANES) * t;
+		fb_store(d + i, fb_lanes255(lo) | fb_lanes255(hi) << 8);
+	}
+
+	for (; i < len; i++) d[i] = fb_div255(d[i] * u + s[i] * t);
+}
+
+/* the brighter of dst and src */
+void
+fb_max(struct pixel *dst, const struct pixel *src, int n)
+{
+	uint8_t		*d = (uint8_t *)dst;
+	const uint8_t	*s = (const uint8_t *)src;
+	fb_word		 x, y, low, ge, keep;
+	size_t		 len = (size_t)n * 3, i = 0;
+
+	for (; i + sizeof(fb_word) <= len; i += sizeof(fb_word)) {
+		x = fb_load(d + i);
+		y = fb_load(s + i);
+
+		/* which low seven bits are >=, then settle it by
+		 * the top bits where those differ
+		 */
+		low = (x | FB_HIGH) - (y & ~FB_HIGH);
+		ge = ((x & ~y) | (~(x ^ y) & low)) & FB_HIGH;
+		keep = (ge >> 7) * 0xff;
+
+		fb_store(d + i, (x & keep) | (y & ~keep));
+	}
+
+	for (; i < len; i++) if (s[i] > d[i]) d[i] = s[i];
+}
+
+/* dst * src / 255 */
+void
+fb_multiply(struct pixel *dst, const struct pixel *src, int n)
+{
+	uint8_t		*d = (uint8_t *)dst;
+	const uint8_t	*s = (const uint8_t *)src;
+	size_t		 len = (size_t)n * 3, i;
+
+	for (i = 0; i < len; i++) d[i] = fb_div255(d[i] * s[i]);
+}
+
+/* 255 - dst */
+void
+fb_invert(struct pixel *dst, int n)
+{
+	uint8_t	*d = (uint8_t *)dst;
+	size_t	 len = (size_t)n * 3, i = 0;
+
+	for (; i + sizeof(fb_word) <= len; i += sizeof(fb_word))
+		fb_store(d + i, ~fb_load(d + i));
+
+	for (; i < len; i++) d[i] = ~d[i];
+}
+
+/* a fingerprint of a frame, to tell whether it's changed:
+ * FNV-1a, 32 bits at a time. every step is one to one in the
+ * word it takes, so two frames that only differ inside one
+ * word never come out the same
+ */
+uint32_t
+fb_hash(const struct pixel *src, int n)
+{
+	const uint8_t	*s = (const uint8_t *)src;
+	size_t		 len = (size_t)n * 3, i = 0;
+	uint32_t	 h = FB_FNV_BASIS, w;
+
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, s + i, sizeof(w));
+		h = (h ^ w) * FB_FNV_PRIME;
+	}
+
+	for (; i < len; i++) h = (h ^ s[i]) * FB_FNV_PRIME;
+	return h;
+}
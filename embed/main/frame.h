@@ -0,0 +1,330 @@
+/* frame.h
+ * host-safe pieces of the LED pipeline
+ *
+ * (c) jay lang, 2023
+ * redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* the frame engine: everything that turns effects into
+ * pixels, without touching the chip. nothing in here includes
+ * anything from esp-idf, so the same files build on a desktop
+ * in ../../ledbench, where they're checked and timed
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* in the order the WS2812s want them on the wire */
+struct __attribute__((packed)) pixel {
+	uint8_t	g;
+	uint8_t	r;
+	uint8_t	b;
+};
+
+/* compose.c */
+#define COMPOSE_LAYERS		4
+
+/* how a layer goes onto whatever is under it */
+#define COMPOSE_OVER		0	/* lerp by opacity */
+#define COMPOSE_ADD		1	/* saturating add, scaled by opacity */
+#define COMPOSE_MULTIPLY	2	/* 255 is "leave it", 0 is black */
+#define COMPOSE_MAX		3	/* brighter channel wins */
+
+struct compose_time {
+	uint64_t	now;		/* us, same clock for every layer */
+	uint64_t	elapsed;	/* us since the layer was set */
+	uint32_t	frame;		/* frames since the layer was set */
+};
+
+struct compose_layer;
+
+/* once per frame, before any pixels. row is the layer's own
+ * scratch row, which the callback can fill itself if there's
+ * no pixel shader
+ */
+typedef void	(*compose_frame_fn)(struct compose_layer *, struct pixel *,
+		    int, const struct compose_time *);
+
+/* once per pixel per frame, with the pixel's index */
+typedef struct pixel
+		(*compose_pixel_fn)(struct compose_layer *, int,
+		    const struct compose_time *);
+
+struct compose_layer {
+	compose_frame_fn	 frame;
+	compose_pixel_fn	 pixel;
+	int			 blend;
+	uint8_t			 opacity;
+	void			*arg;
+
+	int			 active;
+	int			 still;		/* same every frame */
+	uint64_t		 started;
+	uint32_t		 frames;
+};
+
+struct compose {
+	struct compose_layer	 layers[COMPOSE_LAYERS];	/* bottom up */
+	struct pixel		*scratch;
+	int			 nleds;
+
+	/* something changed since the last frame */
+	int			 dirty;
+};
+
+void		compose_init(struct compose *, int, struct pixel *);
+void		compose_set(struct compose *, int, compose_frame_fn,
+		    compose_pixel_fn, int, uint8_t, void *, uint64_t);
+void		compose_clear(struct compose *, int);
+void		compose_still(struct compose *, int);
+void		compose_touch(struct compose *);
+int		compose_pending(const struct compose *);
+int		compose_render(struct compose *, struct pixel *, uint64_t);
+
+/* fb.c */
+void		fb_fill(struct pixel *, int, struct pixel);
+void		fb_add(struct pixel *, const struct pixel *, int);
+void		fb_scale(struct pixel *, int, uint8_t);
+void		fb_lerp(struct pixel *, const struct pixel *, int, uint8_t);
+void		fb_max(struct pixel *, const struct pixel *, int);
+void		fb_multiply(struct pixel *, const struct pixel *, int);
+void		fb_invert(struct pixel *, int);
+uint32_t	fb_hash(const struct pixel *, int);
+
+/* palette.c */
+#define PALETTE_BITS_MIN	4
+#define PALETTE_BITS_MAX	8
+
+/* bytes of index nleds LEDs take, bits apiece */
+#define PALETTE_BYTES(BITS, N)	(((size_t)(N) * (BITS) + 7) / 8)
+
+void		palette_map(uint8_t *, int, int, int, int);
+int		palette_get(const uint8_t *, int, int);
+void		palette_expand(const struct pixel *, const uint8_t *, int, int,
+		    struct pixel *);
+
+/* pipe.c */
+#define PIPE_BUFFERS		3
+
+#define PIPE_FREE		0
+#define PIPE_RENDERING		1
+#define PIPE_QUEUED		2
+
+struct pipe {
+	struct pixel	*bufs[PIPE_BUFFERS];
+	int		 state[PIPE_BUFFERS];
+	int		 nbufs;
+
+	/* queued buffers, oldest first */
+	int		 queue[PIPE_BUFFERS];
+	int		 head, queued;
+
+	uint32_t	 submitted, done, skipped;
+	int		 deepest;	/* most ever queued at once */
+};
+
+void		 pipe_init(struct pipe *, struct pixel *, int, int);
+struct pixel	*pipe_acquire(struct pipe *);
+int		 pipe_submit(struct pipe *, struct pixel *);
+int		 pipe_abandon(struct pipe *, struct pixel *);
+struct pixel	*pipe_done(struct pipe *);
+
+/* when frames go out: on a grid of slots every period us, each
+ * rendered for its slot and sent as close to it as we can.
+ * how close is the jitter
+ */
+struct pace {
+	uint64_t	 period;
+	uint64_t	 next;		/* the slot the next frame gets */
+
+	uint32_t	 frames;
+	uint32_t	 missed;	/* slots that went by with no frame */
+	uint32_t	 skipped;	/* slots with nothing new to send */
+	uint32_t	 jittermax;	/* us */
+	uint64_t	 jittersum;
+};
+
+void		 pace_init(struct pace *, uint64_t, uint64_t);
+void		 pace_restart(struct pace *, uint64_t);
+uint64_t	 pace_slot(struct pace *, uint64_t);
+void		 pace_sent(struct pace *, uint64_t);
+void		 pace_skip(struct pace *);
+
+/* ws2812.c */
+#define WS2812_SYMBOLS		8
+
+/* symbols of RMT memory a strip is streamed through: one half
+ * goes out while the other's encoded into. each half is whole
+ * bytes, so a refill never leaves a gap
+ */
+#define WS2812_BLOCK		512
+
+/* the RMT's symbol word: durations are 15 bits, in ticks */
+#define WS2812_SYMBOL(L0, D0, L1, D1)					\
+	((uint32_t)(D0) | (uint32_t)(L0) << 15 |			\
+	(uint32_t)(D1) << 16 | (uint32_t)(L1) << 31)
+
+struct ws2812 {
+	uint32_t	lut[256][WS2812_SYMBOLS];
+	uint32_t	reset;
+};
+
+void		ws2812_init(struct ws2812 *, uint16_t, uint16_t, uint16_t,
+		    uint16_t, uint16_t);
+size_t		ws2812_encode(const struct ws2812 *, const uint8_t *, size_t,
+		    size_t, size_t, uint32_t *, int *);
+
+/* an indexed frame, as the encoder takes it: nleds LEDs from
+ * first on, each bits wide in index, looked up in colors
+ */
+struct ws2812_indexed {
+	const struct pixel	*colors;
+	const uint8_t		*index;
+	int			 bits;
+	int			 first, nleds;
+};
+
+size_t		ws2812_encode_indexed(const struct ws2812 *,
+		    const struct ws2812_indexed *, size_t, size_t, uint32_t *,
+		    int *);
+
+/* output.c */
+#define OUTPUT_CHANNELS		3
+#define OUTPUT_FULL		255
+
+struct output {
+	uint16_t	 table[256];
+	uint8_t		 brightness;
+
+	/* left over from the last frame, a byte per subpixel */
+	uint8_t		*err;
+	int		 nleds;
+};
+
+void		output_init(struct output *, uint8_t *, int);
+void		output_brightness(struct output *, uint8_t);
+void		output_apply(struct output *, struct pixel *, int);
+
+/* vm.c */
+#define VM_CODEMAX		64
+#define VM_STACK		8
+
+/* instructions a frame, every pixel's put together */
+#define VM_BUDGET		16384
+
+/* opcodes. push and jumps take a byte after them, push16 a
+ * big endian u16
+ */
+#define VM_END			0x00
+#define VM_PUSH			0x01
+#define VM_PUSH16		0x02
+#define VM_I			0x03
+#define VM_N			0x04
+#define VM_T			0x05
+#define VM_RED			0x06
+#define VM_GREEN		0x07
+#define VM_BLUE			0x08
+
+#define VM_ADD			0x10
+#define VM_SUB			0x11
+#define VM_MUL			0x12
+#define VM_DIV			0x13
+#define VM_MOD			0x14
+#define VM_AND			0x15
+#define VM_OR			0x16
+#define VM_XOR			0x17
+#define VM_SHL			0x18
+#define VM_SHR			0x19
+#define VM_MIN			0x1a
+#define VM_MAX			0x1b
+#define VM_LT			0x1c
+#define VM_EQ			0x1d
+#define VM_SCALE		0x1e
+
+#define VM_DUP			0x20
+#define VM_DROP			0x21
+#define VM_SWAP			0x22
+#define VM_OVER			0x23
+
+#define VM_SIN			0x30
+#define VM_TRI			0x31
+#define VM_CLAMP		0x32
+
+#define VM_JZ			0x40
+#define VM_JMP			0x41
+
+struct vm {
+	uint8_t		code[VM_CODEMAX];
+	int		len;
+	int		cost;
+	int		timed;		/* reads t, so it moves */
+};
+
+int		vm_check(const uint8_t *, size_t, const char **);
+int		vm_load(struct vm *, const uint8_t *, size_t, int,
+		    const char **);
+struct pixel	vm_run(const struct vm *, int, int, uint32_t, struct pixel);
+
+/* effect.c */
+
+/* blink's rise and fall, and spin's ramp up, take this long */
+#define EFFECT_RAMP_US		1000000
+
+/* steps of the gradient a spin turns by a second. at 16 LEDs
+ * that's around the ring every six seconds
+ */
+#define EFFECT_SPIN_RATE	85
+
+struct effect {
+	struct pixel	ref;
+	int		n;
+	int		primary, secondary;
+	uint8_t		level;
+
+	/* the gradient steps delta an LED, and comes back
+	 * around every period. phase is 24.8 fixed point
+	 */
+	uint32_t	delta, period;
+	uint32_t	phase;
+
+	/* a program from the server, in place of all that */
+	const struct vm	*vm;
+};
+
+void		effect_solid(struct compose *, int, struct effect *,
+		    struct pixel, uint64_t);
+void		effect_blink(struct compose *, int, struct effect *,
+		    struct pixel, uint64_t);
+void		effect_spin(struct compose *, int, struct effect *,
+		    struct pixel, uint64_t);
+void		effect_program(struct compose *, int, struct effect *,
+		    const struct vm *, struct pixel, uint64_t);
+
+#endif /* FRAME_H */
@@ -31,6 +31,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/stat.h>
+
 #include <stdint.h>
 #include <errno.h>
 #include <stdio.h>
@@ -39,6 +41,7 @@
 
 #include "esp_spiffs.h"
 #include "esp_log.h"
+#include "esp_mac.h"
 #include "nvs_flash.h"
 
 #include "him.h"
@@ -160,4 +163,52 @@ fs_clear_credentials(void)
 {
 	remove(FS_SSIDPATH);
 	remove(FS_PASSPATH);
-}
\ No newline at end of file
+}
+
+/* decimal digits and maybe a newline, and nothing else. an
+ * empty file or one too long to be a u32 is no id at all, and
+ * neither is anything strtoul had to clamp: unsigned long is
+ * only 32 bits here, so that's the one way to tell
+ */
+uint32_t
+fs_read_lampid(void)
+{
+	char		*raw, buf[16] = { 0 }, *end;
+	uint8_t		 mac[6];
+	size_t		 rawsize;
+	unsigned long	 id;
+	struct stat	 st;
+
+	if (stat(FS_IDPATH, &st) == 0 &&
+	    (st.st_size == 0 || (size_t)st.st_size >= sizeof(buf))) {
+		ESP_LOGW(TAG, "ignoring lamp id of %ld bytes",
+		    (long)st.st_size);
+		goto mac;
+	}
+
+	CATCH_DIE(fs_slurp(FS_IDPATH, &raw, &rawsize));
+
+	if (raw != NULL) {
+		memcpy(buf, raw, (rawsize < sizeof(buf) - 1) ?
+		    rawsize : sizeof(buf) - 1);
+		free(raw);
+
+		errno = 0;
+		id = strtoul(buf, &end, 10);
+		if (buf[0] >= '0' && buf[0] <= '9' && errno != ERANGE &&
+		    id <= UINT32_MAX && (end == buf + rawsize ||
+		    (end == buf + rawsize - 1 && *end == '\n'))) {
+			ESP_LOGI(TAG, "lamp id is %lu", id);
+			return id;
+		}
+
+		ESP_LOGW(TAG, "ignoring malformed lamp id %s", buf);
+	}
+
+mac:
+	CATCH_DIE(esp_read_mac(mac, ESP_MAC_WIFI_STA));
+	id = (uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 |
+	    (uint32_t)mac[4] << 8 | mac[5];
+	ESP_LOGI(TAG, "no lamp id, using %lu from the mac", id);
+	return id;
+}
@@ -35,6 +35,7 @@
 
 #include "esp_event.h"
 #include "esp_check.h"
+#include "sdkconfig.h"
 
 /* esp error checking */
 #define CATCH_GOTO(X, LABEL) do {		\
@@ -83,11 +84,18 @@ int			reboot(void *);
 #define FS_SSIDPATH	FS_ROOT "/credentials/ssid"
 #define FS_PASSPATH	FS_ROOT "/credentials/pass"
 
+/* our lamp id, in decimal, dropped into image/ when a lamp is
+ * flashed. lamps numbered densely keep the server's presence
+ * index small; without it we make one up from the mac
+ */
+#define FS_IDPATH	FS_ROOT "/id"
+
 esp_err_t		fs_init(void);
 esp_err_t		fs_slurp(char *, char **, size_t *);
 esp_err_t		fs_write_credentials(char *, char *);
 esp_err_t		fs_read_credentials(char **, char **);
 void			fs_clear_credentials(void);
+uint32_t		fs_read_lampid(void);
 
 /* wifi.c */
 #define WIFI_SSID	"Him"
@@ -131,22 +139,57 @@ void			httpd_teardown(void);
 esp_err_t		sched_schedule(uint64_t, int (*)(void *), void *);
 
 /* rmt.c */
-#define RMT_GPIO_NUM		4
-#define RMT_NUM_LEDS		16
-
-/* we're not built to parameterize around these
- * values, we assume that they maintain these values.
- * such assumptions are inherent in e.g. the choice
- * of char arrays in led.c to encode colors
- * so, don't change the below defines
+
+/* outputs, and the pins they're on, are set from menuconfig.
+ * every output is its own strip of RMT_NUM_LEDS, and a frame is
+ * all of them end to end. the RMT's memory doesn't grow with
+ * any of it, see WS2812_BLOCK
+ */
+#define RMT_OUTPUTS		CONFIG_HIM_LED_OUTPUTS
+#define RMT_NUM_LEDS		CONFIG_HIM_LED_COUNT
+#define RMT_FRAME_LEDS		(RMT_OUTPUTS * RMT_NUM_LEDS)
+
+#if RMT_OUTPUTS == 1
+#define RMT_GPIOS		{ CONFIG_HIM_LED_GPIO0 }
+#elif RMT_OUTPUTS == 2
+#define RMT_GPIOS		{ CONFIG_HIM_LED_GPIO0, CONFIG_HIM_LED_GPIO1 }
+#elif RMT_OUTPUTS == 3
+#define RMT_GPIOS		{ CONFIG_HIM_LED_GPIO0, CONFIG_HIM_LED_GPIO1, \
+				  CONFIG_HIM_LED_GPIO2 }
+#else
+#define RMT_GPIOS		{ CONFIG_HIM_LED_GPIO0, CONFIG_HIM_LED_GPIO1, \
+				  CONFIG_HIM_LED_GPIO2, CONFIG_HIM_LED_GPIO3 }
+#endif
+
+/* pixels are 8 bit g, r, b - struct pixel in frame.h - so
+ * don't change the below defines
  */
 #define RMT_COLOR_BITS		8
 #define RMT_BITS_PER_LED	(RMT_COLOR_BITS * 3)
 #define RMT_BYTES_PER_LED	(RMT_BITS_PER_LED / 8)
 
+/* or frames are indexed, from menuconfig: a palette, and this
+ * many bits an LED saying which of its colors it shows. 0 is
+ * full color. see palette.c
+ */
+#if CONFIG_HIM_LED_FRAME_INDEX4
+#define RMT_INDEX_BITS		4
+#elif CONFIG_HIM_LED_FRAME_INDEX8
+#define RMT_INDEX_BITS		8
+#else
+#define RMT_INDEX_BITS		0
+#endif
+
+struct pixel;
+
 esp_err_t		rmt_init(void);
 void			rmt_teardown(void);
+void			rmt_ondone(int (*)(void *), void *);
 esp_err_t		rmt_enqueue(void *, size_t);
+#if RMT_INDEX_BITS
+esp_err_t		rmt_enqueue_indexed(const struct pixel *,
+			    const uint8_t *);
+#endif
 
 /* led.c */
 #define LED_COLOR_RED		1
@@ -161,15 +204,46 @@ esp_err_t		rmt_enqueue(void *, size_t);
 				 LED_COLOR_GREEN | \
 				 LED_COLOR_BLUE)
 
+/* frames a second, from menuconfig. effects run off the
+ * clock, so this only decides how smooth they are
+ */
+#define LED_FPS			CONFIG_HIM_LED_FPS
+
+/* an LED, counting across every strip, that's always off, or
+ * -1 for none, from menuconfig
+ */
+#define LED_DARK		CONFIG_HIM_LED_DARK
+
+/* where brightness starts out, from menuconfig */
+#define LED_BRIGHTNESS		CONFIG_HIM_LED_BRIGHTNESS
+#define LED_BRIGHTNESS_MAX	255
+
+/* frames that didn't go out, and why, and how well the ones
+ * that did kept time. frames go out only when they'd look
+ * different, and not at all while nothing moves
+ */
+struct led_stats {
+	uint32_t	sent;		/* handed to the RMT */
+	uint32_t	same;		/* rendered, but no different */
+	uint32_t	busy;		/* no buffer free to render into */
+	uint32_t	sleeps;		/* times we dropped to 0 fps */
+	uint32_t	wakes;
+
+	uint32_t	missed;		/* frame slots that went by */
+	uint32_t	jittermax;	/* us late, at worst */
+	uint32_t	jittermean;	/* and on average */
+	int		depth;		/* most frames ever on the wire */
+};
+
 esp_err_t		led_init(void);
 uint8_t			led_currentcolor(void);
+void			led_brightness(uint8_t);
+esp_err_t		led_program(const uint8_t *, size_t);
+void			led_stats(struct led_stats *);
 void			led_teardown(void);
 
-/* could definitely have some sort of cool callback-based
- * design here where you get a callback once every 1/60s
- * to adjust a pixel as you see fit
- * but that sounds like it would take time and my ritalin
- * only stays in effect for so long (:
+/* each of these swaps the effect layer under the frame
+ * engine (frame.h), which renders every pixel once per frame
  */
 esp_err_t		led_solid(uint8_t);
 esp_err_t		led_blink(uint8_t);
@@ -190,6 +264,36 @@ void			button_teardown(void);
 #define APP_NAME	"juliana.jtlang.dev"
 #define APP_PORT	6969
 
+/* bytes from the server with the top bit set are control,
+ * not colors. a backoff hint carries a window in seconds in
+ * the low bits - wait a random time inside it before we
+ * next connect, so the whole fleet doesn't show up at once
+ */
+#define APP_CTL_BACKOFF		0x80
+#define APP_BACKOFF_MASK	0x7f
+
+/* a press asks the server to step to whatever color comes
+ * after the one it has, so presses on two lamps at the same
+ * time both count instead of agreeing on the same next color
+ */
+#define APP_OP_ADVANCE		0x82
+
+/* and says which lamp it is, as a big endian u32, so the
+ * server can tell who's online
+ */
+#define APP_OP_IDENT		0x84
+
+/* we can run effects, see vm.c. the server sends them as
+ * APP_CTL_EFFECT, a length up to VM_CODEMAX and the program,
+ * and a length of 0 for back to our own
+ */
+#define APP_OP_EFFECTS		0x85
+#define APP_CTL_EFFECT		0x7e
+
+#define APP_RETRIES		6
+#define APP_RETRY_BASE_MS	500
+#define APP_RETRY_MAX_MS	(30 * SCHED_MS_PER_S)
+
 esp_err_t		app_init(void);
 void			app_readloop(void *);
 esp_err_t		app_changecolor(void);
@@ -1,6 +1,15 @@
 /* led.c
  * high-level interface to the LEDs
  *
+ * effects are layers in a compose.c stack, and a frame is
+ * rendered from the stack LED_FPS times a second, whatever
+ * the effect. if there's an LED_DARK, the top layer keeps it
+ * dark
+ *
+ * with indexed frames, the stack renders the palette instead:
+ * FRAME_COLORS of them, each standing for the LEDs palette_map
+ * gave it, and the LEDs are looked up as they go out
+ *
  * (c) jay lang, 2023
  * redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are met:
@@ -31,81 +40,168 @@
 
 #include <stdint.h>
 #include <errno.h>
-#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <FreeRTOS/FreeRTOS.h>
+#include <FreeRTOS/semphr.h>
+#include <FreeRTOS/task.h>
+
+#include "esp_attr.h"
+#include "esp_timer.h"
+
+#include "frame.h"
 #include "him.h"
 
-#define ACTIVE_SIZE		(RMT_NUM_LEDS * sizeof(struct pixel))
+#define LAYER_EFFECT		0
+#define LAYER_MASK		(COMPOSE_LAYERS - 1)
 
 #define STATE_SOLID		0
-#define STATE_BLINK_UP		1
-#define STATE_BLINK_DOWN	2
-#define STATE_SPIN_UP		3
-#define STATE_SPIN		4
+#define STATE_BLINK		1
+#define STATE_SPIN		2
 
-/* NOTE: must cleanly divide 255 for maximum effect */
-#define ANIMATION_FPS		85
+/* frames are made by a task of their own, above everything but
+ * the radio and the system's, so nothing else decides when they
+ * go out
+ */
+#define RENDER_PRIORITY		(configMAX_PRIORITIES - 4)
+#define RENDER_STACK		4096
 
-#define SPIN_DELTA		(255 / (RMT_NUM_LEDS / 2) + 1)
-#define SPIN_HALFWAY		(255 - (SPIN_DELTA * RMT_NUM_LEDS / 2))
-#define BLINK_INCREMENT		(255 / ANIMATION_FPS)
+/* one frame on the wire, and the next rendered while it goes */
+#define RENDER_BUFFERS		2
+
+/* what a frame is, and what the stack renders: every LED, or
+ * the palette, which only needs as many colors as there are LEDs
+ */
+#if RMT_INDEX_BITS
+#define FRAME_COLORS		((RMT_FRAME_LEDS < (1 << RMT_INDEX_BITS)) ? \
+				 RMT_FRAME_LEDS : (1 << RMT_INDEX_BITS))
+#else
+#define FRAME_COLORS		RMT_FRAME_LEDS
+#endif
+
+/* the tick that wakes the render task for a frame's slot comes
+ * straight from the timer interrupt where it can
+ */
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+#define TICK_DISPATCH		ESP_TIMER_ISR
+#else
+#define TICK_DISPATCH		ESP_TIMER_TASK
+#endif
 
 LOG_SET_TAG("led");
 
-struct __attribute__((packed)) pixel {
-	uint8_t	g;
-	uint8_t r;
-	uint8_t b;
-};
+static SemaphoreHandle_t lock = NULL;
+static int		 running = 0;
 
-static uint64_t		 epoch = 0;
-static int		 transitionpt = 0;
-static int		 primaryidx, secondaryidx;
+/* the render task, which sleeps while nothing's moving, when
+ * its frames go out, and the last frame it sent, before gamma,
+ * so it can tell when one's no different. all of it under lock
+ */
+static TaskHandle_t	 render = NULL;
+static SemaphoreHandle_t stopped = NULL;
+static esp_timer_handle_t tick = NULL;
+static int		 asleep = 0;
+static struct pace	 pace;
+static int		 sentvalid = 0;
+static uint32_t		 senthash = 0;
+static struct led_stats	 stats;
+
+static struct compose	 comp;
+static struct effect	 current;
+static struct pixel	 scratch[FRAME_COLORS];
+
+/* gamma and brightness, with each subpixel's dithering */
+static struct output	 stage;
+static uint8_t		 dither[FRAME_COLORS * OUTPUT_CHANNELS];
+
+/* pipelock keeps the transmit-done interrupt off the buffers
+ * while we're in them
+ */
+static struct pipe	 out;
+static struct pixel	 frames[RENDER_BUFFERS][FRAME_COLORS];
+static portMUX_TYPE	 pipelock = portMUX_INITIALIZER_UNLOCKED;
+
+/* which color each LED is, laid out once, and which one of
+ * them is LED_DARK's
+ */
+#if RMT_INDEX_BITS
+static uint8_t		 map[PALETTE_BYTES(RMT_INDEX_BITS, RMT_FRAME_LEDS)];
+#endif
+static int		 dark = LED_DARK;
 
 static int		 state = STATE_SOLID;
-static struct pixel	*actives = NULL;
 static struct pixel	 reference = { 0 };
 static uint8_t		 refcolor = 0;
 
-static esp_err_t	 epoch_new(uint64_t **);
+/* an effect from the server. while there is one, it's what the
+ * lamp shows, and the colors that come in only change what it
+ * sees as the lamp's color
+ */
+static struct vm	 program;
+static int		 programmed = 0;
 
 static struct pixel	 color_to_pixel(uint8_t);
-static void		 update_indices(struct pixel);
-
-static void		 prep_spin(void);
-static void		 update_spin(void);
-
-static int		 blink_cb(void *);
-static int		 spin_cb(void *);
-
-static esp_err_t
-epoch_new(uint64_t **e)
-{
-	if ((*e = malloc(sizeof(uint64_t))) == NULL)
-		CATCH_RETURN(errno);
-	**e = ++epoch;
-	return 0;
-}
+static struct pixel	 mask_pixel(struct compose_layer *, int,
+			     const struct compose_time *);
+static void		 led_effect(uint64_t);
+static void		 led_wake(void);
+static void		 led_wait(uint64_t, int);
+static void		 led_frame(void);
+static void		 led_render(void *);
+static IRAM_ATTR void	 led_tick(void *);
+static IRAM_ATTR int	 led_done(void *);
 
 esp_err_t
 led_init(void)
 {
-	esp_err_t	rv;
-
-	actives = calloc(RMT_NUM_LEDS, sizeof(struct pixel));
-	if (actives == NULL) CATCH_RETURN(errno);
-
-	if ((rv = led_solid(0)) < 0) {
-		free(actives);
-		actives = NULL;
-		CATCH_RETURN(rv);
+	esp_timer_create_args_t	cfg = { 0 };
+	struct pixel		black = { 0 };
+
+	if ((lock = xSemaphoreCreateMutex()) == NULL) CATCH_RETURN(ENOMEM);
+	if ((stopped = xSemaphoreCreateBinary()) == NULL)
+		CATCH_RETURN(ENOMEM);
+
+	cfg.callback = led_tick;
+	cfg.dispatch_method = TICK_DISPATCH;
+	cfg.name = "frame tick";
+	CATCH_RETURN(esp_timer_create(&cfg, &tick));
+
+	pipe_init(&out, &frames[0][0], RENDER_BUFFERS, FRAME_COLORS);
+	pace_init(&pace, SCHED_US_PER_S / LED_FPS, esp_timer_get_time());
+	rmt_ondone(led_done, NULL);
+
+#if RMT_INDEX_BITS
+	palette_map(map, RMT_INDEX_BITS, RMT_FRAME_LEDS, FRAME_COLORS,
+	    LED_DARK);
+	if (LED_DARK >= 0 && LED_DARK < RMT_FRAME_LEDS)
+		dark = palette_get(map, RMT_INDEX_BITS, LED_DARK);
+#endif
+
+	output_init(&stage, dither, FRAME_COLORS);
+	output_brightness(&stage, LED_BRIGHTNESS);
+
+	compose_init(&comp, FRAME_COLORS, scratch);
+	if (LED_DARK >= 0) {
+		compose_set(&comp, LAYER_MASK, NULL, mask_pixel,
+		    COMPOSE_MULTIPLY, 255, NULL, esp_timer_get_time());
+		compose_still(&comp, LAYER_MASK);
 	}
+	effect_solid(&comp, LAYER_EFFECT, &current, black,
+	    esp_timer_get_time());
 
 	refcolor = 0;
-	memset(&reference, 0, sizeof(struct pixel));
+	reference = black;
+	state = STATE_SOLID;
+
+	/* from here on, we make every frame that's different */
+	running = 1;
+	if (xTaskCreate(led_render, "render", RENDER_STACK, NULL,
+	    RENDER_PRIORITY, &render) != pdPASS) {
+		running = 0;
+		CATCH_RETURN(ENOMEM);
+	}
 
 	return 0;
 }
@@ -116,13 +212,50 @@ led_currentcolor(void)
 	return refcolor;
 }
 
+/* scales everything, 0 to LED_BRIGHTNESS_MAX, without
+ * losing any of the levels in between
+ */
+void
+led_brightness(uint8_t level)
+{
+	xSemaphoreTake(lock, portMAX_DELAY);
+	output_brightness(&stage, level);
+
+	/* the same frame comes out differently now */
+	sentvalid = 0;
+	compose_touch(&comp);
+	led_wake();
+	xSemaphoreGive(lock);
+}
+
+void
+led_stats(struct led_stats *ls)
+{
+	xSemaphoreTake(lock, portMAX_DELAY);
+	*ls = stats;
+	ls->missed = pace.missed;
+	ls->jittermax = pace.jittermax;
+	ls->jittermean = (pace.frames > 0) ? pace.jittersum / pace.frames : 0;
+	xSemaphoreGive(lock);
+
+	portENTER_CRITICAL(&pipelock);
+	ls->busy = out.skipped;
+	ls->depth = out.deepest;
+	portEXIT_CRITICAL(&pipelock);
+}
+
+/* returns once the render task's gone, so nothing's halfway
+ * into the RMT driver when it's torn down after us
+ */
 void
 led_teardown(void)
 {
-	if (actives != NULL) {
-		free(actives);
-		actives = NULL;
-	}
+	running = 0;
+	if (render == NULL) return;
+
+	xTaskNotifyGive(render);
+	xSemaphoreTake(stopped, portMAX_DELAY);
+	render = NULL;
 }
 
 static struct pixel
@@ -137,188 +270,293 @@ color_to_pixel(uint8_t color)
 	return ret;
 }
 
-static void
-update_indices(struct pixel p)
+static struct pixel
+mask_pixel(struct compose_layer *l, int i, const struct compose_time *t)
 {
-	int	 i;
-	uint8_t	*packed = (uint8_t *)&p;
-
-	/* composite colors */
-	for (i = 0; i < 3; i++)
-		if (packed[i] && packed[(i + 1) % 3]) {
-			primaryidx = (i + 1) % 3;
-			secondaryidx = i;
-			return;
-		}
+	struct pixel	white = { 255, 255, 255 }, black = { 0 };
 
-	/* primary colors */
-	for (i = 0; i < 3; i++) if (packed[i]) break;
-	secondaryidx = (i + 1) % 3;
-	primaryidx = i;
+	return (i == dark) ? black : white;
+	(void)l;
+	(void)t;
 }
 
-esp_err_t
-led_solid(uint8_t color)
+/* whatever the lamp should be showing now, from the top. call
+ * with the lock held
+ */
+static void
+led_effect(uint64_t now)
 {
-	int		 i;
-	struct pixel	 p;
-
-	/* knock out the previous effect without alloc'ing */
-	epoch++;
+	led_wake();
 
-	if (color >= LED_COLOR_MAX) CATCH_RETURN(EINVAL);
-	else p = color_to_pixel(color);
+	if (programmed) {
+		current.ref = reference;
+		compose_touch(&comp);
+		return;
+	}
 
-	for (i = 0; i < RMT_NUM_LEDS; i++) actives[i] = p;
-	actives[15].r = actives[15].g = actives[15].b = 0;
-	CATCH_RETURN(rmt_enqueue(actives, ACTIVE_SIZE));
+	switch (state) {
+	case STATE_BLINK:
+		effect_blink(&comp, LAYER_EFFECT, &current, reference, now);
+		break;
+	case STATE_SPIN:
+		effect_spin(&comp, LAYER_EFFECT, &current, reference, now);
+		break;
+	default:
+		effect_solid(&comp, LAYER_EFFECT, &current, reference, now);
+	}
+}
 
-	state = STATE_SOLID;
-	reference = p;
-	refcolor = color;
+/* if the render task's asleep, there's something new to
+ * show. call with the lock held
+ */
+static void
+led_wake(void)
+{
+	if (!asleep || render == NULL) return;
 
-	return 0;
+	asleep = 0;
+	stats.wakes++;
+	xTaskNotifyGive(render);
 }
 
-static int
-blink_cb(void *arg)
+/* until it's time for slot, and if wire, until the frame before
+ * is off the wire too. the interrupt says when the wire's free,
+ * and the tick when it's time. anything else that wakes us just
+ * goes round again, unless it's led_teardown
+ */
+static void
+led_wait(uint64_t slot, int wire)
 {
-	/* we want to go all the way down in one second,
-	 * and vice versa. this should get us there
-	 */
-	int		 i;
-	uint64_t	*myepoch = (uint64_t *)arg;
-
-	if (*myepoch != epoch) {
-		ESP_LOGI(TAG, "stopping blink epoch %llu", *myepoch);
-		free(myepoch);
-		return SCHED_STOP;
-	}
+	int64_t	early;
+	int	busy;
 
-	for (i = 0; i < RMT_NUM_LEDS; i++) {
-		if (state == STATE_BLINK_UP) {
-			actives[i].r += (reference.r > 0) * BLINK_INCREMENT;
-			actives[i].g += (reference.g > 0) * BLINK_INCREMENT;
-			actives[i].b += (reference.b > 0) * BLINK_INCREMENT;
-		} else {
-			actives[i].r -= (reference.r > 0) * BLINK_INCREMENT;
-			actives[i].g -= (reference.g > 0) * BLINK_INCREMENT;
-			actives[i].b -= (reference.b > 0) * BLINK_INCREMENT;
-		}
-	}
+	while (running) {
+		portENTER_CRITICAL(&pipelock);
+		busy = wire && out.queued > 0;
+		portEXIT_CRITICAL(&pipelock);
 
-	if (state == STATE_BLINK_UP &&
-	    (actives->r == 255 ||
-	     actives->g == 255 ||
-	     actives->b == 255))
-		state = STATE_BLINK_DOWN;
+		early = (int64_t)(slot - esp_timer_get_time());
+		if (!busy && early <= 0) return;
 
-	else if ((actives->r == 0 && reference.r != 0) ||
-	    (actives->g == 0 && reference.g != 0) ||
-	    (actives->b == 0 && reference.b != 0))
-		state = STATE_BLINK_UP;
+		if (!busy) {
+			esp_timer_stop(tick);
+			esp_timer_start_once(tick, early);
+		}
 
-	actives[15].r = actives[15].g = actives[15].b = 0;
-	rmt_enqueue(actives, ACTIVE_SIZE);
-	return SCHED_CONTINUE;
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	}
 }
 
-esp_err_t
-led_blink(uint8_t color)
+/* the next slot's frame, rendered while the last one's still
+ * going out, and sent the moment both it's time and the wire's
+ * free. only one frame is ever on the wire, so it's never more
+ * than a frame behind what it should be showing
+ */
+static void
+led_frame(void)
 {
-	struct pixel	p;
-	uint64_t       *newepoch;
+	struct pixel	*back;
+	uint64_t	 slot, at;
+	uint32_t	 hash;
+	esp_err_t	 rv;
+	int		 changed;
+
+	portENTER_CRITICAL(&pipelock);
+	back = pipe_acquire(&out);
+	portEXIT_CRITICAL(&pipelock);
+
+	/* can't happen with one on the wire, but if it does,
+	 * there will be once it's gone
+	 */
+	if (back == NULL) {
+		led_wait(0, 1);
+		return;
+	}
 
-	if (color >= LED_COLOR_MAX) CATCH_RETURN(EINVAL);
-	else p = color_to_pixel(color);
+	xSemaphoreTake(lock, portMAX_DELAY);
+	slot = pace_slot(&pace, esp_timer_get_time());
+	changed = compose_render(&comp, back, slot);
 
-	/* knock out the previous effect */
-	CATCH_RETURN(epoch_new(&newepoch));
+	/* moving, but not so it shows this frame. the LEDs keep
+	 * the last one, dithering and all. a hash can collide,
+	 * so a frame something changed for always goes: after
+	 * it, a still stack sleeps on whatever it was
+	 */
+	hash = fb_hash(back, FRAME_COLORS);
+	if (!changed && sentvalid && hash == senthash) {
+		stats.same++;
+		xSemaphoreGive(lock);
+
+		portENTER_CRITICAL(&pipelock);
+		pipe_abandon(&out, back);
+		portEXIT_CRITICAL(&pipelock);
+
+		led_wait(slot, 0);
+		xSemaphoreTake(lock, portMAX_DELAY);
+		pace_skip(&pace);
+		xSemaphoreGive(lock);
+		return;
+	}
 
-	memset(actives, 0, ACTIVE_SIZE);
-	CATCH_RETURN(rmt_enqueue(actives, ACTIVE_SIZE));
-	CATCH_RETURN(sched_schedule(SCHED_US_PER_S / ANIMATION_FPS,
-	    blink_cb, newepoch));
+	output_apply(&stage, back, FRAME_COLORS);
+	senthash = hash;
+	sentvalid = 1;
+	xSemaphoreGive(lock);
+
+	led_wait(slot, 1);
+	if (!running) {
+		portENTER_CRITICAL(&pipelock);
+		pipe_abandon(&out, back);
+		portEXIT_CRITICAL(&pipelock);
+		return;
+	}
 
-	ESP_LOGI(TAG, "starting blink during epoch %llu", *newepoch);
-	state = STATE_BLINK_UP;
-	reference = p;
-	refcolor = color;
-	return 0;
+	/* queued before it's enqueued, so it's there to be
+	 * released however soon the transmission's done
+	 */
+	portENTER_CRITICAL(&pipelock);
+	pipe_submit(&out, back);
+	portEXIT_CRITICAL(&pipelock);
+
+	at = esp_timer_get_time();
+#if RMT_INDEX_BITS
+	rv = rmt_enqueue_indexed(back, map);
+#else
+	rv = rmt_enqueue(back, sizeof(frames[0]));
+#endif
+	if (rv < 0) {
+		portENTER_CRITICAL(&pipelock);
+		pipe_abandon(&out, back);
+		portEXIT_CRITICAL(&pipelock);
+
+		/* it never got there, so don't sleep on it */
+		xSemaphoreTake(lock, portMAX_DELAY);
+		sentvalid = 0;
+		compose_touch(&comp);
+		pace_skip(&pace);
+		xSemaphoreGive(lock);
+		return;
+	}
+
+	xSemaphoreTake(lock, portMAX_DELAY);
+	pace_sent(&pace, at);
+	stats.sent++;
+	xSemaphoreGive(lock);
 }
 
 static void
-prep_spin(void)
+led_render(void *arg)
 {
-	struct pixel	 refcopy;
-	uint8_t		*packed, *rpacked;
-	int	 	 i;
+	int	idle;
+
+	while (running) {
+		/* nothing's moving and nothing's changed, so what's
+		 * on the LEDs is what we'd send. sleep until there's
+		 * something new: the lock keeps a wake from getting
+		 * in before we've said we're asleep
+		 */
+		xSemaphoreTake(lock, portMAX_DELAY);
+		if ((idle = !compose_pending(&comp))) {
+			asleep = 1;
+			stats.sleeps++;
+			ESP_LOGD(TAG, "idle after %lu frames, %lu unchanged",
+			    stats.sent + stats.same, stats.same);
+		}
+		xSemaphoreGive(lock);
 
-	for (i = 0; i < RMT_NUM_LEDS; i++) {
-		refcopy = reference;
+		if (!idle) {
+			led_frame();
+			continue;
+		}
 
-		rpacked = (uint8_t *)(&refcopy);
-		packed = (uint8_t *)(&actives[i]);
+		while (running) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-		if (i < RMT_NUM_LEDS / 2) rpacked[secondaryidx] = i * SPIN_DELTA;
-		else rpacked[secondaryidx] = 255 - ((i - (RMT_NUM_LEDS / 2)) * SPIN_DELTA);
+			xSemaphoreTake(lock, portMAX_DELAY);
+			idle = asleep;
+			if (!idle) pace_restart(&pace, esp_timer_get_time());
+			xSemaphoreGive(lock);
 
-		packed[primaryidx] += BLINK_INCREMENT;
-		if (packed[primaryidx] > 255 - rpacked[secondaryidx])
-			packed[secondaryidx] = packed[primaryidx] - (255 - rpacked[secondaryidx]);
-		if (packed[primaryidx] == 255) state = STATE_SPIN;
+			if (!idle) break;
+		}
 	}
+
+	esp_timer_stop(tick);
+	xSemaphoreGive(stopped);
+	vTaskDelete(NULL);
+	(void)arg;
 }
 
+/* a frame's slot has come */
 static void
-update_spin(void)
+led_tick(void *arg)
 {
-	int		 i, cnt = 0;
-	uint8_t		*packed;
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+	BaseType_t	woken = pdFALSE;
+
+	vTaskNotifyGiveFromISR(render, &woken);
+	if (woken == pdTRUE) esp_timer_isr_dispatch_need_yield();
+#else
+	xTaskNotifyGive(render);
+#endif
+	(void)arg;
+}
 
-	for (i = transitionpt; cnt < RMT_NUM_LEDS - 1; cnt++) {
-		packed = (uint8_t *)(&actives[i]);
-		packed[secondaryidx] += (cnt < RMT_NUM_LEDS / 2) ? 1 : -1;
-		i = (i + 1) % RMT_NUM_LEDS;
-	}
+/* the frame on the wire is done, so the next can go */
+static int
+led_done(void *arg)
+{
+	BaseType_t	woken = pdFALSE;
 
-	packed = (uint8_t *)(&actives[i]);
-	packed[secondaryidx] -= 1;
-	if (packed[secondaryidx] == 0) {
-		ESP_LOGW(TAG, "transition point -> %d", i);
-		transitionpt = i;
-	}
-}
+	portENTER_CRITICAL_ISR(&pipelock);
+	pipe_done(&out);
+	portEXIT_CRITICAL_ISR(&pipelock);
 
+	if (render != NULL) vTaskNotifyGiveFromISR(render, &woken);
+	return woken == pdTRUE;
+	(void)arg;
+}
 
-static int
-spin_cb(void *arg)
+esp_err_t
+led_solid(uint8_t color)
 {
-	uint64_t	*myepoch = (uint64_t *)arg;
-	struct pixel	 hack;
+	struct pixel	p;
 
-	if (*myepoch != epoch) {
-		ESP_LOGI(TAG, "stopping spin during epoch %llu", *myepoch);
-		free(myepoch);
-		return SCHED_STOP;
-	}
+	if (color >= LED_COLOR_MAX) CATCH_RETURN(EINVAL);
+	else p = color_to_pixel(color);
 
-	if (state == STATE_SPIN) update_spin();
-	else prep_spin();
+	xSemaphoreTake(lock, portMAX_DELAY);
+	state = STATE_SOLID;
+	reference = p;
+	refcolor = color;
+	led_effect(esp_timer_get_time());
+	xSemaphoreGive(lock);
 
+	return 0;
+}
 
-	hack = actives[15];
-	actives[15].r = actives[15].g = actives[15].b = 0;
-	rmt_enqueue(actives, ACTIVE_SIZE);
-	actives[15] = hack;
+esp_err_t
+led_blink(uint8_t color)
+{
+	struct pixel	p;
+
+	if (color >= LED_COLOR_MAX) CATCH_RETURN(EINVAL);
+	else p = color_to_pixel(color);
 
-	return SCHED_CONTINUE;
+	xSemaphoreTake(lock, portMAX_DELAY);
+	state = STATE_BLINK;
+	reference = p;
+	refcolor = color;
+	led_effect(esp_timer_get_time());
+	xSemaphoreGive(lock);
+
+	ESP_LOGI(TAG, "starting blink");
+	return 0;
 }
 
 esp_err_t
 led_spin(uint8_t color)
 {
-	uint64_t	*newepoch;
 	struct pixel	 p;
 
 	if (color >= LED_COLOR_MAX) CATCH_RETURN(EINVAL);
@@ -326,23 +564,48 @@ led_spin(uint8_t color)
 
 	/* short circuit if we're already the correct color */
 	if (p.r == reference.r && p.g == reference.g && p.b == reference.b)
-		if (state == STATE_SPIN_UP || state == STATE_SPIN)
+		if (state == STATE_SPIN)
 			goto end;
 
-	/* knock out the previous effect */
-	CATCH_RETURN(epoch_new(&newepoch));
-	update_indices(p);
-
-	memset(actives, 0, ACTIVE_SIZE);
-	CATCH_RETURN(rmt_enqueue(actives, ACTIVE_SIZE));
-	CATCH_RETURN(sched_schedule(SCHED_US_PER_S / ANIMATION_FPS, spin_cb, newepoch));
-
+	xSemaphoreTake(lock, portMAX_DELAY);
 	reference = p;
 	refcolor = color;
-	state = STATE_SPIN_UP;
-	transitionpt = 0;
+	state = STATE_SPIN;
+	led_effect(esp_timer_get_time());
+	xSemaphoreGive(lock);
 
-	ESP_LOGI(TAG, "starting spin during epoch %llu", *newepoch);
+	ESP_LOGI(TAG, "starting spin");
  end:
 	return 0;
-}
\ No newline at end of file
+}
+
+/* run code from the server in place of the lamp's own effects,
+ * or go back to them if there's none
+ */
+esp_err_t
+led_program(const uint8_t *code, size_t len)
+{
+	struct vm	 next;
+	const char	*why;
+
+	if (len > 0 && vm_load(&next, code, len, FRAME_COLORS, &why) < 0) {
+		ESP_LOGW(TAG, "not running effect: %s", why);
+		CATCH_RETURN(EINVAL);
+	}
+
+	xSemaphoreTake(lock, portMAX_DELAY);
+	if (len > 0) {
+		program = next;
+		programmed = 1;
+		effect_program(&comp, LAYER_EFFECT, &current, &program,
+		    reference, esp_timer_get_time());
+		led_wake();
+	} else if (programmed) {
+		programmed = 0;
+		led_effect(esp_timer_get_time());
+	}
+	xSemaphoreGive(lock);
+
+	ESP_LOGI(TAG, "%s effect", (len > 0) ? "running" : "dropping");
+	return 0;
+}
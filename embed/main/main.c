@@ -59,7 +59,6 @@ wifi_state_changed(int connected)
 	}
 
 	ESP_LOGI(TAG, "wifi up, starting late boot activities");
-	CATCH_DIE(app_init());
 	CATCH_DIE(button_init(1));
 
 	/* never returns */
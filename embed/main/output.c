@@ -0,0 +1,89 @@
+/* output.c
+ * gamma, brightness and dithering
+ *
+ * (c) jay lang, 2023
+ * redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* what a rendered frame goes through on its way out. effects
+ * work in 0-255, as if LEDs were linear, which they're far from:
+ * so every subpixel goes through gamma_table (gamma.h), scaled
+ * by the brightness, into 8.8 fixed point light. only the whole
+ * part goes on the wire. what's left over is kept, per subpixel,
+ * and added into the next frame, so over a few frames a pixel
+ * averages out to the level it asked for, fraction and all
+ *
+ * brightness is folded into the table whenever it changes, so a
+ * subpixel costs a lookup, an add and a shift whatever it is
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frame.h"
+#include "gamma.h"
+
+/* err has room for nleds pixels of leftovers */
+void
+output_init(struct output *o, uint8_t *err, int nleds)
+{
+	o->err = err;
+	o->nleds = nleds;
+	memset(err, 0, (size_t)nleds * OUTPUT_CHANNELS);
+
+	output_brightness(o, OUTPUT_FULL);
+}
+
+/* 0 is off, and OUTPUT_FULL is the table as it is */
+void
+output_brightness(struct output *o, uint8_t level)
+{
+	int	i;
+
+	for (i = 0; i < 256; i++)
+		o->table[i] = ((uint32_t)gamma_table[i] * (level + 1)) >> 8;
+	o->brightness = level;
+}
+
+/* in place, on up to nleds pixels */
+void
+output_apply(struct output *o, struct pixel *px, int n)
+{
+	uint8_t		*sub = (uint8_t *)px, *err = o->err;
+	unsigned int	 light;
+	size_t		 i, len;
+
+	if (n > o->nleds) n = o->nleds;
+	len = (size_t)n * OUTPUT_CHANNELS;
+
+	for (i = 0; i < len; i++) {
+		light = o->table[sub[i]] + err[i];
+		sub[i] = light >> 8;
+		err[i] = light;
+	}
+}
@@ -0,0 +1,106 @@
+/* palette.c
+ * indexed frames, for strips too long to keep in full color
+ *
+ * (c) jay lang, 2023
+ * redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* an indexed frame is a palette of up to 16 or 256 colors, and
+ * an index of which one each LED shows, 4 or 8 bits apiece. 4
+ * bit indices go two to a byte, the even LED in the low nibble.
+ * the index is laid out once and left alone: effects move by
+ * changing the colors, a few of them a frame where a full frame
+ * takes every pixel, and the encoder looks each LED up as it
+ * goes out (see ws2812.c)
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+static void	palette_put(uint8_t *, int, int, int);
+
+static void
+palette_put(uint8_t *index, int bits, int i, int color)
+{
+	uint8_t	*byte;
+
+	if (bits == PALETTE_BITS_MAX) {
+		index[i] = color;
+		return;
+	}
+
+	byte = &index[i / 2];
+	if (i % 2 == 0) *byte = (*byte & 0xf0) | (color & 0x0f);
+	else *byte = (*byte & 0x0f) | (color & 0x0f) << 4;
+}
+
+/* lays nleds LEDs out over colors colors. with as many colors
+ * as LEDs, each gets its own; with more LEDs, runs of them share
+ * one, so the palette is the strip at a lower resolution. the
+ * alone LED, if there is one, keeps the last color to itself
+ */
+void
+palette_map(uint8_t *index, int bits, int nleds, int colors, int alone)
+{
+	int	i, at, spread = colors, share = nleds;
+
+	if (nleds <= colors) {
+		for (i = 0; i < nleds; i++) palette_put(index, bits, i, i);
+		return;
+	}
+
+	if (alone >= 0 && alone < nleds) {
+		spread--;
+		share--;
+	}
+
+	for (i = at = 0; i < nleds; i++) {
+		if (i == alone) palette_put(index, bits, i, colors - 1);
+		else palette_put(index, bits, i, at++ * spread / share);
+	}
+}
+
+/* which color LED i shows */
+int
+palette_get(const uint8_t *index, int bits, int i)
+{
+	if (bits == PALETTE_BITS_MAX) return index[i];
+	return (index[i / 2] >> (i % 2 * 4)) & 0x0f;
+}
+
+/* the full frame an indexed one stands for, nleds pixels at out */
+void
+palette_expand(const struct pixel *colors, const uint8_t *index, int bits,
+    int nleds, struct pixel *out)
+{
+	int	i;
+
+	for (i = 0; i < nleds; i++)
+		out[i] = colors[palette_get(index, bits, i)];
+}
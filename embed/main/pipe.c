@@ -0,0 +1,224 @@
+/* pipe.c
+ * frame buffers, and handing them to the hardware
+ *
+ * (c) jay lang, 2023
+ * redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* who owns which frame buffer. a buffer is free, being rendered
+ * into, or queued - handed to the RMT driver, which reads it out
+ * as it transmits and gives it back, oldest first, when it's
+ * done. the renderer only ever writes a free buffer, so a frame
+ * on the wire is never touched, and never copied either
+ *
+ *	free --acquire--> rendering --submit--> queued --done--> free
+ *	  ^                   |                     |
+ *	  +-----abandon-------+---------------------+
+ *
+ * with nothing free to render into, the frame is skipped rather
+ * than waited for. there's no locking in here: pipe_done comes
+ * from the transmit-done interrupt, so callers keep everything
+ * else out of its way themselves
+ *
+ * pace_* keeps the time: which slot a frame is for, and how far
+ * off it was when it went
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frame.h"
+
+/* nbufs buffers of nleds pixels each, in one block of memory
+ * the caller owns
+ */
+void
+pipe_init(struct pipe *p, struct pixel *mem, int nbufs, int nleds)
+{
+	int	i;
+
+	memset(p, 0, sizeof(struct pipe));
+	p->nbufs = (nbufs > PIPE_BUFFERS) ? PIPE_BUFFERS : nbufs;
+
+	for (i = 0; i < p->nbufs; i++) {
+		p->bufs[i] = mem + (size_t)i * nleds;
+		p->state[i] = PIPE_FREE;
+	}
+}
+
+/* a free buffer to render the next frame into, or NULL if
+ * every one of them is on its way out
+ */
+struct pixel *
+pipe_acquire(struct pipe *p)
+{
+	int	i;
+
+	for (i = 0; i < p->nbufs; i++) {
+		if (p->state[i] != PIPE_FREE) continue;
+
+		p->state[i] = PIPE_RENDERING;
+		return p->bufs[i];
+	}
+
+	p->skipped++;
+	return NULL;
+}
+
+static int
+pipe_index(struct pipe *p, struct pixel *buf, int state)
+{
+	int	i;
+
+	for (i = 0; i < p->nbufs; i++)
+		if (p->bufs[i] == buf && p->state[i] == state) return i;
+	return -1;
+}
+
+/* buf is going to the driver: it's theirs until pipe_done */
+int
+pipe_submit(struct pipe *p, struct pixel *buf)
+{
+	int	i;
+
+	if ((i = pipe_index(p, buf, PIPE_RENDERING)) < 0) return -1;
+
+	p->state[i] = PIPE_QUEUED;
+	p->queue[(p->head + p->queued) % PIPE_BUFFERS] = i;
+	p->queued++;
+	p->submitted++;
+	if (p->queued > p->deepest) p->deepest = p->queued;
+	return 0;
+}
+
+/* rendered, but it never made it to the driver: either it
+ * wasn't submitted, or it was and the driver turned it down,
+ * in which case it's still the newest thing queued
+ */
+int
+pipe_abandon(struct pipe *p, struct pixel *buf)
+{
+	int	i, tail;
+
+	if ((i = pipe_index(p, buf, PIPE_RENDERING)) >= 0) {
+		p->state[i] = PIPE_FREE;
+		return 0;
+	}
+
+	if (p->queued == 0) return -1;
+
+	tail = (p->head + p->queued - 1) % PIPE_BUFFERS;
+	if (p->bufs[p->queue[tail]] != buf) return -1;
+
+	p->state[p->queue[tail]] = PIPE_FREE;
+	p->queued--;
+	p->submitted--;
+	return 0;
+}
+
+/* the driver finished the oldest queued frame. returns it,
+ * free again, or NULL if nothing was queued
+ */
+struct pixel *
+pipe_done(struct pipe *p)
+{
+	int	i;
+
+	if (p->queued == 0) return NULL;
+
+	i = p->queue[p->head];
+	p->head = (p->head + 1) % PIPE_BUFFERS;
+	p->queued--;
+	p->done++;
+
+	p->state[i] = PIPE_FREE;
+	return p->bufs[i];
+}
+
+/* the first slot's at now */
+void
+pace_init(struct pace *pc, uint64_t period, uint64_t now)
+{
+	memset(pc, 0, sizeof(struct pace));
+	pc->period = period;
+	pc->next = now;
+}
+
+/* after sitting idle, the grid starts again from now. the
+ * slots in between weren't missed, there was nothing to show
+ */
+void
+pace_restart(struct pace *pc, uint64_t now)
+{
+	if (pc->next < now) pc->next = now;
+}
+
+/* the slot to render the next frame for. a little late is
+ * still that slot's frame, just sent late: only once the slot
+ * after it has come too is it missed, and the newest of those
+ * that have come is the one to catch up on
+ */
+uint64_t
+pace_slot(struct pace *pc, uint64_t now)
+{
+	uint64_t	behind;
+
+	if (now >= pc->next + pc->period) {
+		behind = (now - pc->next) / pc->period;
+		pc->next += behind * pc->period;
+		pc->missed += behind;
+	}
+
+	return pc->next;
+}
+
+/* the frame for the current slot went out at, which is never
+ * before it
+ */
+void
+pace_sent(struct pace *pc, uint64_t at)
+{
+	uint32_t	jitter;
+
+	jitter = (at > pc->next) ? at - pc->next : 0;
+	if (jitter > pc->jittermax) pc->jittermax = jitter;
+	pc->jittersum += jitter;
+	pc->frames++;
+
+	pc->next += pc->period;
+}
+
+/* the current slot goes by without a frame: there was nothing
+ * new to show in it, or it couldn't be sent
+ */
+void
+pace_skip(struct pace *pc)
+{
+	pc->skipped++;
+	pc->next += pc->period;
+}
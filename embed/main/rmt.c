@@ -29,14 +29,19 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <FreeRTOS/FreeRTOS.h>
+
 #include "driver/rmt_encoder.h"
 #include "driver/rmt_tx.h"
 #include "esp_attr.h"
 #include "esp_log.h"
 
+#include "frame.h"
 #include "him.h"
 
 #define HZ_PER_MHZ		1000000
@@ -46,13 +51,24 @@
 #define TICK_FREQUENCY_HZ	(NS_PER_S / TICK_PERIOD_NS)
 
 /* each symbol is a pair of 16 bit values - so in all
- * that's 32 bits -> 4 bytes to hold a single WS2812 'bit'.
- * our protocol is doing 8 bit color, so that's 24 * 4 = 96
- * bytes per LED. 96 * 16 = 1536 to hold an entire transmission
- * for 16 LEDs - that's a lot, but maybe we can do it?
+ * that's 32 bits -> 4 bytes to hold a single WS2812 'bit',
+ * or 96 bytes per LED. rather than find room for a whole frame
+ * of them, the driver plays out a block of symbols in halves,
+ * and has us refill each as it goes, however long the strip is
+ *
+ * a single output gets the DMA channel, and a block of
+ * WS2812_BLOCK. there's only one of those though, so with more
+ * than one output, they split the RMT's own memory between them
+ * instead, RMT_MEM_BLOCK symbols at a time
  */
-#define SYMBOL_BYTES		4
-#define MEM_SYMBOLS		(SYMBOL_BYTES * RMT_BITS_PER_LED * RMT_NUM_LEDS)
+#define RMT_MEM_BLOCK		48
+#define RMT_MEM_BLOCKS		4
+
+#if RMT_OUTPUTS == 1
+#define MEM_SYMBOLS		WS2812_BLOCK
+#else
+#define MEM_SYMBOLS		(RMT_MEM_BLOCK * (RMT_MEM_BLOCKS / RMT_OUTPUTS))
+#endif
 
 /* totally arbitrary pick here */
 #define TXQ_BACKLOG_SIZE	16
@@ -61,9 +77,6 @@
  * The duration of each level sums to 1200ns, and
  * determines whether the bit is a one or a zero
  */
-#define LEVEL_FIRST		1
-#define LEVEL_SECOND		0
-
 #define RESET_NS		50000
 #define ZERO_LEVEL_FIRST_NS	300
 #define ZERO_LEVEL_SECOND_NS	900
@@ -74,77 +87,101 @@
 
 LOG_SET_TAG("rmt");
 
-static IRAM_ATTR size_t	rmt_encode(rmt_encoder_t *, rmt_channel_handle_t,
-	    		    const void *, size_t, rmt_encode_state_t *);
-static esp_err_t	rmt_reset(rmt_encoder_t *);
-static esp_err_t	rmt_del(rmt_encoder_t *);
+static IRAM_ATTR size_t	rmt_encode(const void *, size_t, size_t, size_t,
+			    rmt_symbol_word_t *, bool *, void *);
+static esp_err_t	rmt_send(const void *const *, size_t);
+static IRAM_ATTR uint32_t rmt_slowest(void);
+static IRAM_ATTR bool	rmt_done(rmt_channel_handle_t,
+			    const rmt_tx_done_event_data_t *, void *);
 
-static DRAM_ATTR rmt_channel_handle_t	  chan = NULL;
-static DRAM_ATTR rmt_encoder_t	 	  base;
-static DRAM_ATTR rmt_encoder_t		 *dataobj, *blankobj;
-static DRAM_ATTR rmt_symbol_word_t	  blankdata;
-static DRAM_ATTR int		 	  blanking;
+static DRAM_ATTR rmt_channel_handle_t	  chans[RMT_OUTPUTS] = { NULL };
+static DRAM_ATTR rmt_encoder_handle_t	  encs[RMT_OUTPUTS] = { NULL };
+static rmt_sync_manager_handle_t	  syncman = NULL;
+static DRAM_ATTR struct ws2812		  lut;
 
+static const int			  gpios[RMT_OUTPUTS] = RMT_GPIOS;
+
+/* transmissions each channel's finished, and frames we've
+ * said are done: a frame's only done once it's done everywhere
+ */
+static DRAM_ATTR uint32_t		  sent[RMT_OUTPUTS];
+static DRAM_ATTR uint32_t		  released = 0;
+static DRAM_ATTR portMUX_TYPE		  sentlock =
+					    portMUX_INITIALIZER_UNLOCKED;
+
+static DRAM_ATTR int			(*ondone)(void *) = NULL;
+static DRAM_ATTR void			 *ondonearg = NULL;
+
+#if RMT_INDEX_BITS
+/* an indexed frame goes to each output's encoder as where to
+ * find its share of the LEDs. the driver holds on to that until
+ * it's done, so there's one for everything it can have queued,
+ * and one more for the frame going in behind them
+ */
+static DRAM_ATTR struct ws2812_indexed	  frames[TXQ_BACKLOG_SIZE + 1]
+					    [RMT_OUTPUTS];
+static int				  nextframe = 0;
+#endif
+
+/* the driver calls this from its interrupt whenever there's
+ * room for more symbols, with how many it's had so far. there's
+ * always room for a byte and the latch after it
+ */
 static size_t
-rmt_encode(rmt_encoder_t *enc, rmt_channel_handle_t ch,
-    const void *data, size_t datasize, rmt_encode_state_t *stateout)
+rmt_encode(const void *data, size_t datasize, size_t written, size_t room,
+    rmt_symbol_word_t *symbols, bool *done, void *arg)
 {
-	/* the RMT encoding API is non-blocking - basically, we
-	 * call encode() and get a result which is one or more of
-	 * - complete
-	 * - would block (i.e. "memory full")
-	 *
-	 * in addition, there's also this RESET flag, which
-	 * indicates that the encoder is 'reset' and ready for
-	 * another transmission. in reality, however, this is
-	 * just defined to zero, so we can not use it
-	 */
-	size_t			written = 0;
-	rmt_encode_state_t	substate;
-
-	if (!blanking) {
-		written = dataobj->encode(dataobj, chan,
-		    data, datasize, &substate);
-
-		if (substate & RMT_ENCODING_COMPLETE) blanking = 1;
-		if (substate & RMT_ENCODING_MEM_FULL) {
-			*stateout = RMT_ENCODING_MEM_FULL;
-			goto end;
-		}
-	}
-
-	if (blanking) {
-		written += blankobj->encode(blankobj, chan,
-		    &blankdata, sizeof(rmt_symbol_word_t), stateout);
-		if (*stateout & RMT_ENCODING_COMPLETE) blanking = 0;
-	}
-
-end:
-	return written;
-	(void)enc;
-	(void)ch;
+	size_t	n;
+	int	over = 0;
+
+#if RMT_INDEX_BITS
+	n = ws2812_encode_indexed(&lut, data, written, room,
+	    (uint32_t *)symbols, &over);
+	(void)datasize;
+#else
+	n = ws2812_encode(&lut, data, datasize, written, room,
+	    (uint32_t *)symbols, &over);
+#endif
+	*done = over;
+
+	return n;
+	(void)arg;
 }
 
-static esp_err_t
-rmt_reset(rmt_encoder_t *enc)
+/* the slowest channel to finish a frame */
+static uint32_t
+rmt_slowest(void)
 {
-	CATCH_RETURN(rmt_encoder_reset(blankobj));
-	CATCH_RETURN(rmt_encoder_reset(dataobj));
-	blanking = 0;
+	uint32_t	least = sent[0];
+	int		i;
 
-	return 0;
-	(void)enc;
+	for (i = 1; i < RMT_OUTPUTS; i++)
+		if (sent[i] < least) least = sent[i];
+	return least;
 }
 
-static esp_err_t
-rmt_del(rmt_encoder_t *enc)
+/* a channel's done with a transmission. once every channel
+ * is, the driver's done reading the frame. runs in interrupt
+ * context
+ */
+static bool
+rmt_done(rmt_channel_handle_t ch, const rmt_tx_done_event_data_t *ev,
+    void *arg)
 {
-	CATCH_RETURN(rmt_reset(enc));
-	CATCH_RETURN(rmt_del_encoder(blankobj));
-	CATCH_RETURN(rmt_del_encoder(dataobj));
+	int	frames, woke = 0;
 
-	return 0;
-	(void)enc;
+	portENTER_CRITICAL_ISR(&sentlock);
+	sent[(intptr_t)arg]++;
+	frames = rmt_slowest() - released;
+	released += frames;
+	portEXIT_CRITICAL_ISR(&sentlock);
+
+	if (ondone == NULL) return false;
+	while (frames-- > 0) woke |= ondone(ondonearg);
+
+	return woke != 0;
+	(void)ch;
+	(void)ev;
 }
 
 esp_err_t
@@ -152,78 +189,164 @@ rmt_init(void)
 {
 	esp_err_t			rv;
 	rmt_tx_channel_config_t		cfg = { 0 };
-	rmt_copy_encoder_config_t	blankcfg;
-	rmt_bytes_encoder_config_t	datacfg;
+	rmt_tx_event_callbacks_t	cbs = { 0 };
+	rmt_simple_encoder_config_t	enccfg = { 0 };
+	rmt_sync_manager_config_t	synccfg = { 0 };
+	intptr_t			i;
+
+	ws2812_init(&lut, NS_TO_TICKS(ZERO_LEVEL_FIRST_NS),
+	    NS_TO_TICKS(ZERO_LEVEL_SECOND_NS), NS_TO_TICKS(ONE_LEVEL_FIRST_NS),
+	    NS_TO_TICKS(ONE_LEVEL_SECOND_NS), NS_TO_TICKS(RESET_NS));
+
+	released = 0;
+	memset(sent, 0, sizeof(sent));
 
-	/* set up tx channel */
-	cfg.gpio_num = RMT_GPIO_NUM;
+	/* set up tx channels */
 	cfg.clk_src = RMT_CLK_SRC_APB;
 	cfg.resolution_hz = TICK_FREQUENCY_HZ;
 	cfg.mem_block_symbols = MEM_SYMBOLS;
 	cfg.trans_queue_depth = TXQ_BACKLOG_SIZE;
-	cfg.flags.with_dma = 1;
-
-	if ((rv = rmt_new_tx_channel(&cfg, &chan)) < 0) CATCH_RETURN(rv);
-	else if ((rv = rmt_enable(chan)) < 0) CATCH_GOTO(rv, delchan);
-
-	/* reset signal */
-	if ((rv = rmt_new_copy_encoder(&blankcfg,
-	    (rmt_encoder_handle_t *)&blankobj)) < 0)
-	    	CATCH_GOTO(rv, delchan);
-
-	blankdata.level0 = 0;
-	blankdata.duration0 = NS_TO_TICKS(RESET_NS) / 2;
-	blankdata.level1 = 0;
-	blankdata.duration1 = NS_TO_TICKS(RESET_NS) / 2;
-	blanking = 0;
-
-	/* data stuff */
-	datacfg.bit0.level0 = datacfg.bit1.level0 = LEVEL_FIRST;
-	datacfg.bit0.level1 = datacfg.bit1.level1 = LEVEL_SECOND;
-	datacfg.bit0.duration0 = NS_TO_TICKS(ZERO_LEVEL_FIRST_NS);
-	datacfg.bit0.duration1 = NS_TO_TICKS(ZERO_LEVEL_SECOND_NS);
-	datacfg.bit1.duration0 = NS_TO_TICKS(ONE_LEVEL_FIRST_NS);
-	datacfg.bit1.duration1 = NS_TO_TICKS(ONE_LEVEL_SECOND_NS);
-	datacfg.flags.msb_first = 1;
-
-	if ((rv = rmt_new_bytes_encoder(&datacfg,
-	    (rmt_encoder_handle_t *)&dataobj)) < 0)
-	    	CATCH_GOTO(rv, delcopy);
-
-	/* plumbing */
-	base.encode = &rmt_encode;
-	base.reset = &rmt_reset;
-	base.del = &rmt_del;
-
-delcopy:
-	if (rv < 0) rmt_del_encoder(blankobj);
-delchan:
-	if (rv < 0) {
-		rmt_disable(chan);
-		rmt_del_channel(chan);
-		chan = NULL;
+	cfg.flags.with_dma = (RMT_OUTPUTS == 1);
+
+	/* callbacks can only go in before the channel's enabled */
+	cbs.on_trans_done = &rmt_done;
+
+	/* an encoder apiece, straight from the table */
+	enccfg.callback = &rmt_encode;
+	enccfg.min_chunk_size = WS2812_SYMBOLS + 1;
+
+	for (i = 0; i < RMT_OUTPUTS; i++) {
+		cfg.gpio_num = gpios[i];
+
+		if ((rv = rmt_new_tx_channel(&cfg, &chans[i])) < 0)
+			CATCH_GOTO(rv, end);
+		else if ((rv = rmt_tx_register_event_callbacks(chans[i], &cbs,
+		    (void *)i)) < 0)
+			CATCH_GOTO(rv, end);
+		else if ((rv = rmt_enable(chans[i])) < 0) CATCH_GOTO(rv, end);
+		else if ((rv = rmt_new_simple_encoder(&enccfg, &encs[i])) < 0)
+			CATCH_GOTO(rv, end);
+	}
+
+	/* hold each transmission until every channel has one, so
+	 * they all start on the same tick
+	 */
+	if (RMT_OUTPUTS > 1) {
+		synccfg.tx_channel_array = chans;
+		synccfg.array_size = RMT_OUTPUTS;
+
+		if ((rv = rmt_new_sync_manager(&synccfg, &syncman)) < 0)
+			CATCH_GOTO(rv, end);
 	}
 
+end:
+	if (rv < 0) rmt_teardown();
 	return rv;
 }
 
+/* cb runs, from interrupt context, every time a frame's been
+ * sent on every output, in the order they were enqueued. it
+ * returns nonzero if it woke a task that should run right away
+ */
+void
+rmt_ondone(int (*cb)(void *), void *arg)
+{
+	ondonearg = arg;
+	ondone = cb;
+}
+
+/* a payload apiece, size bytes each, out on every output at
+ * once
+ */
+static esp_err_t
+rmt_send(const void *const *payloads, size_t size)
+{
+	rmt_transmit_config_t	 cfg = { 0 };
+	esp_err_t		 rv;
+	int			 i;
+
+	for (i = 0; i < RMT_OUTPUTS; i++) {
+		rv = rmt_transmit(chans[i], encs[i], payloads[i], size, &cfg);
+		if (rv == ESP_OK) continue;
+
+		/* the outputs before this one are armed, waiting on it
+		 * to start them all at once, which it never will. take
+		 * the frame back off them - there's only ever the one
+		 * on the wire, so there's nothing else to lose - and
+		 * it's all the caller's again
+		 */
+		while (--i >= 0) {
+			ESP_ERROR_CHECK_WITHOUT_ABORT(rmt_disable(chans[i]));
+			ESP_ERROR_CHECK_WITHOUT_ABORT(rmt_enable(chans[i]));
+		}
+		if (syncman != NULL)
+			ESP_ERROR_CHECK_WITHOUT_ABORT(rmt_sync_reset(syncman));
+
+		CATCH_RETURN(rv);
+	}
+
+	return 0;
+}
+
+/* data is every output's pixels, one after another, and goes
+ * out on all of them at once. the driver reads it as it goes,
+ * so it has to stay as it is until the frame's done
+ */
 esp_err_t
 rmt_enqueue(void *data, size_t datasize)
 {
-	rmt_transmit_config_t cfg = { 0 };
+	const void	*payloads[RMT_OUTPUTS];
+	size_t		 slice = datasize / RMT_OUTPUTS;
+	int		 i;
 
-	CATCH_RETURN(rmt_transmit(chan, &base, data, datasize, &cfg));
-	return 0;
+	for (i = 0; i < RMT_OUTPUTS; i++)
+		payloads[i] = (uint8_t *)data + i * slice;
+	return rmt_send(payloads, slice);
 }
 
+#if RMT_INDEX_BITS
+/* the same for an indexed frame: colors is its palette, and
+ * index every output's LEDs, RMT_INDEX_BITS apiece. both have
+ * to stay as they are until it's done
+ */
+esp_err_t
+rmt_enqueue_indexed(const struct pixel *colors, const uint8_t *index)
+{
+	const void		*payloads[RMT_OUTPUTS];
+	struct ws2812_indexed	*f = frames[nextframe];
+	int			 i;
+
+	nextframe = (nextframe + 1) % (TXQ_BACKLOG_SIZE + 1);
+
+	for (i = 0; i < RMT_OUTPUTS; i++) {
+		f[i].colors = colors;
+		f[i].index = index;
+		f[i].bits = RMT_INDEX_BITS;
+		f[i].first = i * RMT_NUM_LEDS;
+		f[i].nleds = RMT_NUM_LEDS;
+		payloads[i] = &f[i];
+	}
+
+	return rmt_send(payloads, sizeof(struct ws2812_indexed));
+}
+#endif
+
 void
 rmt_teardown(void)
 {
-	if (chan != NULL) {
-		rmt_del_encoder(&base);
-		rmt_disable(chan);
-		rmt_del_channel(chan);
-	}
+	int	i;
 
-	chan = NULL;
-}
\ No newline at end of file
+	if (syncman != NULL) rmt_del_sync_manager(syncman);
+	syncman = NULL;
+
+	for (i = 0; i < RMT_OUTPUTS; i++) {
+		if (encs[i] != NULL) rmt_del_encoder(encs[i]);
+		if (chans[i] != NULL) {
+			rmt_disable(chans[i]);
+			rmt_del_channel(chans[i]);
+		}
+
+		encs[i] = NULL;
+		chans[i] = NULL;
+	}
+}
@@ -0,0 +1,351 @@
+/* vm.c
+ * a small interpreter for effects the server sends
+ *
+ * (c) jay lang, 2023
+ * redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* effects that come over the wire. a program is a few dozen
+ * bytes of stack machine code, run once for every pixel of every
+ * frame, that leaves the pixel's red, green and blue on the stack
+ * when it ends. it can see which pixel it's on, how many there
+ * are, how long it's been running and what color the lamp is:
+ *
+ *	i n t			pixel, pixels, milliseconds
+ *	red green blue		the lamp's color, 0 or 255 each
+ *	push k			k up to 65535
+ *	add sub mul div mod and or xor shl shr min max lt eq
+ *	scale			a * b / 255
+ *	dup drop swap over
+ *	sin tri clamp		0-255 waves over 256 and 512, 0-255
+ *	jz jmp			forward only
+ *	end			r g b on the stack
+ *
+ * everything about a program that could go wrong is found when
+ * it's loaded, so running it needs no checks at all. jumps only
+ * go forward, so no instruction runs twice for a pixel, and the
+ * instructions in it bound what it costs. a program that would
+ * cost more than VM_BUDGET a frame at the strip's length, or
+ * that could underflow or overflow the stack, or end without a
+ * color, is turned away
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frame.h"
+
+struct vm_op {
+	uint8_t	valid;
+	uint8_t	pop, push;
+	uint8_t	operand;
+};
+
+static int		vm_merge(int8_t *, size_t, size_t, int, const char **);
+static int32_t		vm_sin(int32_t);
+static int32_t		vm_clamp(int32_t);
+
+static const struct vm_op	ops[256] = {
+	[VM_END] =	{ 1, 3, 0, 0 },
+	[VM_PUSH] =	{ 1, 0, 1, 1 },
+	[VM_PUSH16] =	{ 1, 0, 1, 2 },
+	[VM_I] =	{ 1, 0, 1, 0 },
+	[VM_N] =	{ 1, 0, 1, 0 },
+	[VM_T] =	{ 1, 0, 1, 0 },
+	[VM_RED] =	{ 1, 0, 1, 0 },
+	[VM_GREEN] =	{ 1, 0, 1, 0 },
+	[VM_BLUE] =	{ 1, 0, 1, 0 },
+	[VM_ADD] =	{ 1, 2, 1, 0 },
+	[VM_SUB] =	{ 1, 2, 1, 0 },
+	[VM_MUL] =	{ 1, 2, 1, 0 },
+	[VM_DIV] =	{ 1, 2, 1, 0 },
+	[VM_MOD] =	{ 1, 2, 1, 0 },
+	[VM_AND] =	{ 1, 2, 1, 0 },
+	[VM_OR] =	{ 1, 2, 1, 0 },
+	[VM_XOR] =	{ 1, 2, 1, 0 },
+	[VM_SHL] =	{ 1, 2, 1, 0 },
+	[VM_SHR] =	{ 1, 2, 1, 0 },
+	[VM_MIN] =	{ 1, 2, 1, 0 },
+	[VM_MAX] =	{ 1, 2, 1, 0 },
+	[VM_LT] =	{ 1, 2, 1, 0 },
+	[VM_EQ] =	{ 1, 2, 1, 0 },
+	[VM_SCALE] =	{ 1, 2, 1, 0 },
+	[VM_DUP] =	{ 1, 1, 2, 0 },
+	[VM_DROP] =	{ 1, 1, 0, 0 },
+	[VM_SWAP] =	{ 1, 2, 2, 0 },
+	[VM_OVER] =	{ 1, 2, 3, 0 },
+	[VM_SIN] =	{ 1, 1, 1, 0 },
+	[VM_TRI] =	{ 1, 1, 1, 0 },
+	[VM_CLAMP] =	{ 1, 1, 1, 0 },
+	[VM_JZ] =	{ 1, 1, 0, 1 },
+	[VM_JMP] =	{ 1, 0, 0, 1 },
+};
+
+/* a quarter of a sine, 0 to 127 */
+static const uint8_t	quarter[65] = {
+	  0,   3,   6,   9,  12,  16,  19,  22,  25,  28,  31,  34,  37,
+	 40,  43,  46,  49,  51,  54,  57,  60,  63,  65,  68,  71,  73,
+	 76,  78,  81,  83,  85,  88,  90,  92,  94,  96,  98, 100, 102,
+	104, 106, 107, 109, 111, 112, 113, 115, 116, 117, 118, 120, 121,
+	122, 122, 123, 124, 125, 125, 126, 126, 126, 127, 127, 127, 127,
+};
+
+/* the stack is depth deep when it gets to pc, one way or
+ * another. every way there has to agree
+ */
+static int
+vm_merge(int8_t *depths, size_t len, size_t pc, int depth, const char **why)
+{
+	if (pc >= len) {
+		*why = "runs off the end";
+		return -1;
+	}
+
+	if (depths[pc] >= 0 && depths[pc] != depth) {
+		*why = "stack depths disagree where paths meet";
+		return -1;
+	}
+
+	depths[pc] = depth;
+	return 0;
+}
+
+/* the most instructions a pixel can cost, or -1 with why it
+ * won't run
+ */
+int
+vm_check(const uint8_t *code, size_t len, const char **why)
+{
+	int8_t			depths[VM_CODEMAX];
+	uint8_t			starts[VM_CODEMAX];
+	const struct vm_op	*op;
+	size_t			pc, next, target;
+	int			depth, cost = 0;
+	const char		*ignored;
+
+	if (why == NULL) why = &ignored;
+
+	if (len == 0 || len > VM_CODEMAX) {
+		*why = "no code, or too much";
+		return -1;
+	}
+
+	memset(depths, -1, sizeof(depths));
+	memset(starts, 0, sizeof(starts));
+	depths[0] = 0;
+
+	for (pc = 0; pc < len; pc = next) {
+		op = &ops[code[pc]];
+		next = pc + 1 + op->operand;
+		starts[pc] = 1;
+
+		if (!op->valid) {
+			*why = "unknown instruction";
+			return -1;
+		} else if (next > len) {
+			*why = "instruction cut off";
+			return -1;
+		} else if ((depth = depths[pc]) < 0) {
+			*why = "unreachable code";
+			return -1;
+		} else if (depth < op->pop) {
+			*why = "stack underflow";
+			return -1;
+		}
+
+		depth += op->push - op->pop;
+		if (depth > VM_STACK) {
+			*why = "stack overflow";
+			return -1;
+		}
+
+		cost++;
+
+		switch (code[pc]) {
+		case VM_END:
+			if (depth != 0) {
+				*why = "end needs just r, g and b";
+				return -1;
+			}
+			break;
+		case VM_JZ:
+		case VM_JMP:
+			target = next + code[pc + 1];
+			if (vm_merge(depths, len, target, depth, why) < 0)
+				return -1;
+			if (code[pc] == VM_JMP) break;
+			/* fall through */
+		default:
+			if (vm_merge(depths, len, next, depth, why) < 0)
+				return -1;
+		}
+	}
+
+	/* and nothing jumps into the middle of an instruction */
+	for (pc = 0; pc < len; pc++)
+		if (depths[pc] >= 0 && !starts[pc]) {
+			*why = "jump into an instruction";
+			return -1;
+		}
+
+	return cost;
+}
+
+/* code, checked, for a strip of nleds. -1, with why, if it
+ * won't run or would take too long
+ */
+int
+vm_load(struct vm *v, const uint8_t *code, size_t len, int nleds,
+    const char **why)
+{
+	const char	*ignored;
+	size_t		 i;
+	int		 cost;
+
+	if (why == NULL) why = &ignored;
+	if ((cost = vm_check(code, len, why)) < 0) return -1;
+
+	if ((long)cost * nleds > VM_BUDGET) {
+		*why = "too slow for this many pixels";
+		return -1;
+	}
+
+	memcpy(v->code, code, len);
+	v->len = len;
+	v->cost = cost;
+
+	/* every instruction's reachable, so any t is read */
+	v->timed = 0;
+	for (i = 0; i < len; i += 1 + ops[code[i]].operand)
+		if (code[i] == VM_T) v->timed = 1;
+
+	return 0;
+}
+
+/* 128 + 127 sin(2 pi x / 256) */
+static int32_t
+vm_sin(int32_t x)
+{
+	int	k = x & 63;
+
+	switch ((x >> 6) & 3) {
+	case 0:		return 128 + quarter[k];
+	case 1:		return 128 + quarter[64 - k];
+	case 2:		return 128 - quarter[k];
+	default:	return 128 - quarter[64 - k];
+	}
+}
+
+static int32_t
+vm_clamp(int32_t x)
+{
+	return (x < 0) ? 0 : (x > 255) ? 255 : x;
+}
+
+/* arithmetic wraps, and dividing by 0 gives 0, so there's
+ * nothing a checked program can do wrong
+ */
+struct pixel
+vm_run(const struct vm *v, int i, int n, uint32_t t, struct pixel color)
+{
+	const uint8_t	*code = v->code;
+	struct pixel	 out;
+	int32_t		 s[VM_STACK], a, b;
+	uint32_t	 ua, ub;
+	int		 sp = 0, pc = 0;
+
+	for (;;) {
+		switch (code[pc++]) {
+		case VM_END:
+			out.r = vm_clamp(s[0]);
+			out.g = vm_clamp(s[1]);
+			out.b = vm_clamp(s[2]);
+			return out;
+		case VM_PUSH:	s[sp++] = code[pc++]; continue;
+		case VM_PUSH16:
+			s[sp++] = code[pc] << 8 | code[pc + 1];
+			pc += 2;
+			continue;
+		case VM_I:	s[sp++] = i; continue;
+		case VM_N:	s[sp++] = n; continue;
+		case VM_T:	s[sp++] = (int32_t)(t & INT32_MAX); continue;
+		case VM_RED:	s[sp++] = color.r; continue;
+		case VM_GREEN:	s[sp++] = color.g; continue;
+		case VM_BLUE:	s[sp++] = color.b; continue;
+		case VM_DUP:	s[sp] = s[sp - 1]; sp++; continue;
+		case VM_DROP:	sp--; continue;
+		case VM_SWAP:
+			a = s[sp - 1];
+			s[sp - 1] = s[sp - 2];
+			s[sp - 2] = a;
+			continue;
+		case VM_OVER:	s[sp] = s[sp - 2]; sp++; continue;
+		case VM_SIN:	s[sp - 1] = vm_sin(s[sp - 1]); continue;
+		case VM_TRI:
+			a = s[sp - 1] & 511;
+			s[sp - 1] = (a < 256) ? a : 511 - a;
+			continue;
+		case VM_CLAMP:	s[sp - 1] = vm_clamp(s[sp - 1]); continue;
+		case VM_JZ:
+			pc += (s[--sp] == 0) ? code[pc] + 1 : 1;
+			continue;
+		case VM_JMP:	pc += code[pc] + 1; continue;
+		}
+
+		/* the rest take two and leave one */
+		b = s[--sp];
+		a = s[sp - 1];
+		ua = (uint32_t)a;
+		ub = (uint32_t)b;
+
+		switch (code[pc - 1]) {
+		case VM_ADD:	a = (int32_t)(ua + ub); break;
+		case VM_SUB:	a = (int32_t)(ua - ub); break;
+		case VM_MUL:	a = (int32_t)(ua * ub); break;
+		case VM_DIV:
+			a = (b == 0) ? 0 : (b == -1) ? (int32_t)(0 - ua) : a / b;
+			break;
+		case VM_MOD:	a = (b == 0 || b == -1) ? 0 : a % b; break;
+		case VM_AND:	a = (int32_t)(ua & ub); break;
+		case VM_OR:	a = (int32_t)(ua | ub); break;
+		case VM_XOR:	a = (int32_t)(ua ^ ub); break;
+		case VM_SHL:	a = (int32_t)(ua << (ub & 31)); break;
+		case VM_SHR:	a = (int32_t)(ua >> (ub & 31)); break;
+		case VM_MIN:	a = (a < b) ? a : b; break;
+		case VM_MAX:	a = (a > b) ? a : b; break;
+		case VM_LT:	a = (a < b); break;
+		case VM_EQ:	a = (a == b); break;
+		case VM_SCALE:
+			a = (int32_t)((int64_t)vm_clamp(a) * vm_clamp(b) + 127) /
+			    255;
+			break;
+		}
+
+		s[sp - 1] = a;
+	}
+}
@@ -0,0 +1,155 @@
+/* ws2812.c
+ * turns pixel bytes into RMT symbols
+ *
+ * (c) jay lang, 2023
+ * redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* WS2812s take each bit as a high then a low, long then short
+ * for a one and short then long for a zero, with a long low at
+ * the end of a frame to latch it. the RMT peripheral plays out
+ * symbols - a pair of levels and how long to hold each - so
+ * every byte of a frame turns into eight of them, most
+ * significant bit first
+ *
+ * rather than work that out bit by bit as the driver asks for
+ * more, we do all 256 bytes once, up front, and encoding is a
+ * table lookup and eight stores per byte:
+ *
+ *	lut[byte][bit]	the symbol for bit 7 - bit of byte
+ *	reset		the latch, as one symbol
+ *
+ * ws2812_encode runs from the RMT interrupt, so it's kept out
+ * of flash (see linker.lf), and works on whole bytes only:
+ * however the driver splits the frame up, where it's at is just
+ * the symbols written so far over eight
+ *
+ * ws2812_encode_indexed does the same for indexed frames (see
+ * palette.c), looking each LED's color up in the palette on the
+ * way, so a full color frame never exists anywhere
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+static inline void	ws2812_byte(uint32_t *, const uint32_t *);
+
+/* a byte's eight symbols */
+static inline void
+ws2812_byte(uint32_t *out, const uint32_t *sym)
+{
+	out[0] = sym[0];
+	out[1] = sym[1];
+	out[2] = sym[2];
+	out[3] = sym[3];
+	out[4] = sym[4];
+	out[5] = sym[5];
+	out[6] = sym[6];
+	out[7] = sym[7];
+}
+
+void
+ws2812_init(struct ws2812 *w, uint16_t t0h, uint16_t t0l, uint16_t t1h,
+    uint16_t t1l, uint16_t reset)
+{
+	uint32_t	zero, one;
+	int		byte, bit;
+
+	zero = WS2812_SYMBOL(1, t0h, 0, t0l);
+	one = WS2812_SYMBOL(1, t1h, 0, t1l);
+
+	for (byte = 0; byte < 256; byte++)
+		for (bit = 0; bit < WS2812_SYMBOLS; bit++)
+			w->lut[byte][bit] = (byte & (0x80 >> bit)) ? one : zero;
+
+	/* halves, so either one fits in a duration */
+	w->reset = WS2812_SYMBOL(0, reset - reset / 2, 0, reset / 2);
+}
+
+/* as much of data as fits in room symbols at out, picking up
+ * after the written symbols already out. sets *done once the
+ * latch is in, and returns the symbols it wrote, or 0 if it
+ * needs more room than that
+ */
+size_t
+ws2812_encode(const struct ws2812 *w, const uint8_t *data, size_t len,
+    size_t written, size_t room, uint32_t *out, int *done)
+{
+	size_t	i, n = 0;
+
+	for (i = written / WS2812_SYMBOLS; i < len; i++) {
+		if (room - n < WS2812_SYMBOLS) return n;
+
+		ws2812_byte(out + n, w->lut[data[i]]);
+		n += WS2812_SYMBOLS;
+	}
+
+	if (room - n < 1) return n;
+
+	out[n++] = w->reset;
+	*done = 1;
+	return n;
+}
+
+/* as ws2812_encode, for an indexed frame. a byte's still eight
+ * symbols, so where we're at is too, just a byte of some LED's
+ * color rather than of data
+ */
+size_t
+ws2812_encode_indexed(const struct ws2812 *w, const struct ws2812_indexed *f,
+    size_t written, size_t room, uint32_t *out, int *done)
+{
+	const uint8_t	*color;
+	size_t		 i, n = 0;
+	int		 led, ch, at;
+
+	i = written / WS2812_SYMBOLS;
+	ch = i % OUTPUT_CHANNELS;
+
+	for (led = i / OUTPUT_CHANNELS; led < f->nleds; led++, ch = 0) {
+		/* palette_get, but out of flash */
+		at = f->first + led;
+		at = (f->bits == PALETTE_BITS_MAX) ? f->index[at] :
+		    (f->index[at / 2] >> (at % 2 * 4)) & 0x0f;
+		color = (const uint8_t *)&f->colors[at];
+
+		for (; ch < OUTPUT_CHANNELS; ch++) {
+			if (room - n < WS2812_SYMBOLS) return n;
+
+			ws2812_byte(out + n, w->lut[color[ch]]);
+			n += WS2812_SYMBOLS;
+		}
+	}
+
+	if (room - n < 1) return n;
+
+	out[n++] = w->reset;
+	*done = 1;
+	return n;
+}
@@ -1,13 +1,6 @@
 #include <sys/types.h>
 
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-
 #include <err.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <netdb.h>
 #include <limits.h>
 #include <math.h>
 #include <stdio.h>
@@ -17,6 +10,8 @@
 
 #include <SDL.h>
 
+#include "libhim.h"
+
 static uint64_t		 framecnt = 0;
 
 /* BEGIN LED THINGS */
@@ -193,7 +188,7 @@ static SDL_Texture	*texture = NULL;
 /* what color the LEDs are spinning right now */
 static uint8_t		 currentcolor = LED_COLOR_GREEN;
 
-static int		 sockfd;
+static struct him_client	*client = NULL;
 
 static void		 index_to_position(int, uint32_t, uint32_t *, uint32_t *);
 static void		 draw_circle(SDL_Renderer *, uint32_t, uint32_t,
@@ -250,59 +245,28 @@ draw_circle(SDL_Renderer *r, uint32_t x, uint32_t y,
 static uint8_t
 poll_color(void)
 {
-	uint8_t	new;
-
-	if (read(sockfd, &new, sizeof(uint8_t)) < 0) {
-		if (errno == EAGAIN) return currentcolor;
-		err(1, "read");
-	}
-
-	return new;
+	/* libhim reconnects on its own, so all we
+	 * have to do is give it a chance to run
+	 */
+	him_dispatch(client, 0);
+	return (him_color(client) != 0) ? him_color(client) : currentcolor;
 }
 
 static int
 try_increment_color(uint8_t nextcolor)
 {
-	if (write(sockfd, &nextcolor, sizeof(uint8_t)) > 0) return 1;
-	if (errno != EAGAIN) err(1, "write");
-	else return 0;
+	if (him_update(client, nextcolor) < 0) return 0;
+	return him_flush(client) == 0;
 }
 
 int
 main(int argc, char *argv[])
 {
-	struct hostent		*host;
-	struct sockaddr_in	 sa;
-	int			 flags;
-
 	struct pixel		 black = { 0 };
 	struct pixel		 ring = { .r = 70, .g = 70, .b = 70 };
 
-	sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sockfd < 0) err(1, "socket");
-
-	if ((host = gethostbyname(APP_NAME)) == NULL) {
-		close(sockfd);
-		errx(1, "gethostbyname (h_errno = %d)", h_errno);
-	}
-
-	sa.sin_family = AF_INET;
-	sa.sin_port = htons(6969);
-	sa.sin_addr.s_addr = *(in_addr_t *)host->h_addr;
-
-	if (connect(sockfd, (struct sockaddr *)&sa,
-	    sizeof(struct sockaddr_in)) < 0) {
-	    	close(sockfd);
-		err(1, "connect");
-	}
-
-	if ((flags = fcntl(sockfd, F_GETFL)) < 0) err(1, "fcntl F_GETFL");
-	flags |= O_NONBLOCK;
-	if (fcntl(sockfd, F_SETFL, flags) < 0) err(1, "fcntl F_SETFL");
-
-	if ((flags = fcntl(sockfd, F_GETFD)) < 0) err(1, "fcntl F_GETFD");
-	flags |= O_CLOEXEC;
-	if (fcntl(sockfd, F_SETFD, flags) < 0) err(1, "fcntl F_SETFD");
+	client = him_open(APP_NAME, HIM_PORT, NULL, NULL);
+	if (client == NULL) err(1, "him_open");
 
 	if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) {
 		SDL_ERROR("SDL_InitSubsystem");
@@ -393,6 +357,7 @@ main(int argc, char *argv[])
 	}
 
 end:
+	him_close(client);
 	return 0;
 
 	(void)argc;
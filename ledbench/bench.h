@@ -0,0 +1,47 @@
+/* bench.h
+ * bits shared by the suites
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/* how long a timing loop runs, roughly */
+#define BENCH_NS		200000000ULL
+
+#define CHECK(cond, ...) do {					\
+	if (!(cond)) bench_fail(__FILE__, __LINE__, __VA_ARGS__);	\
+} while (0)
+
+void		bench_fail(const char *, int, const char *, ...)
+		    __attribute__((format(printf, 3, 4)));
+uint64_t	bench_now(void);
+void		bench_report(const char *, uint64_t, uint64_t, uint64_t,
+		    const char *);
+
+/* layers.c */
+void		layers_check(void);
+void		layers_bench(void);
+
+/* pipeline.c */
+void		pipeline_check(void);
+void		pipeline_bench(void);
+
+/* encoder.c */
+void		encoder_check(void);
+void		encoder_bench(void);
+
+/* stage.c */
+void		stage_check(void);
+void		stage_bench(void);
+
+/* kernels.c */
+void		kernels_check(void);
+void		kernels_bench(void);
+
+/* programs.c */
+void		programs_check(void);
+void		programs_bench(void);
+
+#endif /* BENCH_H */
@@ -0,0 +1,427 @@
+/* encoder.c
+ * ws2812.c: the symbols a frame becomes, against a bit at a time
+ * encoder laid out like the RMT bytes encoder we used to chain,
+ * and how fast they come - and whether, streamed through the
+ * RMT's ping-pong halves, they come faster than the line takes
+ * them at 800kHz
+ *
+ * indexed frames (palette.c) have to come out symbol for symbol
+ * the same as the full color frames they stand for
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "frame.h"
+
+/* rmt.c's timings, in 100ns ticks */
+#define T0H		3
+#define T0L		9
+#define T1H		9
+#define T1L		3
+#define RESET		500
+
+#define STRIP		1000
+#define LONGEST		4096
+
+/* on the wire: 1.25us a bit, and 50us to latch */
+#define BIT_NS		1250
+#define LATCH_NS	50000
+
+#define HALF		(WS2812_BLOCK / 2)
+
+static struct ws2812	w;
+
+static size_t	reference(const uint8_t *, size_t, uint32_t *);
+static size_t	chunked(const uint8_t *, size_t, uint32_t *, size_t);
+static void	fill(uint8_t *, size_t);
+static size_t	stream(const uint8_t *, size_t, uint32_t *);
+static void	bench_stream(int);
+static void	check_map(int, int, int, int);
+static void	check_indexed(int, int, int);
+
+static size_t
+reference(const uint8_t *data, size_t len, uint32_t *out)
+{
+	size_t	i, n = 0;
+	int	bit;
+
+	for (i = 0; i < len; i++)
+		for (bit = 7; bit >= 0; bit--)
+			out[n++] = ((data[i] >> bit) & 1) ?
+			    WS2812_SYMBOL(1, T1H, 0, T1L) :
+			    WS2812_SYMBOL(1, T0H, 0, T0L);
+
+	out[n++] = WS2812_SYMBOL(0, RESET / 2, 0, RESET / 2);
+	return n;
+}
+
+/* the way the driver calls us, with room for at least min
+ * symbols each time. 0 if it never finished
+ */
+static size_t
+chunked(const uint8_t *data, size_t len, uint32_t *out, size_t min)
+{
+	size_t	written = 0, room;
+	int	done = 0, calls = 0;
+
+	while (!done && calls++ < 100000) {
+		room = min + rand() % 40;
+		written += ws2812_encode(&w, data, len, written, room,
+		    out + written, &done);
+	}
+
+	return done ? written : 0;
+}
+
+static void
+fill(uint8_t *data, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) data[i] = rand();
+}
+
+/* a frame the way the driver plays it: it waits for a half to
+ * go out, then has us refill just that half. returns how many
+ * refills it took
+ */
+static size_t
+stream(const uint8_t *data, size_t len, uint32_t *out)
+{
+	size_t	written = 0, n, fills = 0;
+	int	done = 0;
+
+	while (!done) {
+		n = ws2812_encode(&w, data, len, written, HALF,
+		    out + (fills % 2) * HALF, &done);
+
+		/* a half that isn't full would go out short */
+		if (!done && n != HALF) {
+			bench_fail(__FILE__, __LINE__, "%zu bytes: refill %zu "
+			    "came out %zu symbols short", len, fills, HALF - n);
+			return 0;
+		}
+
+		written += n;
+		fills++;
+	}
+
+	return fills;
+}
+
+/* every LED's color in range, the alone LED's the last and
+ * nobody else's, and the rest spread in order over all of the
+ * others
+ */
+static void
+check_map(int bits, int nleds, int colors, int alone)
+{
+	uint8_t	index[PALETTE_BYTES(PALETTE_BITS_MAX, LONGEST)];
+	int	i, c, last = 0;
+
+	memset(index, 0xa5, sizeof(index));
+	palette_map(index, bits, nleds, colors, alone);
+
+	for (i = 0; i < nleds; i++) {
+		c = palette_get(index, bits, i);
+		CHECK(c >= 0 && c < colors, "%d bit, %d leds: %d is color %d "
+		    "of %d", bits, nleds, i, c, colors);
+
+		if (nleds <= colors) {
+			CHECK(c == i, "%d bit, %d leds: %d is color %d",
+			    bits, nleds, i, c);
+			continue;
+		}
+
+		if (i == alone) {
+			CHECK(c == colors - 1, "%d bit, %d leds: the one left "
+			    "alone is color %d", bits, nleds, c);
+			continue;
+		}
+
+		CHECK(c == last || c == last + 1, "%d bit, %d leds: %d "
+		    "went from color %d to %d", bits, nleds, i, last, c);
+		CHECK(alone < 0 || alone >= nleds || c != colors - 1,
+		    "%d bit, %d leds: %d shares the lone color", bits, nleds,
+		    i);
+		last = c;
+	}
+
+	if (nleds > colors)
+		CHECK(last == colors - 1 - (alone >= 0 && alone < nleds),
+		    "%d bit, %d leds: only %d colors of %d used", bits,
+		    nleds, last + 1, colors);
+}
+
+/* a random palette and index, against the frame they make
+ * encoded in full, in one go and in dribs and drabs, and split
+ * over two outputs the way rmt.c does
+ */
+static void
+check_indexed(int bits, int nleds, int colors)
+{
+	static uint32_t		got[LONGEST * 24 + 1], want[LONGEST * 24 + 1];
+	static struct pixel	full[LONGEST];
+	struct pixel		palette[1 << PALETTE_BITS_MAX];
+	uint8_t			index[PALETTE_BYTES(PALETTE_BITS_MAX,
+				    LONGEST)];
+	struct ws2812_indexed	f;
+	size_t			n, m, written, room;
+	int			i, done, half, calls;
+
+	fill((uint8_t *)palette, sizeof(palette));
+	memset(index, 0, sizeof(index));
+	palette_map(index, bits, nleds, colors, rand() % (nleds + 1) - 1);
+	palette_expand(palette, index, bits, nleds, full);
+	for (i = 0; i < nleds; i++)
+		CHECK(memcmp(&full[i], &palette[palette_get(index, bits, i)],
+		    sizeof(struct pixel)) == 0, "%d bit: led %d expanded "
+		    "wrong", bits, i);
+
+	n = reference((uint8_t *)full, (size_t)nleds * 3, want);
+
+	f.colors = palette;
+	f.index = index;
+	f.bits = bits;
+	f.first = 0;
+	f.nleds = nleds;
+
+	done = 0;
+	memset(got, 0, sizeof(got));
+	CHECK(ws2812_encode_indexed(&w, &f, 0, n, got, &done) == n && done,
+	    "%d bit, %d leds in one go", bits, nleds);
+	CHECK(memcmp(got, want, n * sizeof(uint32_t)) == 0,
+	    "%d bit, %d leds in one go don't match", bits, nleds);
+
+	done = 0;
+	written = 0;
+	calls = 0;
+	memset(got, 0, sizeof(got));
+	while (!done && calls++ < 100000) {
+		room = WS2812_SYMBOLS + 1 + rand() % 40;
+		written += ws2812_encode_indexed(&w, &f, written, room,
+		    got + written, &done);
+	}
+	CHECK(written == n && memcmp(got, want, n * sizeof(uint32_t)) == 0,
+	    "%d bit, %d leds, a bit at a time, don't match", bits, nleds);
+
+	/* an odd split, so a 4 bit output starts mid byte */
+	half = nleds / 2 | 1;
+	if (half > nleds) return;
+
+	f.first = half;
+	f.nleds = nleds - half;
+	m = reference((uint8_t *)(full + half), (size_t)f.nleds * 3, want);
+
+	done = 0;
+	memset(got, 0, sizeof(got));
+	CHECK(ws2812_encode_indexed(&w, &f, 0, m, got, &done) == m && done &&
+	    memcmp(got, want, m * sizeof(uint32_t)) == 0,
+	    "%d bit, %d leds from %d don't match", bits, nleds, half);
+}
+
+void
+encoder_check(void)
+{
+	static uint32_t	got[STRIP * 24 + 1], want[STRIP * 24 + 1];
+	uint8_t		data[STRIP * 3];
+	uint8_t		byte = 0x80;
+	size_t		n, len, i;
+	int		done = 0;
+
+	ws2812_init(&w, T0H, T0L, T1H, T1L, RESET);
+
+	/* what the words themselves should be */
+	n = ws2812_encode(&w, &byte, 1, 0, 9, got, &done);
+	CHECK(n == 9 && done, "one byte: %zu symbols, done %d", n, done);
+	CHECK(got[0] == 0x00038009, "a one is %08x", got[0]);
+	CHECK(got[1] == 0x00098003, "a zero is %08x", got[1]);
+	CHECK(got[8] == 0x00fa00fa, "the latch is %08x", got[8]);
+
+	/* no room for a byte is no progress, and the latch needs
+	 * its own symbol
+	 */
+	done = 0;
+	CHECK(ws2812_encode(&w, &byte, 1, 0, 7, got, &done) == 0 && !done,
+	    "a byte went into seven symbols");
+	CHECK(ws2812_encode(&w, &byte, 1, 0, 8, got, &done) == 8 && !done,
+	    "finished without a latch");
+	CHECK(ws2812_encode(&w, &byte, 1, 8, 1, got + 8, &done) == 1 && done,
+	    "the latch on its own");
+
+	/* whole bytes to a half, or refills leave gaps */
+	CHECK(HALF % WS2812_SYMBOLS == 0, "%d symbol halves", HALF);
+
+	/* long strips through the ping-pong halves, every one
+	 * refilled in full
+	 */
+	for (len = 3 * STRIP; len <= 3 * LONGEST; len *= 2) {
+		uint8_t		*strip;
+		uint32_t	 halves[WS2812_BLOCK];
+
+		if ((strip = calloc(len, 1)) == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+
+		n = len * WS2812_SYMBOLS + 1;
+		CHECK(stream(strip, len, halves) == (n + HALF - 1) / HALF,
+		    "%zu leds streamed in the wrong number of refills", len / 3);
+		free(strip);
+	}
+
+	srand(1);
+	for (len = 0; len <= sizeof(data); len += 3 * 97) {
+		fill(data, len);
+		n = reference(data, len, want);
+
+		done = 0;
+		memset(got, 0, sizeof(got));
+		CHECK(ws2812_encode(&w, data, len, 0, n, got, &done) == n &&
+		    done, "%zu bytes in one go", len);
+		CHECK(memcmp(got, want, n * sizeof(uint32_t)) == 0,
+		    "%zu bytes in one go don't match", len);
+
+		for (i = WS2812_SYMBOLS + 1; i < 64; i += 13) {
+			memset(got, 0, sizeof(got));
+			CHECK(chunked(data, len, got, i) == n,
+			    "%zu bytes, %zu at a time, came out short", len, i);
+			CHECK(memcmp(got, want, n * sizeof(uint32_t)) == 0,
+			    "%zu bytes, %zu at a time, don't match", len, i);
+		}
+	}
+
+	/* indexed frames, 16 and 256 colors, with fewer LEDs than
+	 * that, as many, and far more
+	 */
+	for (len = 0; len <= LONGEST; len = len * 3 + 1) {
+		check_map(4, len, 16, -1);
+		check_map(4, len, 16, 15);
+		check_map(8, len, 256, -1);
+		check_map(8, len, 256, len / 2);
+		check_map(8, len, 12, 3);
+
+		check_indexed(4, len, 16);
+		check_indexed(8, len, 256);
+	}
+	check_indexed(4, LONGEST, 16);
+	check_indexed(8, LONGEST, 256);
+}
+
+/* refilling a half has to take less time than sending the
+ * other one does. a desktop is a good deal quicker than the
+ * lamp, so what matters here is how much to spare
+ */
+static void
+bench_stream(int leds)
+{
+	static uint32_t	halves[WS2812_BLOCK];
+	uint8_t		*data;
+	uint64_t	start, ns, fills = 0, line, frame;
+	size_t		len = (size_t)leds * 3;
+	char		what[64];
+
+	if ((data = malloc(len)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	fill(data, len);
+
+	start = bench_now();
+	do {
+		fills += stream(data, len, halves);
+	} while (bench_now() - start < BENCH_NS);
+	ns = bench_now() - start;
+
+	snprintf(what, sizeof(what), "streamed, %d leds", leds);
+	bench_report(what, fills, ns, HALF, "symbol");
+
+	line = (uint64_t)HALF * BIT_NS;
+	frame = (uint64_t)len * 8 * BIT_NS + LATCH_NS;
+	printf("  %-40s %10.1f us/half on the line, %.0fx to spare\n", "",
+	    (double)line / 1000, (double)line * fills / ns);
+	printf("  %-40s %10.1f ms/frame on the line, %.1f frames/s\n", "",
+	    (double)frame / 1000000, 1e9 / frame);
+
+	CHECK(ns / fills < line, "%d leds: a refill takes %lu ns, the line "
+	    "sends a half in %lu", leds, (unsigned long)(ns / fills),
+	    (unsigned long)line);
+	free(data);
+}
+
+void
+encoder_bench(void)
+{
+	static uint32_t	out[STRIP * 24 + 1];
+	static uint8_t	data[STRIP * 3];
+	uint8_t		index[PALETTE_BYTES(PALETTE_BITS_MAX, STRIP)];
+	struct ws2812_indexed f;
+	uint64_t	start, ns, frames = 0;
+	size_t		n = 0;
+	char		what[64];
+	int		done, bits;
+
+	ws2812_init(&w, T0H, T0L, T1H, T1L, RESET);
+	fill(data, sizeof(data));
+
+	start = bench_now();
+	do {
+		done = 0;
+		n = ws2812_encode(&w, data, sizeof(data), 0, sizeof(out) /
+		    sizeof(uint32_t), out, &done);
+		frames++;
+	} while (bench_now() - start < BENCH_NS);
+	ns = bench_now() - start;
+
+	bench_report("lut, 1000 leds", frames, ns, n, "symbol");
+	printf("  %-40s %10.1f symbols/us\n", "", (double)n * frames * 1000 /
+	    ns);
+
+	frames = 0;
+	start = bench_now();
+	do {
+		n = reference(data, sizeof(data), out);
+		frames++;
+	} while (bench_now() - start < BENCH_NS);
+	ns = bench_now() - start;
+
+	bench_report("bit at a time, 1000 leds", frames, ns, n, "symbol");
+	printf("  %-40s %10.1f symbols/us\n", "", (double)n * frames * 1000 /
+	    ns);
+
+	/* looking every LED up on the way out shouldn't cost much
+	 * next to the table itself
+	 */
+	for (bits = PALETTE_BITS_MIN; bits <= PALETTE_BITS_MAX; bits *= 2) {
+		palette_map(index, bits, STRIP, 1 << bits, -1);
+		f.colors = (const struct pixel *)data;
+		f.index = index;
+		f.bits = bits;
+		f.first = 0;
+		f.nleds = STRIP;
+
+		frames = 0;
+		start = bench_now();
+		do {
+			done = 0;
+			n = ws2812_encode_indexed(&w, &f, 0, sizeof(out) /
+			    sizeof(uint32_t), out, &done);
+			frames++;
+		} while (bench_now() - start < BENCH_NS);
+		ns = bench_now() - start;
+
+		snprintf(what, sizeof(what), "indexed, %d bit, 1000 leds",
+		    bits);
+		bench_report(what, frames, ns, n, "symbol");
+		printf("  %-40s %10.1f symbols/us, %zu bytes a frame\n", "",
+		    (double)n * frames * 1000 / ns,
+		    PALETTE_BYTES(bits, STRIP));
+	}
+
+	bench_stream(STRIP);
+	bench_stream(LONGEST);
+}
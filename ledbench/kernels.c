@@ -0,0 +1,265 @@
+/* kernels.c
+ * fb.c: every kernel, bit for bit against the plain loop over
+ * bytes it stands in for - every pair of bytes, every opacity,
+ * rows of every length up to a few words and at every alignment
+ * - then how the two compare for speed. and that fb_hash sees
+ * every byte, wherever it is
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "frame.h"
+
+#define STRIP		1000
+
+/* room for every pair of bytes, in whole pixels */
+#define PAIRS		(65536 / 3 + 1)
+
+/* rows up to this long, starting this far off */
+#define ROWMAX		67
+#define SKEW		16
+
+static uint8_t	div255(uint32_t);
+static void	ref_fill(uint8_t *, size_t, struct pixel);
+static void	ref_add(uint8_t *, const uint8_t *, size_t);
+static void	ref_scale(uint8_t *, size_t, uint8_t);
+static void	ref_lerp(uint8_t *, const uint8_t *, size_t, uint8_t);
+static void	ref_max(uint8_t *, const uint8_t *, size_t);
+static void	ref_multiply(uint8_t *, const uint8_t *, size_t);
+static void	ref_invert(uint8_t *, size_t);
+static void	kernel(int, struct pixel *, const struct pixel *, int,
+		    uint8_t);
+static void	reference(int, uint8_t *, const uint8_t *, size_t,
+		    uint8_t);
+static void	fill(uint8_t *, size_t);
+
+enum { FILL, ADD, SCALE, LERP, MAX, MULTIPLY, INVERT, KERNELS };
+
+static const char	*names[KERNELS] = {
+	"fill", "add", "scale", "lerp", "max", "multiply", "invert"
+};
+
+/* as compose.c always has */
+static uint8_t
+div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static void
+ref_fill(uint8_t *d, size_t len, struct pixel p)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) d[i] = ((uint8_t *)&p)[i % 3];
+}
+
+static void
+ref_add(uint8_t *d, const uint8_t *s, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) d[i] = (d[i] + s[i] > 255) ? 255 : d[i] + s[i];
+}
+
+static void
+ref_scale(uint8_t *d, size_t len, uint8_t a)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) d[i] = div255(d[i] * a);
+}
+
+static void
+ref_lerp(uint8_t *d, const uint8_t *s, size_t len, uint8_t t)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) d[i] = div255(d[i] * (255 - t) + s[i] * t);
+}
+
+static void
+ref_max(uint8_t *d, const uint8_t *s, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) d[i] = (s[i] > d[i]) ? s[i] : d[i];
+}
+
+static void
+ref_multiply(uint8_t *d, const uint8_t *s, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) d[i] = div255(d[i] * s[i]);
+}
+
+static void
+ref_invert(uint8_t *d, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) d[i] = 255 - d[i];
+}
+
+/* a is the fill color's every channel, or the opacity */
+static void
+kernel(int k, struct pixel *d, const struct pixel *s, int n, uint8_t a)
+{
+	struct pixel	p = { a, (uint8_t)(a * 7), (uint8_t)~a };
+
+	switch (k) {
+	case FILL:	fb_fill(d, n, p); break;
+	case ADD:	fb_add(d, s, n); break;
+	case SCALE:	fb_scale(d, n, a); break;
+	case LERP:	fb_lerp(d, s, n, a); break;
+	case MAX:	fb_max(d, s, n); break;
+	case MULTIPLY:	fb_multiply(d, s, n); break;
+	case INVERT:	fb_invert(d, n); break;
+	}
+}
+
+static void
+reference(int k, uint8_t *d, const uint8_t *s, size_t len, uint8_t a)
+{
+	struct pixel	p = { a, (uint8_t)(a * 7), (uint8_t)~a };
+
+	switch (k) {
+	case FILL:	ref_fill(d, len, p); break;
+	case ADD:	ref_add(d, s, len); break;
+	case SCALE:	ref_scale(d, len, a); break;
+	case LERP:	ref_lerp(d, s, len, a); break;
+	case MAX:	ref_max(d, s, len); break;
+	case MULTIPLY:	ref_multiply(d, s, len); break;
+	case INVERT:	ref_invert(d, len); break;
+	}
+}
+
+static void
+fill(uint8_t *p, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) p[i] = rand();
+}
+
+void
+kernels_check(void)
+{
+	static uint8_t	x[PAIRS * 3], y[PAIRS * 3], got[PAIRS * 3],
+			want[PAIRS * 3];
+	uint8_t		src[ROWMAX * 3 + SKEW], dst[ROWMAX * 3 + SKEW + 1];
+	uint8_t		wdst[sizeof(dst)];
+	size_t		i;
+	int		k, a, n, skew;
+
+	/* every pair of bytes */
+	for (i = 0; i < sizeof(x); i++) {
+		x[i] = i;
+		y[i] = i >> 8;
+	}
+
+	for (k = 0; k < KERNELS; k++)
+		for (a = 0; a < 256; a += (k == SCALE || k == LERP) ? 1 : 51) {
+			memcpy(got, x, sizeof(x));
+			memcpy(want, x, sizeof(x));
+			kernel(k, (struct pixel *)got, (struct pixel *)y, PAIRS,
+			    a);
+			reference(k, want, y, sizeof(x), a);
+
+			for (i = 0; i < sizeof(x); i++)
+				if (got[i] != want[i]) break;
+			CHECK(i == sizeof(x), "%s at %d: %u and %u gave %u, "
+			    "should be %u", names[k], a, x[i], y[i], got[i],
+			    want[i]);
+		}
+
+	/* short rows, and rows at odd addresses, and that nothing
+	 * past the end is touched
+	 */
+	srand(2);
+	for (k = 0; k < KERNELS; k++)
+		for (n = 0; n <= ROWMAX; n++)
+			for (skew = 0; skew < SKEW; skew++) {
+				a = rand() & 0xff;
+				fill(src, sizeof(src));
+				fill(dst, sizeof(dst));
+				memcpy(wdst, dst, sizeof(dst));
+
+				kernel(k, (struct pixel *)(dst + skew),
+				    (struct pixel *)(src + SKEW - 1 - skew), n,
+				    a);
+				reference(k, wdst + skew, src + SKEW - 1 - skew,
+				    n * 3, a);
+
+				CHECK(memcmp(dst, wdst, sizeof(dst)) == 0,
+				    "%s, %d pixels at +%d: wrong", names[k], n,
+				    skew);
+			}
+
+	/* the hash only sees bytes, wherever they are, and any
+	 * one of them changing changes it
+	 */
+	for (n = 1; n <= ROWMAX; n++) {
+		fill(src, n * 3);
+		for (skew = 0; skew < SKEW; skew++) {
+			memcpy(dst + skew, src, n * 3);
+			CHECK(fb_hash((struct pixel *)(dst + skew), n) ==
+			    fb_hash((struct pixel *)src, n), "hash of %d "
+			    "pixels at +%d isn't the same", n, skew);
+		}
+
+		for (i = 0; i < (size_t)n * 3; i++)
+			for (a = 1; a < 256; a++) {
+				memcpy(dst, src, n * 3);
+				dst[i] ^= a;
+				CHECK(fb_hash((struct pixel *)dst, n) !=
+				    fb_hash((struct pixel *)src, n), "hash of "
+				    "%d pixels missed byte %zu ^ %d", n, i, a);
+			}
+	}
+}
+
+void
+kernels_bench(void)
+{
+	static struct pixel	d[STRIP], s[STRIP];
+	uint64_t		start, n;
+	char			what[64];
+	int			k, which;
+
+	fill((uint8_t *)s, sizeof(s));
+
+	for (k = 0; k < KERNELS; k++)
+		for (which = 0; which < 2; which++) {
+			fill((uint8_t *)d, sizeof(d));
+
+			n = 0;
+			start = bench_now();
+			do {
+				if (which == 0) kernel(k, d, s, STRIP, 200);
+				else reference(k, (uint8_t *)d, (uint8_t *)s,
+				    sizeof(d), 200);
+				n++;
+			} while (bench_now() - start < BENCH_NS);
+
+			snprintf(what, sizeof(what), "%s, %s, %d leds",
+			    names[k], which ? "bytes" : "fb.c", STRIP);
+			bench_report(what, n, bench_now() - start, STRIP,
+			    "pixel");
+		}
+
+	n = 0;
+	start = bench_now();
+	do {
+		d[0].r += fb_hash(s, STRIP);
+		n++;
+	} while (bench_now() - start < BENCH_NS);
+	snprintf(what, sizeof(what), "hash, %d leds", STRIP);
+	bench_report(what, n, bench_now() - start, STRIP, "pixel");
+}
@@ -0,0 +1,387 @@
+/* layers.c
+ * compose.c and effect.c: what the lamp's effects render, and
+ * what a frame costs, at the ring's 16 LEDs and at strip sizes.
+ * then how few frames each needs to send
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "frame.h"
+
+#define RING		16
+#define DARK		15
+
+/* the lamp's default */
+#define FPS		100
+
+static const struct pixel	black = { 0, 0, 0 };
+static const struct pixel	white = { 255, 255, 255 };
+static const struct pixel	red = { 0, 255, 0 };
+static const struct pixel	yellow = { 255, 255, 0 };
+static const struct pixel	cyan = { 255, 0, 255 };
+
+static struct pixel	mask_pixel(struct compose_layer *, int,
+			    const struct compose_time *);
+static int		same(struct pixel, struct pixel);
+static void		render(struct compose *, struct pixel *, int,
+			    uint64_t *, uint64_t);
+static void		check_rates(void);
+static int		play(struct compose *, struct pixel *, int, uint64_t *,
+			    uint64_t, uint32_t *);
+static void		check_idle(void);
+
+/* as led.c does it */
+static struct pixel
+mask_pixel(struct compose_layer *l, int i, const struct compose_time *t)
+{
+	(void)l;
+	(void)t;
+	return (i == DARK) ? black : white;
+}
+
+static int
+same(struct pixel a, struct pixel b)
+{
+	return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+/* frames at fps from *now on, the last one right at until */
+static void
+render(struct compose *c, struct pixel *out, int fps, uint64_t *now,
+    uint64_t until)
+{
+	uint64_t	step = 1000000 / fps;
+
+	do {
+		*now = (*now + step < until) ? *now + step : until;
+		compose_render(c, out, *now);
+	} while (*now < until);
+}
+
+static void
+check_blends(void)
+{
+	struct pixel	scratch[1], out[1];
+	struct effect	a, b;
+	struct compose	c;
+	struct pixel	grey = { 128, 128, 128 }, dim = { 64, 0, 200 };
+
+	compose_init(&c, 1, scratch);
+	effect_solid(&c, 0, &a, grey, 0);
+	effect_solid(&c, 1, &b, dim, 0);
+
+	c.layers[1].blend = COMPOSE_OVER;
+	c.layers[1].opacity = 128;
+	compose_render(&c, out, 0);
+	CHECK(out[0].g == 96 && out[0].r == 64 && out[0].b == 164,
+	    "over: %u %u %u", out[0].g, out[0].r, out[0].b);
+
+	c.layers[1].blend = COMPOSE_ADD;
+	c.layers[1].opacity = 255;
+	compose_render(&c, out, 0);
+	CHECK(out[0].g == 192 && out[0].r == 128 && out[0].b == 255,
+	    "add: %u %u %u", out[0].g, out[0].r, out[0].b);
+
+	c.layers[1].blend = COMPOSE_MULTIPLY;
+	compose_render(&c, out, 0);
+	CHECK(out[0].g == 32 && out[0].r == 0 && out[0].b == 100,
+	    "multiply: %u %u %u", out[0].g, out[0].r, out[0].b);
+
+	c.layers[1].opacity = 0;
+	compose_render(&c, out, 0);
+	CHECK(same(out[0], grey), "multiply at 0 should leave it alone");
+
+	c.layers[1].blend = COMPOSE_MAX;
+	c.layers[1].opacity = 255;
+	compose_render(&c, out, 0);
+	CHECK(out[0].g == 128 && out[0].r == 128 && out[0].b == 200,
+	    "max: %u %u %u", out[0].g, out[0].r, out[0].b);
+}
+
+void
+layers_check(void)
+{
+	struct pixel	scratch[RING], out[RING], before[RING];
+	struct effect	e;
+	struct compose	c;
+	uint64_t	now;
+	int		i, delta;
+
+	check_blends();
+
+	compose_init(&c, RING, scratch);
+	compose_set(&c, COMPOSE_LAYERS - 1, NULL, mask_pixel,
+	    COMPOSE_MULTIPLY, 255, NULL, 0);
+
+	/* solid, with the dark LED dark */
+	now = 0;
+	effect_solid(&c, 0, &e, red, now);
+	render(&c, out, FPS, &now, 0);
+	for (i = 0; i < RING; i++)
+		CHECK(same(out[i], (i == DARK) ? black : red),
+		    "solid: led %d is %u %u %u", i, out[i].g, out[i].r, out[i].b);
+
+	/* blink: up to full in a second, back down in another */
+	now = 0;
+	effect_blink(&c, 0, &e, yellow, now);
+	render(&c, out, FPS, &now, EFFECT_RAMP_US);
+	CHECK(same(out[0], yellow), "blink should peak after a second, "
+	    "got %u %u %u", out[0].g, out[0].r, out[0].b);
+	render(&c, out, FPS, &now, 2 * EFFECT_RAMP_US);
+	CHECK(same(out[0], black), "blink should be out after two seconds");
+	render(&c, out, FPS, &now, 2 * EFFECT_RAMP_US + EFFECT_RAMP_US / 5);
+	CHECK(out[0].r == 51 && out[0].g == out[0].r && out[0].b == 0,
+	    "blink should be a fifth of the way back up, got %u",
+	    out[0].r);
+
+	/* spin: red all the way up in a second, then the
+	 * gradient turns by an LED for every delta steps
+	 */
+	now = 0;
+	effect_spin(&c, 0, &e, red, now);
+	render(&c, out, FPS, &now, EFFECT_RAMP_US);
+	for (i = 0; i < RING; i++) {
+		if (i == DARK) continue;
+		CHECK(out[i].r == 255 && out[i].g == 0,
+		    "spin: led %d should be full red", i);
+	}
+
+	CHECK(out[0].b == 0 && out[RING / 2].b == 255,
+	    "spin gradient should run from 0 to full over half the ring");
+
+	memcpy(before, out, sizeof(out));
+	delta = 255 / (RING / 2) + 1;
+	render(&c, out, FPS, &now, EFFECT_RAMP_US +
+	    (delta * 1000000 + EFFECT_SPIN_RATE - 1) / EFFECT_SPIN_RATE);
+	for (i = 0; i + 1 < DARK; i++)
+		CHECK(same(out[i], before[i + 1]),
+		    "spin should turn an LED every %d steps (led %d)", delta, i);
+
+	check_rates();
+	check_idle();
+}
+
+/* whatever the frame rate, a frame at a given moment is the
+ * same frame
+ */
+static void
+check_rates(void)
+{
+	void		(*set[])(struct compose *, int, struct effect *,
+			    struct pixel, uint64_t) = {
+			    effect_blink, effect_spin };
+	int		rates[] = { 30, 85, 200, 1000 };
+	struct pixel	scratch[RING], want[RING], got[RING];
+	struct effect	e;
+	struct compose	c;
+	uint64_t	now, at;
+	size_t		i, r;
+
+	compose_init(&c, RING, scratch);
+
+	for (i = 0; i < sizeof(set) / sizeof(set[0]); i++)
+		for (at = 1000; at < 8 * EFFECT_RAMP_US; at += 333333) {
+			now = 0;
+			set[i](&c, 0, &e, yellow, now);
+			render(&c, want, 25, &now, at);
+
+			for (r = 0; r < sizeof(rates) / sizeof(int); r++) {
+				now = 0;
+				set[i](&c, 0, &e, yellow, now);
+				render(&c, got, rates[r], &now, at);
+
+				CHECK(memcmp(got, want, sizeof(got)) == 0,
+				    "effect %zu at %lu us: %d fps isn't 25 "
+				    "fps", i, (unsigned long)at, rates[r]);
+			}
+		}
+}
+
+/* frames from *now to until as led.c sends them: none at all
+ * while nothing's pending, and only those that something
+ * changed for or that look different from the last one sent,
+ * whose hash is in *last. how many went out
+ */
+static int
+play(struct compose *c, struct pixel *out, int fps, uint64_t *now,
+    uint64_t until, uint32_t *last)
+{
+	uint64_t	step = 1000000 / fps;
+	uint32_t	hash;
+	int		sent = 0, changed;
+
+	while (*now < until) {
+		*now += step;
+		if (!compose_pending(c)) continue;
+
+		changed = compose_render(c, out, *now);
+		if ((hash = fb_hash(out, c->nleds)) == *last && !changed)
+			continue;
+
+		*last = hash;
+		sent++;
+	}
+
+	return sent;
+}
+
+/* what's still costs nothing after its first frame, and what
+ * moves is never mistaken for still
+ */
+static void
+check_idle(void)
+{
+	const uint8_t	static_program[] = { VM_I, VM_DUP, VM_N, VM_END };
+	const uint8_t	timed_program[] = { VM_T, VM_DUP, VM_DUP, VM_END };
+	struct pixel	scratch[RING], out[RING];
+	struct effect	e;
+	struct compose	c;
+	struct vm	v;
+	uint64_t	now = 0;
+	uint32_t	last = 0;
+	int		sent;
+
+	compose_init(&c, RING, scratch);
+	compose_set(&c, COMPOSE_LAYERS - 1, NULL, mask_pixel,
+	    COMPOSE_MULTIPLY, 255, NULL, 0);
+	compose_still(&c, COMPOSE_LAYERS - 1);
+
+	effect_solid(&c, 0, &e, red, now);
+	sent = play(&c, out, FPS, &now, now + 10 * 1000000, &last);
+	CHECK(sent == 1 && !compose_pending(&c), "solid sent %d frames, "
+	    "should be 1 then idle", sent);
+
+	/* the same color again goes once more: something was set,
+	 * and the hash alone can't say it came out the same
+	 */
+	effect_solid(&c, 0, &e, red, now);
+	CHECK(compose_pending(&c), "setting a layer should wake it");
+	sent = play(&c, out, FPS, &now, now + 1000000, &last);
+	CHECK(sent == 1 && !compose_pending(&c), "same solid sent %d "
+	    "frames", sent);
+
+	/* so a new color whose frame collides with the last one
+	 * sent still makes it out
+	 */
+	fb_fill(out, RING, cyan);
+	out[DARK] = black;
+	last = fb_hash(out, RING);
+	effect_solid(&c, 0, &e, cyan, now);
+	sent = play(&c, out, FPS, &now, now + 1000000, &last);
+	CHECK(sent == 1 && !compose_pending(&c), "a colliding solid sent "
+	    "%d frames", sent);
+
+	compose_touch(&c);
+	CHECK(compose_pending(&c), "touching should wake it");
+	play(&c, out, FPS, &now, now + 1000000, &last);
+	CHECK(!compose_pending(&c), "touch should only last a frame");
+
+	effect_blink(&c, 0, &e, yellow, now);
+	sent = play(&c, out, FPS, &now, now + 2 * EFFECT_RAMP_US, &last);
+	CHECK(compose_pending(&c) && sent > FPS, "blink sent %d frames in "
+	    "two seconds", sent);
+
+	CHECK(vm_load(&v, static_program, sizeof(static_program), RING,
+	    NULL) == 0, "static program refused");
+	effect_program(&c, 0, &e, &v, red, now);
+	sent = play(&c, out, FPS, &now, now + 1000000, &last);
+	CHECK(sent == 1 && !compose_pending(&c), "program without t sent "
+	    "%d frames", sent);
+
+	CHECK(vm_load(&v, timed_program, sizeof(timed_program), RING,
+	    NULL) == 0, "timed program refused");
+	effect_program(&c, 0, &e, &v, red, now);
+	play(&c, out, FPS, &now, now + 1000000, &last);
+	CHECK(compose_pending(&c), "program with t should keep moving");
+
+	compose_clear(&c, 0);
+	CHECK(compose_pending(&c), "clearing a layer should wake it");
+}
+
+static void
+bench_effect(const char *name, int n,
+    void (*set)(struct compose *, int, struct effect *, struct pixel,
+    uint64_t))
+{
+	struct pixel	*scratch, *out;
+	struct effect	 e;
+	struct compose	 c;
+	uint64_t	 start, now = 0, frames = 0;
+	char		 what[64];
+
+	if ((scratch = calloc(n, sizeof(struct pixel))) == NULL ||
+	    (out = calloc(n, sizeof(struct pixel))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	compose_init(&c, n, scratch);
+	compose_set(&c, COMPOSE_LAYERS - 1, NULL, mask_pixel,
+	    COMPOSE_MULTIPLY, 255, NULL, 0);
+	set(&c, 0, &e, yellow, 0);
+
+	start = bench_now();
+	do {
+		render(&c, out, FPS, &now, now + 64 * (1000000 / FPS));
+		frames += 64;
+	} while (bench_now() - start < BENCH_NS);
+
+	snprintf(what, sizeof(what), "%s, %d leds, 2 layers", name, n);
+	bench_report(what, frames, bench_now() - start, n, "pixel");
+
+	free(scratch);
+	free(out);
+}
+
+/* of a minute's frames at rates, how many are worth sending */
+static void
+bench_sent(const char *name, void (*set)(struct compose *, int,
+    struct effect *, struct pixel, uint64_t))
+{
+	int		rates[] = { FPS, 200, 400 };
+	struct pixel	scratch[RING], out[RING];
+	struct effect	e;
+	struct compose	c;
+	uint64_t	now;
+	uint32_t	last;
+	char		what[64];
+	size_t		r;
+	int		sent;
+
+	compose_init(&c, RING, scratch);
+	compose_set(&c, COMPOSE_LAYERS - 1, NULL, mask_pixel,
+	    COMPOSE_MULTIPLY, 255, NULL, 0);
+	compose_still(&c, COMPOSE_LAYERS - 1);
+
+	for (r = 0; r < sizeof(rates) / sizeof(int); r++) {
+		now = 0;
+		last = 0;
+		set(&c, 0, &e, yellow, now);
+		sent = play(&c, out, rates[r], &now, 60 * 1000000ULL, &last);
+
+		snprintf(what, sizeof(what), "%s at %d fps", name, rates[r]);
+		printf("  %-40s %10d sent %8.1f%% of frames\n", what, sent,
+		    100.0 * sent / (60 * rates[r]));
+	}
+}
+
+void
+layers_bench(void)
+{
+	int	sizes[] = { RING, 1000 };
+	size_t	i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(int); i++) {
+		bench_effect("solid", sizes[i], effect_solid);
+		bench_effect("blink", sizes[i], effect_blink);
+		bench_effect("spin", sizes[i], effect_spin);
+	}
+
+	bench_sent("solid", effect_solid);
+	bench_sent("blink", effect_blink);
+	bench_sent("spin", effect_spin);
+}
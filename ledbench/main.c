@@ -0,0 +1,129 @@
+/* ledbench
+ * the lamp's frame engine (embed/main/frame.h), built for the
+ * desktop: every suite checks its module against what it should
+ * produce, then times it. exits nonzero if any check failed
+ *
+ *	ledbench [-c] [suite ...]
+ *
+ * -c only checks, for make check
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+struct suite {
+	const char	*name;
+	void		(*check)(void);
+	void		(*bench)(void);
+};
+
+static const struct suite	suites[] = {
+	{ "layers",	layers_check,	layers_bench },
+	{ "pipeline",	pipeline_check,	pipeline_bench },
+	{ "encoder",	encoder_check,	encoder_bench },
+	{ "output",	stage_check,	stage_bench },
+	{ "kernels",	kernels_check,	kernels_bench },
+	{ "vm",		programs_check,	programs_bench },
+};
+
+#define NSUITES	(sizeof(suites) / sizeof(struct suite))
+
+static int	failures = 0;
+
+void
+bench_fail(const char *file, int line, const char *fmt, ...)
+{
+	va_list	ap;
+
+	fprintf(stderr, "%s:%d: ", file, line);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	failures++;
+}
+
+uint64_t
+bench_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* n runs of something that handles per units each took ns */
+void
+bench_report(const char *what, uint64_t n, uint64_t ns, uint64_t per,
+    const char *unit)
+{
+	printf("  %-40s %10.1f ns/op %8.2f ns/%s\n", what,
+	    (double)ns / n, (double)ns / n / per, unit);
+}
+
+static void
+usage(void)
+{
+	size_t	i;
+
+	fprintf(stderr, "usage: %s [-c] [suite ...]\nsuites:",
+	    program_invocation_short_name);
+	for (i = 0; i < NSUITES; i++) fprintf(stderr, " %s", suites[i].name);
+	fputc('\n', stderr);
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t	i;
+	int	ch, j, checkonly = 0, want;
+
+	while ((ch = getopt(argc, argv, "c")) != -1) {
+		switch (ch) {
+		case 'c':
+			checkonly = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	for (j = 0; j < argc; j++) {
+		for (i = 0; i < NSUITES; i++)
+			if (strcmp(argv[j], suites[i].name) == 0) break;
+		if (i == NSUITES) usage();
+	}
+
+	for (i = 0; i < NSUITES; i++) {
+		want = (argc == 0);
+		for (j = 0; j < argc; j++)
+			if (strcmp(argv[j], suites[i].name) == 0) want = 1;
+		if (!want) continue;
+
+		printf("%s\n", suites[i].name);
+		suites[i].check();
+		if (!checkonly) suites[i].bench();
+	}
+
+	if (failures > 0) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf("all checks passed\n");
+	return 0;
+}
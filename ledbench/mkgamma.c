@@ -0,0 +1,40 @@
+/* mkgamma
+ * writes ../embed/main/gamma.h, the lamp's gamma table, so the
+ * lamp itself never has to do floating point. run it through
+ * make gamma if GAMMA changes
+ *
+ * entries are 8.8 fixed point: the whole part is what we'd
+ * send, and the fraction is what dithering spreads over frames
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+/* in tenths. WS2812s are about this far from linear */
+#define GAMMA		28
+
+int
+main(void)
+{
+	double	x;
+	int	i;
+
+	printf("/* gamma.h\n"
+	    " * generated by ledbench/mkgamma, don't edit: 8.8 fixed point\n"
+	    " * light for each 8 bit level, at a gamma of %d.%d\n"
+	    " */\n\n"
+	    "#ifndef GAMMA_H\n"
+	    "#define GAMMA_H\n\n"
+	    "#include <stdint.h>\n\n"
+	    "#define GAMMA\t\t%d\n\n"
+	    "static const uint16_t gamma_table[256] = {",
+	    GAMMA / 10, GAMMA % 10, GAMMA);
+
+	for (i = 0; i < 256; i++) {
+		x = pow(i / 255.0, GAMMA / 10.0) * 255 * 256;
+		printf("%s%5d,", (i % 8 == 0) ? "\n\t" : " ", (int)lround(x));
+	}
+
+	printf("\n};\n\n#endif /* GAMMA_H */\n");
+	return 0;
+}
@@ -0,0 +1,345 @@
+/* pipeline.c
+ * pipe.c: a renderer and a transmitter sharing frame buffers the
+ * way led.c and the RMT driver do, interleaved at random a pixel
+ * at a time. every frame has to go out whole, in order, and
+ * without the renderer ever writing a buffer that's on the wire
+ *
+ * and the pace led.c's render task keeps, on a clock of our own:
+ * frames go out on the grid, never early, and every slot is
+ * either sent or counted missed
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "frame.h"
+
+#define LEDS		16
+#define STEPS		400000
+
+#define PERIOD		16667
+#define FRAMES		100000
+
+struct model {
+	struct pipe	 p;
+	struct pixel	 mem[PIPE_BUFFERS * LEDS];
+
+	/* the renderer, and how far into its back buffer it is */
+	struct pixel	*back;
+	int		 drawn;
+	uint32_t	 frame;
+
+	/* the transmitter, and how far into the oldest frame */
+	struct pixel	*wire[PIPE_BUFFERS];
+	int		 nwire, sent;
+	uint32_t	 last, frames;
+};
+
+static uint32_t	rng = 2463534242u;
+
+static uint32_t		roll(void);
+static struct pixel	stamp(uint32_t);
+static uint32_t		unstamp(struct pixel);
+static void		render(struct model *, int);
+static void		transmit(struct model *);
+static void		audit(struct model *);
+static void		run(int, int, int);
+static void		pacing(uint64_t, uint64_t);
+
+static uint32_t
+roll(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+/* frame numbers go in the pixels themselves, so a frame that
+ * gets written while it's read out comes out mixed
+ */
+static struct pixel
+stamp(uint32_t frame)
+{
+	struct pixel	p;
+
+	p.g = frame >> 16;
+	p.r = frame >> 8;
+	p.b = frame;
+	return p;
+}
+
+static uint32_t
+unstamp(struct pixel p)
+{
+	return (uint32_t)p.g << 16 | (uint32_t)p.r << 8 | p.b;
+}
+
+/* one pixel of the next frame, submitting it once it's done.
+ * now and then the driver turns one down
+ */
+static void
+render(struct model *m, int refuse)
+{
+	if (m->back == NULL) {
+		if ((m->back = pipe_acquire(&m->p)) == NULL) return;
+		m->drawn = 0;
+		m->frame++;
+	}
+
+	m->back[m->drawn++] = stamp(m->frame);
+	if (m->drawn < LEDS) return;
+
+	CHECK(pipe_submit(&m->p, m->back) == 0, "frame %u wasn't submitted",
+	    m->frame);
+
+	if (refuse && roll() % 16 == 0)
+		CHECK(pipe_abandon(&m->p, m->back) == 0,
+		    "frame %u couldn't be abandoned", m->frame);
+	else m->wire[m->nwire++] = m->back;
+
+	m->back = NULL;
+}
+
+/* one pixel of the oldest frame out, giving the buffer back
+ * once it's all gone
+ */
+static void
+transmit(struct model *m)
+{
+	uint32_t	first, f;
+
+	if (m->nwire == 0) return;
+
+	first = unstamp(m->wire[0][0]);
+	f = unstamp(m->wire[0][m->sent]);
+	CHECK(f == first, "frame %u torn by frame %u at pixel %d", first, f,
+	    m->sent);
+	if (++m->sent < LEDS) return;
+
+	CHECK(first > m->last, "frame %u went out after frame %u", first,
+	    m->last);
+	CHECK(pipe_done(&m->p) == m->wire[0], "frame %u: wrong buffer back",
+	    first);
+
+	m->last = first;
+	m->frames++;
+	m->sent = 0;
+	memmove(m->wire, m->wire + 1, --m->nwire * sizeof(struct pixel *));
+}
+
+/* every buffer is in exactly the state its holder thinks */
+static void
+audit(struct model *m)
+{
+	int	i, j, want;
+
+	for (i = 0; i < m->p.nbufs; i++) {
+		want = PIPE_FREE;
+		if (m->p.bufs[i] == m->back) want = PIPE_RENDERING;
+		for (j = 0; j < m->nwire; j++)
+			if (m->p.bufs[i] == m->wire[j]) want = PIPE_QUEUED;
+
+		CHECK(m->p.state[i] == want, "buffer %d is %d, should be %d",
+		    i, m->p.state[i], want);
+	}
+
+	CHECK(m->p.queued == m->nwire, "%d queued, %d on the wire",
+	    m->p.queued, m->nwire);
+}
+
+/* the renderer gets pace in 16 of the steps, the transmitter
+ * the rest
+ */
+static void
+run(int nbufs, int pace, int refuse)
+{
+	static struct model	m;
+	int			i;
+
+	memset(&m, 0, sizeof(struct model));
+	pipe_init(&m.p, m.mem, nbufs, LEDS);
+
+	for (i = 0; i < STEPS; i++) {
+		if ((int)(roll() % 16) < pace) render(&m, refuse);
+		else transmit(&m);
+		audit(&m);
+	}
+
+	while (m.nwire > 0) transmit(&m);
+	audit(&m);
+
+	CHECK(m.frames > 0, "%d buffers, pace %d: nothing went out", nbufs,
+	    pace);
+	CHECK(m.p.done == m.frames && m.p.submitted == m.frames,
+	    "%d buffers, pace %d: %u submitted, %u done, %u went out",
+	    nbufs, pace, m.p.submitted, m.p.done, m.frames);
+}
+
+/* render taking up to render us and the wire up to wire, each
+ * at random. a frame goes at its slot, or when the one before
+ * is off the wire if that's later. one in eight comes out the
+ * same as the last, and its slot's skipped
+ */
+static void
+pacing(uint64_t render, uint64_t wire)
+{
+	struct pace	pc;
+	uint64_t	now, start, slot, last, free, late, worst = 0;
+	uint64_t	sum = 0, steady = 0, settle = 0;
+	uint32_t	skips = 0;
+	int		i;
+
+	/* the first frame's for a slot that's already here, so it's
+	 * late by however long it took, and the wire puts that on the
+	 * frames after it. keeping up, they catch up by at least
+	 * PERIOD - wire each
+	 */
+	if (render < PERIOD && wire < PERIOD)
+		settle = render / (PERIOD - wire) + 2;
+
+	now = start = 1000000;
+	free = 0;
+	last = 0;
+	pace_init(&pc, PERIOD, now);
+
+	for (i = 0; i < FRAMES; i++) {
+		slot = pace_slot(&pc, now);
+		CHECK((slot - start) % PERIOD == 0, "slot %llu off the grid",
+		    (unsigned long long)slot);
+		CHECK(i == 0 || slot > last, "slot %llu after %llu",
+		    (unsigned long long)slot, (unsigned long long)last);
+		last = slot;
+
+		now += roll() % (render + 1);
+		if (now < slot) now = slot;
+
+		if (roll() % 8 == 0) {
+			pace_skip(&pc);
+			skips++;
+			continue;
+		}
+
+		if (now < free) now = free;
+
+		late = now - slot;
+		if (late > worst) worst = late;
+		if ((uint64_t)i >= settle && late > steady) steady = late;
+		sum += late;
+		pace_sent(&pc, now);
+		free = now + roll() % (wire + 1);
+	}
+
+	CHECK(pc.frames + pc.skipped == FRAMES && pc.skipped == skips,
+	    "%u frames sent and %u skipped of %d", pc.frames, pc.skipped,
+	    FRAMES);
+	CHECK((pc.next - start) / PERIOD == pc.frames + pc.missed +
+	    pc.skipped, "%llu slots went by, %u sent, %u missed and %u "
+	    "skipped", (unsigned long long)((pc.next - start) / PERIOD),
+	    pc.frames, pc.missed, pc.skipped);
+	CHECK(pc.jittermax == worst && pc.jittersum == sum,
+	    "jitter %u worst, %llu in all; should be %llu, %llu",
+	    pc.jittermax, (unsigned long long)pc.jittersum,
+	    (unsigned long long)worst, (unsigned long long)sum);
+
+	/* and after that, right on time every time */
+	if (settle > 0)
+		CHECK(pc.missed == 0 && steady == 0,
+		    "render %llu, wire %llu: %u missed, %llu us late",
+		    (unsigned long long)render, (unsigned long long)wire,
+		    pc.missed, (unsigned long long)steady);
+}
+
+void
+pipeline_check(void)
+{
+	static struct pixel	mem[PIPE_BUFFERS * LEDS];
+	struct pipe		p;
+	struct pace		pc;
+	struct pixel		*a, *b, *c;
+	int			nbufs, busy;
+
+	/* the edges: running dry, and giving back the wrong thing */
+	pipe_init(&p, mem, 2, LEDS);
+	a = pipe_acquire(&p);
+	b = pipe_acquire(&p);
+	CHECK(a != NULL && b != NULL && a != b, "two buffers, two frames");
+	CHECK(pipe_acquire(&p) == NULL && p.skipped == 1,
+	    "a third frame with nowhere to go");
+	CHECK(pipe_done(&p) == NULL, "done with nothing queued");
+	CHECK(pipe_submit(&p, mem + 1) < 0, "submitted a stray pointer");
+
+	pipe_submit(&p, a);
+	pipe_submit(&p, b);
+	CHECK(pipe_submit(&p, a) < 0, "submitted a frame twice");
+	CHECK(pipe_abandon(&p, a) < 0, "abandoned a frame behind another");
+	CHECK(pipe_abandon(&p, b) == 0 && p.queued == 1,
+	    "abandoned the newest frame");
+	CHECK(pipe_done(&p) == a, "the oldest frame comes back first");
+	c = pipe_acquire(&p);
+	CHECK(c != NULL && pipe_acquire(&p) != NULL,
+	    "both buffers free again");
+
+	for (nbufs = 2; nbufs <= PIPE_BUFFERS; nbufs++)
+		for (busy = 2; busy <= 14; busy += 4) {
+			run(nbufs, busy, 0);
+			run(nbufs, busy, 1);
+		}
+
+	/* coming back from idle isn't missing anything, nor is
+	 * being a little late. a stall is, but only the slots that
+	 * have been and gone: the one it's in is still on
+	 */
+	pace_init(&pc, PERIOD, 0);
+	pace_restart(&pc, 100 * PERIOD + 5);
+	CHECK(pace_slot(&pc, 100 * PERIOD + 5) == 100 * PERIOD + 5 &&
+	    pc.missed == 0, "%u slots missed while idle", pc.missed);
+	CHECK(pace_slot(&pc, 100 * PERIOD + 6) == 100 * PERIOD + 5 &&
+	    pc.missed == 0, "%u slots missed a microsecond late",
+	    pc.missed);
+	CHECK(pace_slot(&pc, 101 * PERIOD + 4) == 100 * PERIOD + 5 &&
+	    pc.missed == 0, "%u slots missed all but a period late",
+	    pc.missed);
+	CHECK(pace_slot(&pc, 103 * PERIOD + 6) == 103 * PERIOD + 5 &&
+	    pc.missed == 3, "%u slots missed in a stall of 3 and a bit",
+	    pc.missed);
+
+	/* and nothing to send isn't a miss either */
+	pace_skip(&pc);
+	CHECK(pace_slot(&pc, 103 * PERIOD + 6) == 104 * PERIOD + 5 &&
+	    pc.missed == 3 && pc.skipped == 1 && pc.frames == 0,
+	    "skipped a slot: %u missed, %u skipped, %u sent", pc.missed,
+	    pc.skipped, pc.frames);
+
+	pacing(PERIOD / 2, PERIOD * 9 / 10);
+	pacing(PERIOD * 3 / 2, PERIOD / 2);
+	pacing(PERIOD / 2, PERIOD * 3 / 2);
+	pacing(PERIOD * 2, PERIOD * 2);
+}
+
+void
+pipeline_bench(void)
+{
+	static struct pixel	mem[PIPE_BUFFERS * LEDS];
+	struct pipe		p;
+	struct pixel		*back;
+	uint64_t		start, n = 0;
+	int			i;
+
+	pipe_init(&p, mem, PIPE_BUFFERS, LEDS);
+
+	start = bench_now();
+	do {
+		for (i = 0; i < 1024; i++) {
+			back = pipe_acquire(&p);
+			pipe_submit(&p, back);
+			pipe_done(&p);
+		}
+		n += 1024;
+	} while (bench_now() - start < BENCH_NS);
+
+	bench_report("acquire, submit, done", n, bench_now() - start, 1,
+	    "frame");
+}
@@ -0,0 +1,404 @@
+/* programs.c
+ * vm.c: that every instruction does what it says, that the
+ * verifier turns away everything it should and lets through
+ * what it should, and that nothing it lets through can go
+ * wrong. then what a program costs a pixel
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "frame.h"
+
+#define RING		16
+#define STRIP		512
+
+/* random programs thrown at the verifier, and how long */
+#define FUZZ		200000
+#define FUZZLEN		24
+
+struct rejection {
+	const char	*why;
+	uint8_t		 code[VM_CODEMAX + 1];
+	size_t		 len;
+};
+
+/* an operation on two pushed u16s, then the low 24 bits of
+ * what it left as r, g and b
+ */
+#define BINARY(A, B, OP)						\
+	VM_PUSH16, (A) >> 8, (A) & 0xff, VM_PUSH16, (B) >> 8, (B) & 0xff,\
+	OP, VM_DUP, VM_PUSH, 255, VM_AND, VM_SWAP, VM_DUP, VM_PUSH, 8,	\
+	VM_SHR, VM_PUSH, 255, VM_AND, VM_SWAP, VM_PUSH, 16, VM_SHR,	\
+	VM_PUSH, 255, VM_AND, VM_END
+
+/* a rainbow turning around the ring, as himasm makes it */
+static const uint8_t	rainbow[] = {
+	VM_I, VM_PUSH16, 1, 0, VM_MUL, VM_N, VM_DIV,
+	VM_T, VM_PUSH, 10, VM_DIV, VM_ADD,
+	VM_DUP, VM_SIN,
+	VM_SWAP, VM_DUP, VM_PUSH, 85, VM_ADD, VM_SIN,
+	VM_SWAP, VM_PUSH, 170, VM_ADD, VM_SIN,
+	VM_END,
+};
+
+/* white if the lamp's red, its own color if not */
+static const uint8_t	branch[] = {
+	VM_RED, VM_PUSH, 255, VM_EQ, VM_JZ, 5,
+	VM_PUSH, 255, VM_DUP, VM_DUP, VM_END,
+	VM_RED, VM_GREEN, VM_BLUE, VM_END,
+};
+
+static const struct rejection	rejections[] = {
+	{ "no code, or too much", { 0 }, 0 },
+	{ "no code, or too much", { 0 }, VM_CODEMAX + 1 },
+	{ "unknown instruction", { 0x09 }, 1 },
+	{ "instruction cut off", { VM_PUSH16, 1 }, 2 },
+	{ "unreachable code", { VM_I, VM_I, VM_I, VM_END, VM_END }, 5 },
+	{ "unreachable code", { VM_JMP, 1, VM_I, VM_I, VM_I, VM_I,
+	    VM_END }, 7 },
+	{ "stack underflow", { VM_I, VM_ADD }, 2 },
+	{ "stack underflow", { VM_I, VM_I, VM_END }, 3 },
+	{ "stack overflow", { VM_I, VM_I, VM_I, VM_I, VM_I, VM_I, VM_I,
+	    VM_I, VM_I }, 9 },
+	{ "end needs just r, g and b", { VM_I, VM_I, VM_I, VM_I,
+	    VM_END }, 5 },
+	{ "runs off the end", { VM_I, VM_I, VM_I }, 3 },
+	{ "runs off the end", { VM_I, VM_JZ, 200, VM_I, VM_I, VM_I,
+	    VM_END }, 7 },
+	{ "stack depths disagree where paths meet", { VM_I, VM_JZ, 1,
+	    VM_I, VM_I, VM_I, VM_I, VM_END }, 8 },
+	{ "jump into an instruction", { VM_I, VM_JZ, 1, VM_PUSH, 7,
+	    VM_I, VM_I, VM_END }, 8 },
+};
+
+#define NREJECTIONS	(sizeof(rejections) / sizeof(struct rejection))
+
+static struct pixel	run(const uint8_t *, size_t, int, int, uint32_t,
+			    struct pixel);
+static uint32_t		binary(uint8_t, uint32_t, uint32_t);
+static uint32_t		reference(uint8_t, uint32_t, uint32_t);
+static void		check_binary(void);
+static void		check_rejections(void);
+static size_t		generate(uint8_t *);
+static void		check_fuzz(void);
+static void		bench_program(const char *, const uint8_t *, size_t,
+			    int);
+
+/* load and run, or fail */
+static struct pixel
+run(const uint8_t *code, size_t len, int i, int n, uint32_t t,
+    struct pixel color)
+{
+	struct vm	 v;
+	const char	*why = NULL;
+
+	if (vm_load(&v, code, len, n, &why) < 0) {
+		bench_fail(__FILE__, __LINE__, "program refused: %s", why);
+		exit(1);
+	}
+
+	return vm_run(&v, i, n, t, color);
+}
+
+static uint32_t
+binary(uint8_t op, uint32_t a, uint32_t b)
+{
+	const uint8_t	code[] = { BINARY(0, 0, 0) };
+	uint8_t		c[sizeof(code)];
+	struct pixel	p, none = { 0 };
+
+	memcpy(c, code, sizeof(code));
+	c[1] = a >> 8;
+	c[2] = a;
+	c[4] = b >> 8;
+	c[5] = b;
+	c[6] = op;
+
+	p = run(c, sizeof(c), 0, 1, 0, none);
+	return (uint32_t)p.b << 16 | (uint32_t)p.g << 8 | p.r;
+}
+
+/* what each two operand instruction should do, spelled out */
+static uint32_t
+reference(uint8_t op, uint32_t a, uint32_t b)
+{
+	uint32_t	sa = a > 255 ? 255 : a, sb = b > 255 ? 255 : b;
+
+	switch (op) {
+	case VM_ADD:	return a + b;
+	case VM_SUB:	return a - b;
+	case VM_MUL:	return a * b;
+	case VM_DIV:	return b ? a / b : 0;
+	case VM_MOD:	return b ? a % b : 0;
+	case VM_AND:	return a & b;
+	case VM_OR:	return a | b;
+	case VM_XOR:	return a ^ b;
+	case VM_SHL:	return a << (b & 31);
+	case VM_SHR:	return a >> (b & 31);
+	case VM_MIN:	return a < b ? a : b;
+	case VM_MAX:	return a > b ? a : b;
+	case VM_LT:	return a < b;
+	case VM_EQ:	return a == b;
+	case VM_SCALE:	return (sa * sb + 127) / 255;
+	}
+
+	return 0;
+}
+
+static void
+check_binary(void)
+{
+	static const uint32_t	values[] = {
+		0, 1, 2, 3, 7, 8, 31, 32, 127, 128, 255, 256, 1000, 4095,
+		32767, 32768, 65534, 65535,
+	};
+	const size_t		nvalues = sizeof(values) / sizeof(*values);
+	uint32_t		want, got;
+	size_t			i, j;
+	uint8_t			op;
+
+	for (op = VM_ADD; op <= VM_SCALE; op++)
+		for (i = 0; i < nvalues; i++)
+			for (j = 0; j < nvalues; j++) {
+				want = reference(op, values[i], values[j]) &
+				    0xffffff;
+				got = binary(op, values[i], values[j]);
+				CHECK(got == want, "op %#x on %u and %u is "
+				    "%#x, should be %#x", op, values[i],
+				    values[j], got, want);
+			}
+}
+
+static void
+check_rejections(void)
+{
+	const struct rejection	*r;
+	struct vm		 v;
+	const char		*why;
+	size_t			 i;
+
+	for (i = 0; i < NREJECTIONS; i++) {
+		r = &rejections[i];
+		why = NULL;
+		CHECK(vm_check(r->code, r->len, &why) < 0, "rejection %zu "
+		    "accepted", i);
+		CHECK(why != NULL && strcmp(why, r->why) == 0, "rejection "
+		    "%zu: %s, should be %s", i, why ? why : "nothing", r->why);
+	}
+
+	/* and what's too slow depends on the strip */
+	CHECK(vm_check(rainbow, sizeof(rainbow), NULL) == 21, "rainbow "
+	    "costs %d", vm_check(rainbow, sizeof(rainbow), NULL));
+	CHECK(vm_load(&v, rainbow, sizeof(rainbow), VM_BUDGET / 21, NULL) ==
+	    0, "rainbow refused at %d", VM_BUDGET / 21);
+	CHECK(vm_load(&v, rainbow, sizeof(rainbow), VM_BUDGET / 21 + 1,
+	    &why) < 0 && strcmp(why, "too slow for this many pixels") == 0,
+	    "rainbow taken at %d", VM_BUDGET / 21 + 1);
+}
+
+/* random programs, written the way a person might: mostly
+ * keeping the stack in order, but not always, with jumps that
+ * land wherever. plenty get through, and whatever does has to
+ * run on any pixel, at any time, without touching anything it
+ * shouldn't
+ */
+static size_t
+generate(uint8_t *code)
+{
+	/* what each instruction takes off the stack and leaves */
+	static const uint8_t	effects[][3] = {
+		{ VM_PUSH, 0, 1 }, { VM_PUSH16, 0, 1 }, { VM_I, 0, 1 },
+		{ VM_N, 0, 1 }, { VM_T, 0, 1 }, { VM_RED, 0, 1 },
+		{ VM_GREEN, 0, 1 }, { VM_BLUE, 0, 1 }, { VM_ADD, 2, 1 },
+		{ VM_SUB, 2, 1 }, { VM_MUL, 2, 1 }, { VM_DIV, 2, 1 },
+		{ VM_MOD, 2, 1 }, { VM_AND, 2, 1 }, { VM_OR, 2, 1 },
+		{ VM_XOR, 2, 1 }, { VM_SHL, 2, 1 }, { VM_SHR, 2, 1 },
+		{ VM_MIN, 2, 1 }, { VM_MAX, 2, 1 }, { VM_LT, 2, 1 },
+		{ VM_EQ, 2, 1 }, { VM_SCALE, 2, 1 }, { VM_DUP, 1, 2 },
+		{ VM_DROP, 1, 0 }, { VM_SWAP, 2, 2 }, { VM_OVER, 2, 3 },
+		{ VM_SIN, 1, 1 }, { VM_TRI, 1, 1 }, { VM_CLAMP, 1, 1 },
+		{ VM_JZ, 1, 0 }, { VM_JMP, 0, 0 },
+	};
+	const size_t		neffects = sizeof(effects) / sizeof(*effects);
+	const uint8_t		*e;
+	size_t			len = 0;
+	int			depth = 0;
+
+	while (len + 4 < FUZZLEN) {
+		e = effects[rand() % neffects];
+		if (rand() % 8 != 0 &&
+		    (e[1] > depth || depth - e[1] + e[2] > VM_STACK))
+			continue;
+
+		code[len++] = e[0];
+		if (e[0] == VM_PUSH16) code[len++] = rand();
+		if (e[0] == VM_PUSH || e[0] == VM_PUSH16) code[len++] = rand();
+		if (e[0] == VM_JZ || e[0] == VM_JMP) code[len++] = rand() % 4;
+		depth += e[2] - e[1];
+		if (rand() % 6 == 0) break;
+	}
+
+	/* tidy up if it's close, and let it fail if it isn't */
+	if (depth >= 0 && depth <= VM_STACK) {
+		for (; depth > 3; depth--) code[len++] = VM_ADD;
+		for (; depth < 3; depth++) code[len++] = VM_T;
+	}
+
+	code[len++] = VM_END;
+	return len;
+}
+
+static void
+check_fuzz(void)
+{
+	struct pixel	color = { 255, 0, 255 };
+	struct vm	v;
+	uint8_t		code[FUZZLEN + 8];
+	size_t		len;
+	int		i, j, accepted = 0;
+
+	srand(47);
+	for (i = 0; i < FUZZ; i++) {
+		len = generate(code);
+		if (vm_load(&v, code, len, RING, NULL) < 0) continue;
+		accepted++;
+
+		for (j = 0; j < RING; j++)
+			vm_run(&v, j, RING, (uint32_t)rand() * 7919, color);
+	}
+
+	CHECK(accepted > FUZZ / 10, "only %d of %d random programs "
+	    "accepted", accepted, FUZZ);
+}
+
+void
+programs_check(void)
+{
+	struct pixel		p, none = { 0 };
+	struct pixel		red = { 0, 255, 0 }, cyan = { 255, 0, 255 };
+	struct compose		c;
+	struct effect		e;
+	struct vm		v;
+	struct pixel		scratch[RING], out[RING];
+	const uint8_t		wave[] = { VM_I, VM_SIN, VM_DUP, VM_DUP,
+				    VM_END };
+	const uint8_t		triangle[] = { VM_I, VM_TRI, VM_DUP, VM_DUP,
+				    VM_END };
+	int			x, want;
+
+	check_binary();
+
+	/* the sine's 128 + 127 sin, give or take a level */
+	for (x = 0; x < 512; x++) {
+		p = run(wave, sizeof(wave), x, 512, 0, none);
+		want = (int)lround(128 + 127 * sin(2 * M_PI * x / 256));
+		CHECK(abs(p.r - want) <= 1 && p.r == p.g && p.g == p.b,
+		    "sin %d is %d, should be %d", x, p.r, want);
+
+		p = run(triangle, sizeof(triangle), x, 512, 0, none);
+		want = (x < 256) ? x : 511 - x;
+		CHECK(p.r == want, "tri %d is %d, should be %d", x, p.r, want);
+	}
+
+	/* where, when and what color */
+	{
+		const uint8_t	inputs[] = { VM_I, VM_N, VM_T, VM_END };
+		const uint8_t	colors[] = { VM_BLUE, VM_RED, VM_GREEN,
+		    VM_END };
+		struct pixel	yellow = { 255, 255, 0 };
+
+		p = run(inputs, sizeof(inputs), 3, 9, 200, none);
+		CHECK(p.r == 3 && p.g == 9 && p.b == 200, "i n t came out "
+		    "%d %d %d", p.r, p.g, p.b);
+		p = run(colors, sizeof(colors), 0, 1, 0, yellow);
+		CHECK(p.r == 0 && p.g == 255 && p.b == 255, "blue red green "
+		    "of yellow came out %d %d %d", p.r, p.g, p.b);
+	}
+
+	/* the stack, and clamping on the way out */
+	{
+		const uint8_t	stack[] = { VM_PUSH, 1, VM_PUSH, 2, VM_SWAP,
+		    VM_OVER, VM_PUSH, 9, VM_DROP, VM_END };
+		const uint8_t	clamp[] = { VM_PUSH, 0, VM_PUSH, 5, VM_SUB,
+		    VM_PUSH16, 1, 0, VM_PUSH, 0, VM_PUSH, 5, VM_SUB, VM_CLAMP,
+		    VM_END };
+
+		p = run(stack, sizeof(stack), 0, 1, 0, none);
+		CHECK(p.r == 2 && p.g == 1 && p.b == 2, "swap over came out "
+		    "%d %d %d", p.r, p.g, p.b);
+		p = run(clamp, sizeof(clamp), 0, 1, 0, none);
+		CHECK(p.r == 0 && p.g == 255 && p.b == 0, "clamps came out "
+		    "%d %d %d", p.r, p.g, p.b);
+	}
+
+	/* both ways through a branch */
+	p = run(branch, sizeof(branch), 0, 1, 0, red);
+	CHECK(p.r == 255 && p.g == 255 && p.b == 255, "red took the wrong "
+	    "branch");
+	p = run(branch, sizeof(branch), 0, 1, 0, cyan);
+	CHECK(p.r == 0 && p.g == 255 && p.b == 255, "cyan took the wrong "
+	    "branch");
+
+	/* as a layer, a program's just what it runs to */
+	CHECK(vm_load(&v, rainbow, sizeof(rainbow), RING, NULL) == 0,
+	    "rainbow refused");
+	compose_init(&c, RING, scratch);
+	effect_program(&c, 0, &e, &v, red, 1000);
+	compose_render(&c, out, 1000 + 2500000);
+	for (x = 0; x < RING; x++) {
+		p = vm_run(&v, x, RING, 2500, red);
+		CHECK(memcmp(&p, &out[x], sizeof(p)) == 0, "layer pixel %d "
+		    "isn't the program's", x);
+	}
+
+	check_rejections();
+	check_fuzz();
+}
+
+static void
+bench_program(const char *what, const uint8_t *code, size_t len, int n)
+{
+	struct pixel	 color = { 0, 255, 0 }, sink = { 0 }, p;
+	struct vm	 v;
+	uint64_t	 start, frames = 0;
+	char		 label[64];
+	int		 i;
+
+	if (vm_load(&v, code, len, n, NULL) < 0) return;
+
+	start = bench_now();
+	do {
+		for (i = 0; i < n; i++) {
+			p = vm_run(&v, i, n, frames * 10, color);
+			sink.r ^= p.r;
+		}
+		frames++;
+	} while (bench_now() - start < BENCH_NS);
+
+	snprintf(label, sizeof(label), "%s, %d leds", what, n);
+	bench_report(label, frames, bench_now() - start, n, "pixel");
+	if (sink.r == 1) printf("%c", 0);
+}
+
+void
+programs_bench(void)
+{
+	uint64_t	start, n = 0;
+
+	bench_program("rainbow", rainbow, sizeof(rainbow), RING);
+	bench_program("rainbow", rainbow, sizeof(rainbow), STRIP);
+	bench_program("branch", branch, sizeof(branch), STRIP);
+
+	start = bench_now();
+	do {
+		vm_check(rainbow, sizeof(rainbow), NULL);
+		n++;
+	} while (bench_now() - start < BENCH_NS);
+	bench_report("verifying rainbow", n, bench_now() - start,
+	    sizeof(rainbow), "byte");
+}
@@ -0,0 +1,164 @@
+/* stage.c
+ * output.c: that the gamma table is what mkgamma says it should
+ * be, that brightness scales without losing levels, and that
+ * dithering gets a fraction across over frames. then what the
+ * stage costs a frame
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "frame.h"
+#include "gamma.h"
+
+#define RING		16
+#define STRIP		1000
+
+/* frames a dithered level is averaged over */
+#define FRAMES		256
+
+static unsigned int	average(struct output *, uint8_t);
+
+/* what a subpixel at level comes to over FRAMES frames, in 8.8 */
+static unsigned int
+average(struct output *o, uint8_t level)
+{
+	struct pixel	px;
+	unsigned int	sum = 0;
+	int		i;
+
+	memset(o->err, 0, OUTPUT_CHANNELS);
+	for (i = 0; i < FRAMES; i++) {
+		px.g = px.r = px.b = level;
+		output_apply(o, &px, 1);
+		sum += px.r;
+	}
+
+	return sum * 256 / FRAMES;
+}
+
+void
+stage_check(void)
+{
+	struct output	o;
+	struct pixel	px;
+	uint8_t		err[OUTPUT_CHANNELS];
+	unsigned int	want, got;
+	int		i, level;
+
+	/* the table's the curve, and never goes backwards */
+	for (i = 0; i < 256; i++) {
+		want = (unsigned int)lround(pow(i / 255.0, GAMMA / 10.0) *
+		    255 * 256);
+		CHECK(gamma_table[i] == want, "gamma %d is %u, should be %u",
+		    i, gamma_table[i], want);
+		CHECK(i == 0 || gamma_table[i] >= gamma_table[i - 1],
+		    "gamma falls at %d", i);
+	}
+
+	output_init(&o, err, 1);
+
+	/* the ends don't move, and don't dither */
+	for (i = 0; i < FRAMES; i++) {
+		px.g = 0;
+		px.r = 255;
+		px.b = 128;
+		output_apply(&o, &px, 1);
+		CHECK(px.g == 0 && px.r == 255, "frame %d: off is %d, full "
+		    "is %d", i, px.g, px.r);
+	}
+
+	/* every level, at a few brightnesses, comes out right on
+	 * average. a fraction of x/256 comes out over 256 frames,
+	 * so that's exactly
+	 */
+	for (level = 0; level <= OUTPUT_FULL; level += 85) {
+		output_brightness(&o, level);
+
+		for (i = 0; i < 256; i++) {
+			want = o.table[i];
+			got = average(&o, i);
+			CHECK(got == want,
+			    "brightness %d, level %d: %u, should be %u", level,
+			    i, got, want);
+		}
+	}
+
+	/* a dim fade keeps more levels dithered than it would just
+	 * truncated
+	 */
+	output_brightness(&o, 32);
+	for (i = 1, level = 0, want = 0; i < 256; i++) {
+		if (average(&o, i) != average(&o, i - 1)) level++;
+		if (o.table[i] >> 8 != o.table[i - 1] >> 8) want++;
+	}
+	CHECK(level > 4 * (int)want, "dim: %d levels dithered, %u without",
+	    level, want);
+
+	output_brightness(&o, 0);
+	px.g = px.r = px.b = 255;
+	output_apply(&o, &px, 1);
+	CHECK(px.g == 0 && px.r == 0 && px.b == 0, "off isn't");
+}
+
+static void
+bench_stage(int n)
+{
+	struct output	 o;
+	struct pixel	*px;
+	uint8_t		*err;
+	uint64_t	 start, frames = 0;
+	char		 what[64];
+	int		 i;
+
+	if ((px = malloc(n * sizeof(struct pixel))) == NULL ||
+	    (err = malloc(n * OUTPUT_CHANNELS)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	output_init(&o, err, n);
+	output_brightness(&o, 180);
+
+	start = bench_now();
+	do {
+		/* a fresh frame each time, as the compositor hands it */
+		for (i = 0; i < n; i++) {
+			px[i].g = i;
+			px[i].r = i * 3;
+			px[i].b = frames;
+		}
+		output_apply(&o, px, n);
+		frames++;
+	} while (bench_now() - start < BENCH_NS);
+
+	snprintf(what, sizeof(what), "gamma+dither, %d leds", n);
+	bench_report(what, frames, bench_now() - start, n, "pixel");
+
+	free(px);
+	free(err);
+}
+
+void
+stage_bench(void)
+{
+	struct output	o;
+	uint8_t		err[OUTPUT_CHANNELS];
+	uint64_t	start, n = 0;
+
+	bench_stage(RING);
+	bench_stage(STRIP);
+
+	output_init(&o, err, 1);
+	start = bench_now();
+	do {
+		output_brightness(&o, n);
+		n++;
+	} while (bench_now() - start < BENCH_NS);
+	bench_report("brightness change", n, bench_now() - start, 256,
+	    "entry");
+}
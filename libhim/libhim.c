@@ -0,0 +1,563 @@
+/* libhim.c
+ * see libhim.h. the protocol is a byte stream both ways.
+ *
+ * from the server:
+ *	1 - 6		a color
+ *	0x80 | secs	backoff hint: reconnect at a random time
+ *			within the next secs
+ *	0x00 ...	compare-and-set result, 7 bytes: 0, ok, the big
+ *			endian u32 version and the color
+ *	0x7e len ...	an effect, only to lamps that asked for them
+ *			with 0x85. we never do, so never see one
+ *
+ * to the server, ops have the top bit set:
+ *	0x81		we're only a monitor
+ *	0x82		advance to the color after the current one
+ *	0x83 ver color	compare-and-set, ver a big endian u32. a
+ *			color of 0 never sets, so it just reads
+ *	0x84 id		lamp id, big endian u32. lamps only
+ *	0x85		send us effects. lamps only
+ *	0x86 len ...	set the effect to len bytes of program, or
+ *			take it away with a len of 0
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libhim.h"
+
+#define HIM_CTL_BACKOFF		0x80
+#define HIM_BACKOFF_MASK	0x7f
+#define HIM_OP_MONITOR		0x81
+#define HIM_OP_ADVANCE		0x82
+#define HIM_OP_CAS		0x83
+#define HIM_OP_EFFECT		0x86
+#define HIM_CTL_RESULT		0x00
+#define HIM_RESULT_LEN		7
+
+/* same schedule as the lamps: exponential with full jitter */
+#define HIM_RETRY_BASE_MS	500
+#define HIM_RETRY_MAX_MS	30000
+
+#define HIM_QUEUE		65536
+#define HIM_READSIZE		4096
+
+struct him_client {
+	char			*host, *port;
+	int			 fd;
+	int			 state;
+	int			 monitor;
+
+	uint8_t			 color;
+	int			 attempts;
+	int			 hint;
+	uint64_t		 retryat;
+	uint64_t		 rng;
+
+	struct him_callbacks	 cb;
+	void			*arg;
+
+	uint8_t			 out[HIM_QUEUE];
+	size_t			 outoff, outlen;
+	uint8_t			 in[HIM_READSIZE];
+	uint8_t			 result[HIM_RESULT_LEN];
+	int			 nresult;
+};
+
+static uint64_t	now_ms(void);
+static uint64_t	him_random(struct him_client *, uint64_t);
+static void	him_setstate(struct him_client *, int);
+static void	him_connect(struct him_client *);
+static void	him_connected(struct him_client *);
+static void	him_drop(struct him_client *);
+static void	him_read(struct him_client *);
+static void	him_result(struct him_client *);
+static int	him_queue(struct him_client *, const uint8_t *, size_t);
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* uniform in [0, bound), from a per client xorshift so we
+ * leave the caller's rand() alone
+ */
+static uint64_t
+him_random(struct him_client *c, uint64_t bound)
+{
+	c->rng ^= c->rng << 13;
+	c->rng ^= c->rng >> 7;
+	c->rng ^= c->rng << 17;
+	return (bound == 0) ? 0 : c->rng % bound;
+}
+
+static void
+him_setstate(struct him_client *c, int state)
+{
+	if (c->state == state) return;
+	c->state = state;
+	if (c->cb.state != NULL) c->cb.state(c, state, c->arg);
+}
+
+static void
+him_connect(struct him_client *c)
+{
+	struct addrinfo	 hints, *res, *ai;
+	int		 enable = 1;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(c->host, c->port, &hints, &res) != 0) {
+		him_drop(c);
+		return;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		c->fd = socket(ai->ai_family,
+		    ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC,
+		    ai->ai_protocol);
+		if (c->fd < 0) continue;
+
+		/* we batch on our own, so don't let nagle
+		 * sit on the tail of a burst
+		 */
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+		    &enable, sizeof(int));
+
+		if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			freeaddrinfo(res);
+			him_connected(c);
+			return;
+		} else if (errno == EINPROGRESS) {
+			freeaddrinfo(res);
+			him_setstate(c, HIM_CONNECTING);
+			return;
+		}
+
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	freeaddrinfo(res);
+	him_drop(c);
+}
+
+static void
+him_connected(struct him_client *c)
+{
+	c->outoff = c->outlen = 0;
+	c->hint = 0;
+	c->nresult = 0;
+
+	/* the server has to hear this before anything else */
+	if (c->monitor) c->out[c->outlen++] = HIM_OP_MONITOR;
+
+	him_setstate(c, HIM_CONNECTED);
+}
+
+static void
+him_drop(struct him_client *c)
+{
+	uint64_t	window;
+
+	if (c->fd >= 0) close(c->fd);
+	c->fd = -1;
+
+	/* whatever was queued is as lost as whatever
+	 * was already in flight
+	 */
+	c->outoff = c->outlen = 0;
+
+	if (c->hint > 0) window = (uint64_t)c->hint * 1000;
+	else {
+		window = HIM_RETRY_BASE_MS;
+		if (c->attempts < 16) window <<= c->attempts;
+		if (window > HIM_RETRY_MAX_MS) window = HIM_RETRY_MAX_MS;
+		c->attempts++;
+	}
+
+	c->hint = 0;
+	c->retryat = now_ms() + him_random(c, window);
+	him_setstate(c, HIM_DISCONNECTED);
+}
+
+static void
+him_read(struct him_client *c)
+{
+	ssize_t	n, i;
+
+	for (;;) {
+		n = read(c->fd, c->in, sizeof(c->in));
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+			if (errno == EINTR) continue;
+			him_drop(c);
+			return;
+		} else if (n == 0) {
+			him_drop(c);
+			return;
+		}
+
+		/* hearing anything at all means the server
+		 * is taking us, so start backoff over
+		 */
+		c->attempts = 0;
+
+		for (i = 0; i < n; i++) {
+			if (c->nresult > 0 || c->in[i] == HIM_CTL_RESULT) {
+				c->result[c->nresult++] = c->in[i];
+				if (c->nresult == HIM_RESULT_LEN) him_result(c);
+				continue;
+			}
+
+			if (c->in[i] & HIM_CTL_BACKOFF) {
+				c->hint = c->in[i] & HIM_BACKOFF_MASK;
+				if (c->cb.backoff != NULL)
+					c->cb.backoff(c, c->hint, c->arg);
+				continue;
+			}
+
+			if (c->in[i] < HIM_COLOR_MIN ||
+			    c->in[i] > HIM_COLOR_MAX)
+				continue;
+
+			c->color = c->in[i];
+			if (c->cb.color != NULL)
+				c->cb.color(c, c->color, c->arg);
+		}
+	}
+}
+
+static void
+him_result(struct him_client *c)
+{
+	uint32_t	version;
+
+	c->nresult = 0;
+	version = (uint32_t)c->result[2] << 24 |
+	    (uint32_t)c->result[3] << 16 |
+	    (uint32_t)c->result[4] << 8 | c->result[5];
+
+	/* the color is only news if the swap went through, and
+	 * then the broadcast is about to tell us anyway
+	 */
+	if (c->cb.result != NULL)
+		c->cb.result(c, c->result[1], version, c->result[6], c->arg);
+}
+
+/* append to the queue, making room by flushing or sliding the
+ * unsent part down. all or nothing
+ */
+static int
+him_queue(struct him_client *c, const uint8_t *bytes, size_t len)
+{
+	if (c->state != HIM_CONNECTED) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (c->outoff + c->outlen + len > HIM_QUEUE) {
+		if (c->outoff == 0 && him_flush(c) < 0) return -1;
+		if (c->outoff + c->outlen + len > HIM_QUEUE) {
+			if (c->outlen + len > HIM_QUEUE) {
+				errno = EAGAIN;
+				return -1;
+			}
+
+			memmove(c->out, c->out + c->outoff, c->outlen);
+			c->outoff = 0;
+		}
+	}
+
+	memcpy(c->out + c->outoff + c->outlen, bytes, len);
+	c->outlen += len;
+	return 0;
+}
+
+struct him_client *
+him_open(const char *host, const char *port,
+    const struct him_callbacks *cb, void *arg)
+{
+	struct him_client	*c;
+
+	if ((c = calloc(1, sizeof(struct him_client))) == NULL) return NULL;
+
+	c->host = strdup(host);
+	c->port = strdup((port != NULL) ? port : HIM_PORT);
+	if (c->host == NULL || c->port == NULL) {
+		free(c->host);
+		free(c->port);
+		free(c);
+		return NULL;
+	}
+
+	c->fd = -1;
+	c->state = HIM_DISCONNECTED;
+	c->rng = now_ms() ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)c;
+	if (c->rng == 0) c->rng = 1;
+	if (cb != NULL) c->cb = *cb;
+	c->arg = arg;
+
+	him_connect(c);
+	return c;
+}
+
+void
+him_close(struct him_client *c)
+{
+	if (c == NULL) return;
+	if (c->fd >= 0) close(c->fd);
+	free(c->host);
+	free(c->port);
+	free(c);
+}
+
+int
+him_fd(struct him_client *c)
+{
+	return c->fd;
+}
+
+int
+him_events(struct him_client *c)
+{
+	switch (c->state) {
+	case HIM_CONNECTING:
+		return HIM_WANT_WRITE;
+	case HIM_CONNECTED:
+		return HIM_WANT_READ | ((c->outlen > 0) ? HIM_WANT_WRITE : 0);
+	default:
+		return 0;
+	}
+}
+
+int
+him_timeout(struct him_client *c)
+{
+	uint64_t	now;
+
+	if (c->state != HIM_DISCONNECTED) return -1;
+
+	now = now_ms();
+	return (c->retryat <= now) ? 0 : (int)(c->retryat - now);
+}
+
+/* revents holds the HIM_WANT_ bits that are ready. call it
+ * with 0 when him_timeout runs out
+ */
+int
+him_process(struct him_client *c, int revents)
+{
+	socklen_t	len = sizeof(int);
+	int		error;
+
+	switch (c->state) {
+	case HIM_DISCONNECTED:
+		if (now_ms() >= c->retryat) him_connect(c);
+		break;
+
+	case HIM_CONNECTING:
+		if (revents == 0) break;
+
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error,
+		    &len) < 0 || error != 0) {
+			him_drop(c);
+			break;
+		}
+
+		him_connected(c);
+		break;
+
+	case HIM_CONNECTED:
+		if (revents & HIM_WANT_READ) him_read(c);
+		if (c->state == HIM_CONNECTED && c->outlen > 0) him_flush(c);
+		break;
+	}
+
+	return 0;
+}
+
+/* for callers without a loop of their own: wait up to timeout
+ * milliseconds (-1 for forever) for something to happen, and
+ * handle it
+ */
+int
+him_dispatch(struct him_client *c, int timeout)
+{
+	struct pollfd	pfd;
+	int		events, wait, revents = 0;
+
+	wait = him_timeout(c);
+	if (wait < 0 || (timeout >= 0 && timeout < wait)) wait = timeout;
+
+	if (c->fd < 0 || (events = him_events(c)) == 0) {
+		if (wait != 0) poll(NULL, 0, wait);
+		return him_process(c, 0);
+	}
+
+	pfd.fd = c->fd;
+	pfd.events = ((events & HIM_WANT_READ) ? POLLIN : 0) |
+	    ((events & HIM_WANT_WRITE) ? POLLOUT : 0);
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, wait) < 0 && errno != EINTR) return -1;
+
+	/* let read and getsockopt tell us what went wrong */
+	if (pfd.revents & (POLLERR|POLLHUP)) revents = events;
+	if (pfd.revents & POLLIN) revents |= HIM_WANT_READ;
+	if (pfd.revents & POLLOUT) revents |= HIM_WANT_WRITE;
+
+	return him_process(c, revents);
+}
+
+/* queue a color for the server. -1 with ENOTCONN if we
+ * aren't connected right now, or EAGAIN if the socket has
+ * fallen HIM_QUEUE updates behind
+ */
+int
+him_update(struct him_client *c, uint8_t color)
+{
+	if (color < HIM_COLOR_MIN || color > HIM_COLOR_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return him_queue(c, &color, 1);
+}
+
+/* step to the color after whatever the server has when this
+ * gets there, so presses from anywhere add up instead of two
+ * of them picking the same next color
+ */
+int
+him_advance(struct him_client *c)
+{
+	uint8_t	op = HIM_OP_ADVANCE;
+
+	return him_queue(c, &op, 1);
+}
+
+/* give every lamp code to run in place of its own effects, or
+ * take it away with len 0. the server checks it, and hangs up
+ * on a program no lamp could run
+ */
+int
+him_effect(struct him_client *c, const uint8_t *code, size_t len)
+{
+	uint8_t	op[2 + HIM_EFFECT_MAX];
+
+	if (len > HIM_EFFECT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	op[0] = HIM_OP_EFFECT;
+	op[1] = len;
+	if (len > 0) memcpy(op + 2, code, len);
+	return him_queue(c, op, 2 + len);
+}
+
+/* set color only if the server is still at version, and hear
+ * back through the result callback either way. color 0 never
+ * sets, so it just asks what the version is
+ */
+int
+him_cas(struct him_client *c, uint32_t version, uint8_t color)
+{
+	uint8_t	op[6];
+
+	if (color > HIM_COLOR_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	op[0] = HIM_OP_CAS;
+	op[1] = version >> 24;
+	op[2] = version >> 16;
+	op[3] = version >> 8;
+	op[4] = version;
+	op[5] = color;
+	return him_queue(c, op, sizeof(op));
+}
+
+/* push out as much of the queue as the socket will take now */
+int
+him_flush(struct him_client *c)
+{
+	ssize_t	n;
+
+	if (c->state != HIM_CONNECTED) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	while (c->outlen > 0) {
+		n = send(c->fd, c->out + c->outoff, c->outlen, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			him_drop(c);
+			errno = ENOTCONN;
+			return -1;
+		}
+
+		c->outoff += n;
+		c->outlen -= n;
+	}
+
+	if (c->outlen == 0) c->outoff = 0;
+	return 0;
+}
+
+/* only watch: the server turns monitors away before lamps when
+ * it's busy. sticks across reconnects
+ */
+int
+him_monitor(struct him_client *c)
+{
+	uint8_t	op = HIM_OP_MONITOR;
+
+	if (c->monitor) return 0;
+	c->monitor = 1;
+
+	if (c->state != HIM_CONNECTED) return 0;
+	return him_queue(c, &op, 1);
+}
+
+size_t
+him_pending(struct him_client *c)
+{
+	return c->outlen;
+}
+
+int
+him_state(struct him_client *c)
+{
+	return c->state;
+}
+
+uint8_t
+him_color(struct him_client *c)
+{
+	return c->color;
+}
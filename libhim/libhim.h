@@ -0,0 +1,87 @@
+/* libhim.h
+ * a small non-blocking client for himd, for anything that wants
+ * to watch the color or change it without hand rolling sockets
+ *
+ * a client owns one connection, and (re)connects on its own with
+ * backoff, honoring the server's backoff hints. nothing ever
+ * blocks except name resolution: drive it from your own loop with
+ * him_fd, him_events and him_timeout, calling him_process when
+ * something happens, or just call him_dispatch now and then.
+ *
+ * updates are pipelined. him_update only queues the color, and
+ * the queue goes out in as few writes as the socket allows, so
+ * a publisher can keep hundreds of thousands of them in flight
+ * without waiting for the broadcast of each to come back
+ */
+
+#ifndef LIBHIM_H
+#define LIBHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIM_PORT		"6969"
+
+#define HIM_COLOR_MIN		1
+#define HIM_COLOR_MAX		6
+
+/* the longest effect, in bytes of code. see embed/main/vm.c
+ * for the instructions, and asm/ for an assembler
+ */
+#define HIM_EFFECT_MAX		64
+
+/* him_events */
+#define HIM_WANT_READ		0x1
+#define HIM_WANT_WRITE		0x2
+
+/* the state callback */
+#define HIM_DISCONNECTED	0
+#define HIM_CONNECTING		1
+#define HIM_CONNECTED		2
+
+struct him_client;
+
+struct him_callbacks {
+	/* every color the server sends us, starting with the
+	 * current one right after we connect
+	 */
+	void	(*color)(struct him_client *, uint8_t, void *);
+
+	/* optional: the connection came up or went away */
+	void	(*state)(struct him_client *, int, void *);
+
+	/* optional: the server asked us to wait up to this many
+	 * seconds before reconnecting. the library already will
+	 */
+	void	(*backoff)(struct him_client *, int, void *);
+
+	/* optional: how a him_cas went - whether it set the
+	 * color, and the version and color the server had after
+	 */
+	void	(*result)(struct him_client *, int, uint32_t, uint8_t,
+		    void *);
+};
+
+struct him_client	*him_open(const char *, const char *,
+			    const struct him_callbacks *, void *);
+void			 him_close(struct him_client *);
+
+int			 him_fd(struct him_client *);
+int			 him_events(struct him_client *);
+int			 him_timeout(struct him_client *);
+int			 him_process(struct him_client *, int);
+int			 him_dispatch(struct him_client *, int);
+
+int			 him_update(struct him_client *, uint8_t);
+int			 him_advance(struct him_client *);
+int			 him_cas(struct him_client *, uint32_t, uint8_t);
+int			 him_effect(struct him_client *, const uint8_t *,
+			    size_t);
+int			 him_flush(struct him_client *);
+int			 him_monitor(struct him_client *);
+size_t			 him_pending(struct him_client *);
+
+int			 him_state(struct him_client *);
+uint8_t			 him_color(struct him_client *);
+
+#endif /* LIBHIM_H */
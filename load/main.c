@@ -0,0 +1,838 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT		6969
+#define DEFAULT_CONNS		1000
+#define DEFAULT_RATE		10
+#define DEFAULT_INTERVAL	10
+
+#define LED_COLOR_MAX		7
+#define NCOLORS			(LED_COLOR_MAX - 1)
+
+/* keep in sync with server/main.c */
+#define HIM_CTL_BACKOFF		0x80
+#define HIM_BACKOFF_MAX		0x7f
+#define HIM_OP_MONITOR		0x81
+#define HIM_OP_IDENT		0x84
+
+/* how far behind the newest update a subscriber is
+ * allowed to be before we can no longer tell which update
+ * a color byte belongs to. colors cycle with period NCOLORS,
+ * so anything inside this window maps back uniquely
+ */
+#define MATCH_WINDOW		NCOLORS
+#define PUB_RING		64
+
+#define MAX_EVENTS		1024
+#define READ_CHUNK		64
+#define RETRY_DELAY_NS		(1 * NS_PER_S)
+
+/* if the server won't take all of us, start publishing
+ * anyway once nobody has come or gone for this long
+ */
+#define SETTLE_NS		(2 * NS_PER_S)
+
+#define NS_PER_US		1000ULL
+#define NS_PER_MS		1000000ULL
+#define NS_PER_S		1000000000ULL
+
+/* log-linear latency histogram in microseconds - 16 linear
+ * sub-buckets per power of two keeps relative error under
+ * ~6% with fixed memory, no matter how long we soak
+ */
+#define HIST_SUB_BITS		4
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS) * HIST_SUB)
+
+#define CONN_IDLE		0
+#define CONN_CONNECTING		1
+#define CONN_OPEN		2
+#define CONN_UP			3
+
+struct conn {
+	int		fd;
+	int		state;
+	uint64_t	started;
+	uint64_t	joinseq;
+	uint64_t	lastseq;
+};
+
+struct retry {
+	uint64_t	at;
+	int		idx;
+};
+
+struct pub {
+	uint64_t	seq;
+	uint64_t	sent;
+	uint64_t	expected;
+	uint64_t	acked;
+};
+
+struct hist {
+	uint64_t	buckets[HIST_BUCKETS];
+	uint64_t	count;
+	uint64_t	max;
+};
+
+struct counters {
+	uint64_t	published;
+	uint64_t	pubstalls;
+	uint64_t	delivered;
+	uint64_t	superseded;
+	uint64_t	duplicates;
+	uint64_t	unmatched;
+	uint64_t	expected;
+	uint64_t	acked;
+	uint64_t	connects;
+	uint64_t	connfails;
+	uint64_t	drops;
+	uint64_t	churned;
+	uint64_t	hints;
+};
+
+static struct conn	*conns = NULL;
+static int		 nconns = DEFAULT_CONNS;
+static int		 npubs = 1;
+static int		 nmonitors = 0;
+static int		 nsources = 1;
+static int		 epfd = -1;
+static int		 nup = 0;
+static uint64_t		 nupchanged = 0;
+static int		 obeyhints = 1;
+static int		 backoff = 0;
+static long long	 identbase = -1;
+
+static struct sockaddr_in	target;
+
+static struct pub	 pubs[PUB_RING];
+static uint64_t		 pubseq = 0;
+static uint8_t		 basecolor = 0;
+static int		 nextpub = 0;
+
+/* min-heap on deadline - backoff hints spread
+ * reconnects out at random
+ */
+static struct retry	*retries = NULL;
+static int		 retrylen = 0;
+
+/* set when the whole fleet was up and somebody fell off */
+static uint64_t		 outage = 0;
+
+static struct hist	 lat, ilat, greet;
+static struct hist	 mlat, imlat;
+static struct counters	 total, ival;
+
+static volatile sig_atomic_t	stopping = 0;
+
+static uint64_t		now_ns(void);
+static void		usage(void);
+static long long	number(const char *, long long, long long,
+			    const char *);
+
+static int		hist_index(uint64_t);
+static uint64_t		hist_value(int);
+static void		hist_add(struct hist *, uint64_t);
+static uint64_t		hist_pct(struct hist *, double);
+
+static uint8_t		color_of(uint64_t);
+static void		count(uint64_t *, uint64_t *, uint64_t);
+
+static void		conn_start(int);
+static void		conn_close(int);
+static void		conn_retry(int, uint64_t);
+static int		retry_pop(uint64_t);
+static void		conn_readable(int, uint64_t);
+static void		conn_writable(int, uint64_t);
+static void		conn_color(int, uint8_t, uint64_t);
+
+static void		publish(uint64_t);
+static void		pub_retire(struct pub *);
+static void		churn(int, uint64_t);
+static void		report(const char *, uint64_t, struct counters *,
+			    struct hist *, struct hist *);
+static void		onsignal(int);
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "clock_gettime");
+	return (uint64_t)ts.tv_sec * NS_PER_S + (uint64_t)ts.tv_nsec;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-H] [-n conns] [-p publishers] "
+	    "[-m monitors] [-r rate] [-c churn] [-R ramp] [-S sources] "
+	    "[-I firstid] [-d secs] [-i secs] host [port]\n",
+	    program_invocation_short_name);
+	exit(2);
+}
+
+static long long
+number(const char *s, long long min, long long max, const char *what)
+{
+	char		*end;
+	long long	 v;
+
+	errno = 0;
+	v = strtoll(s, &end, 10);
+	if (errno != 0 || *s == '\0' || *end != '\0' || v < min || v > max)
+		errx(1, "%s must be between %lld and %lld", what, min, max);
+
+	return v;
+}
+
+static int
+hist_index(uint64_t v)
+{
+	int	msb;
+
+	if (v < HIST_SUB) return (int)v;
+
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	    (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t
+hist_value(int idx)
+{
+	int	msb;
+
+	if (idx < HIST_SUB) return (uint64_t)idx;
+
+	msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	return ((uint64_t)(HIST_SUB | (idx % HIST_SUB))) <<
+	    (msb - HIST_SUB_BITS);
+}
+
+static void
+hist_add(struct hist *h, uint64_t us)
+{
+	h->buckets[hist_index(us)]++;
+	h->count++;
+	if (us > h->max) h->max = us;
+}
+
+static uint64_t
+hist_pct(struct hist *h, double pct)
+{
+	uint64_t	want, seen = 0;
+	int		i;
+
+	if (h->count == 0) return 0;
+
+	want = (uint64_t)((double)h->count * pct / 100.0);
+	if (want == 0) want = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want) return hist_value(i);
+	}
+
+	return h->max;
+}
+
+static uint8_t
+color_of(uint64_t seq)
+{
+	/* seq 0 is whatever the server greeted us with; every
+	 * update after that steps to a different color, cycling
+	 * through all of them
+	 */
+	return (uint8_t)((basecolor - 1 + seq) % NCOLORS + 1);
+}
+
+static void
+count(uint64_t *a, uint64_t *b, uint64_t n)
+{
+	*a += n;
+	*b += n;
+}
+
+static void
+conn_start(int i)
+{
+	struct conn		*c = &conns[i];
+	struct epoll_event	 ev;
+	struct sockaddr_in	 src;
+	int			 enable = 1;
+
+	c->fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (c->fd < 0) err(1, "conn_start: socket");
+
+	/* a single source address runs out of ephemeral ports
+	 * somewhere below 30k connections to one server port,
+	 * so spread big fleets over 127.1.x.y
+	 */
+	if (nsources > 1) {
+		if (setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+		    &enable, sizeof(int)) < 0)
+			err(1, "conn_start: setsockopt IP_BIND_ADDRESS_NO_PORT");
+
+		bzero(&src, sizeof(struct sockaddr_in));
+		src.sin_family = AF_INET;
+		src.sin_addr.s_addr = htonl(0x7f010001 + i % nsources);
+
+		if (bind(c->fd, (struct sockaddr *)&src,
+		    sizeof(struct sockaddr_in)) < 0)
+			err(1, "conn_start: bind");
+	}
+
+	c->state = CONN_CONNECTING;
+	c->started = now_ns();
+
+	if (connect(c->fd, (struct sockaddr *)&target,
+	    sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS) {
+		count(&total.connfails, &ival.connfails, 1);
+		conn_close(i);
+		conn_retry(i, c->started);
+		return;
+	}
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+	ev.data.u32 = (uint32_t)i;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+		err(1, "conn_start: epoll_ctl");
+}
+
+static void
+conn_close(int i)
+{
+	struct conn	*c = &conns[i];
+
+	if (c->fd >= 0) close(c->fd);
+	if (c->state == CONN_UP) {
+		nup--;
+		nupchanged = now_ns();
+	}
+
+	c->fd = -1;
+	c->state = CONN_IDLE;
+}
+
+static void
+conn_retry(int i, uint64_t now)
+{
+	struct retry	r;
+	int		n, parent;
+
+	/* what the firmware does: a fixed reboot delay, or a
+	 * random spot inside the server's backoff window
+	 */
+	r.at = now + RETRY_DELAY_NS;
+	if (obeyhints && backoff > 0)
+		r.at = now + (((uint64_t)rand() << 31) | (uint64_t)rand()) %
+		    ((uint64_t)backoff * NS_PER_S);
+	r.idx = i;
+
+	for (n = retrylen++; n > 0; n = parent) {
+		parent = (n - 1) / 2;
+		if (retries[parent].at <= r.at) break;
+		retries[n] = retries[parent];
+	}
+
+	retries[n] = r;
+}
+
+static int
+retry_pop(uint64_t now)
+{
+	struct retry	last;
+	int		idx, n, child;
+
+	if (retrylen == 0 || retries[0].at > now) return -1;
+
+	idx = retries[0].idx;
+	last = retries[--retrylen];
+
+	for (n = 0; (child = 2 * n + 1) < retrylen; n = child) {
+		if (child + 1 < retrylen &&
+		    retries[child + 1].at < retries[child].at)
+			child++;
+		if (last.at <= retries[child].at) break;
+		retries[n] = retries[child];
+	}
+
+	retries[n] = last;
+	return idx;
+}
+
+static void
+conn_writable(int i, uint64_t now)
+{
+	struct conn		*c = &conns[i];
+	struct epoll_event	 ev;
+	socklen_t		 len = sizeof(int);
+	int			 error = 0;
+
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		err(1, "conn_writable: getsockopt");
+
+	if (error != 0) {
+		count(&total.connfails, &ival.connfails, 1);
+		conn_close(i);
+		conn_retry(i, now);
+		return;
+	}
+
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.u32 = (uint32_t)i;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+		err(1, "conn_writable: epoll_ctl");
+
+	/* the last few of the fleet only watch, and say so */
+	if (i >= nconns - nmonitors) {
+		uint8_t	op = HIM_OP_MONITOR;
+
+		if (write(c->fd, &op, sizeof(uint8_t)) != sizeof(uint8_t))
+			warn("conn_writable: write");
+	} else if (identbase >= 0) {
+		uint32_t	id = (uint32_t)(identbase + i);
+		uint8_t		op[5] = { HIM_OP_IDENT, id >> 24, id >> 16,
+				    id >> 8, id };
+
+		/* the rest are lamps, numbered from -I on */
+		if (write(c->fd, op, sizeof(op)) != sizeof(op))
+			warn("conn_writable: write");
+	}
+
+	c->state = CONN_OPEN;
+	count(&total.connects, &ival.connects, 1);
+}
+
+static void
+conn_color(int i, uint8_t color, uint64_t now)
+{
+	struct conn	*c = &conns[i];
+	struct pub	*p;
+	uint64_t	 s, from;
+
+	if (color & HIM_CTL_BACKOFF) {
+		count(&total.hints, &ival.hints, 1);
+		backoff = color & HIM_BACKOFF_MAX;
+		return;
+	}
+
+	/* first byte on a connection is the greeting - whatever
+	 * the server thinks the current color is
+	 */
+	if (c->state != CONN_UP) {
+		if (basecolor == 0) basecolor = color;
+
+		c->state = CONN_UP;
+		c->joinseq = c->lastseq = pubseq;
+		nup++;
+		nupchanged = now;
+
+		hist_add(&greet, (now - c->started) / NS_PER_US);
+		return;
+	}
+
+	if (color == color_of(c->lastseq)) {
+		count(&total.duplicates, &ival.duplicates, 1);
+		return;
+	}
+
+	from = c->lastseq + 1;
+	if (pubseq >= MATCH_WINDOW && from < pubseq - MATCH_WINDOW + 1)
+		from = pubseq - MATCH_WINDOW + 1;
+
+	for (s = from; s <= pubseq; s++) if (color_of(s) == color) break;
+	if (s > pubseq) {
+		count(&total.unmatched, &ival.unmatched, 1);
+		return;
+	}
+
+	p = &pubs[s % PUB_RING];
+	count(&total.delivered, &ival.delivered, 1);
+	count(&total.superseded, &ival.superseded, s - c->lastseq - 1);
+
+	/* monitors are served on their own schedule, so
+	 * keep them out of the lamp numbers
+	 */
+	if (i >= nconns - nmonitors) {
+		hist_add(&mlat, (now - p->sent) / NS_PER_US);
+		hist_add(&imlat, (now - p->sent) / NS_PER_US);
+	} else {
+		hist_add(&lat, (now - p->sent) / NS_PER_US);
+		hist_add(&ilat, (now - p->sent) / NS_PER_US);
+	}
+
+	/* every update we skipped over still counts as delivered
+	 * for completeness - the lamp ended up in the right place
+	 */
+	for (from = c->lastseq + 1; from <= s; from++) {
+		if (from + PUB_RING <= pubseq) continue;
+		p = &pubs[from % PUB_RING];
+		if (p->seq == from && c->joinseq < from) p->acked++;
+	}
+
+	c->lastseq = s;
+}
+
+static void
+conn_readable(int i, uint64_t now)
+{
+	struct conn	*c = &conns[i];
+	uint8_t		 buf[READ_CHUNK];
+	ssize_t		 n, j;
+
+	for (;;) {
+		n = read(c->fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EWOULDBLOCK) return;
+			if (errno == ECONNRESET || errno == ETIMEDOUT) n = 0;
+			else err(1, "conn_readable: read");
+		}
+
+		/* server hung up on us - do what a lamp does and
+		 * come back after a little while
+		 */
+		if (n == 0) {
+			if (outage == 0 && nup == nconns) outage = now;
+			count(&total.drops, &ival.drops, 1);
+			conn_close(i);
+			conn_retry(i, now);
+			return;
+		}
+
+		for (j = 0; j < n; j++) conn_color(i, buf[j], now);
+	}
+}
+
+static void
+pub_retire(struct pub *p)
+{
+	if (p->seq == 0) return;
+
+	if (p->acked > p->expected) p->acked = p->expected;
+	count(&total.expected, &ival.expected, p->expected);
+	count(&total.acked, &ival.acked, p->acked);
+	p->seq = 0;
+}
+
+static void
+publish(uint64_t now)
+{
+	struct pub	*p;
+	uint8_t		 color;
+	int		 tries, i;
+
+	if (basecolor == 0) return;
+
+	for (tries = 0; tries < npubs; tries++) {
+		i = nextpub;
+		nextpub = (nextpub + 1) % npubs;
+		if (conns[i].state == CONN_UP) break;
+	}
+
+	if (tries == npubs) return;
+
+	color = color_of(pubseq + 1);
+	if (write(conns[i].fd, &color, sizeof(uint8_t)) != sizeof(uint8_t)) {
+		if (errno != EWOULDBLOCK) err(1, "publish: write");
+		count(&total.pubstalls, &ival.pubstalls, 1);
+		return;
+	}
+
+	p = &pubs[++pubseq % PUB_RING];
+	pub_retire(p);
+
+	p->seq = pubseq;
+	p->sent = now;
+	p->expected = (uint64_t)nup;
+	p->acked = 0;
+
+	count(&total.published, &ival.published, 1);
+}
+
+static void
+churn(int n, uint64_t now)
+{
+	int	i, victim;
+
+	for (i = 0; i < n; i++) {
+		victim = npubs + rand() % (nconns - npubs);
+		if (conns[victim].state != CONN_UP) continue;
+
+		conn_close(victim);
+		conn_start(victim);
+		count(&total.churned, &ival.churned, 1);
+	}
+
+	(void)now;
+}
+
+static void
+report(const char *label, uint64_t elapsed, struct counters *k,
+    struct hist *h, struct hist *m)
+{
+	double	compl = 100.0;
+
+	if (k->expected > 0)
+		compl = 100.0 * (double)k->acked / (double)k->expected;
+
+	printf("[%s %6llus] up %d pub %llu stall %llu dlv %llu sup %llu "
+	    "dup %llu unm %llu compl %.3f%% | lat us p50 %llu p90 %llu "
+	    "p99 %llu p999 %llu max %llu | conn %llu fail %llu drop %llu "
+	    "churn %llu hint %llu\n",
+	    label, (unsigned long long)(elapsed / NS_PER_S), nup,
+	    (unsigned long long)k->published,
+	    (unsigned long long)k->pubstalls,
+	    (unsigned long long)k->delivered,
+	    (unsigned long long)k->superseded,
+	    (unsigned long long)k->duplicates,
+	    (unsigned long long)k->unmatched, compl,
+	    (unsigned long long)hist_pct(h, 50),
+	    (unsigned long long)hist_pct(h, 90),
+	    (unsigned long long)hist_pct(h, 99),
+	    (unsigned long long)hist_pct(h, 99.9),
+	    (unsigned long long)h->max,
+	    (unsigned long long)k->connects,
+	    (unsigned long long)k->connfails,
+	    (unsigned long long)k->drops,
+	    (unsigned long long)k->churned,
+	    (unsigned long long)k->hints);
+
+	if (nmonitors > 0)
+		printf("[%s %6llus] monitors lat us p50 %llu p90 %llu "
+		    "p99 %llu max %llu\n", label,
+		    (unsigned long long)(elapsed / NS_PER_S),
+		    (unsigned long long)hist_pct(m, 50),
+		    (unsigned long long)hist_pct(m, 90),
+		    (unsigned long long)hist_pct(m, 99),
+		    (unsigned long long)m->max);
+	fflush(stdout);
+}
+
+static void
+onsignal(int sig)
+{
+	stopping = 1;
+	(void)sig;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct epoll_event	 events[MAX_EVENTS];
+	struct addrinfo		 hints, *res;
+	struct rlimit		 rl;
+	uint64_t		 start, now, rampdone = 0;
+	uint64_t		 nextpubat, nextchurn, nextreport, deadline;
+	uint64_t		 rate = DEFAULT_RATE, duration = 0;
+	uint64_t		 interval = DEFAULT_INTERVAL, ramp = 0;
+	uint64_t		 started = 0, nextrampat;
+	int			 ch, n, i, timeout, churnrate = 0;
+	int			 port = DEFAULT_PORT;
+
+	while ((ch = getopt(argc, argv, "c:d:HI:i:m:n:p:r:R:S:")) != -1) {
+		switch (ch) {
+		case 'H':
+			obeyhints = 0;
+			break;
+		case 'c':
+			churnrate = number(optarg, 0, INT32_MAX, "churn");
+			break;
+		case 'd':
+			duration = number(optarg, 0, INT32_MAX, "duration");
+			break;
+		case 'I':
+			identbase = number(optarg, 0, UINT32_MAX, "firstid");
+			break;
+		case 'i':
+			interval = number(optarg, 1, INT32_MAX, "interval");
+			break;
+		case 'm':
+			nmonitors = number(optarg, 0, INT32_MAX, "monitors");
+			break;
+		case 'n':
+			nconns = number(optarg, 1, INT32_MAX, "conns");
+			break;
+		case 'p':
+			npubs = number(optarg, 0, INT32_MAX, "publishers");
+			break;
+		case 'r':
+			rate = number(optarg, 0, 1000000, "rate");
+			break;
+		case 'R':
+			ramp = number(optarg, 0, INT32_MAX, "ramp");
+			break;
+		case 'S':
+			nsources = number(optarg, 1, 65534, "sources");
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || argc > 2) usage();
+	if (argc == 2) {
+		port = number(argv[1], 1, UINT16_MAX, "port");
+	}
+
+	if (npubs + nmonitors >= nconns)
+		errx(1, "need more connections than publishers and monitors");
+
+	bzero(&hints, sizeof(struct addrinfo));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((n = getaddrinfo(argv[0], NULL, &hints, &res)) != 0)
+		errx(1, "getaddrinfo: %s", gai_strerror(n));
+
+	memcpy(&target, res->ai_addr, sizeof(struct sockaddr_in));
+	target.sin_port = htons(port);
+	freeaddrinfo(res);
+
+	rl.rlim_cur = rl.rlim_max = (rlim_t)nconns + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+		err(1, "setrlimit %d fds (try as root)", nconns + 64);
+
+	if ((conns = calloc(nconns, sizeof(struct conn))) == NULL)
+		err(1, "calloc");
+	if ((retries = calloc(nconns, sizeof(struct retry))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < nconns; i++) conns[i].fd = -1;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		err(1, "epoll_create1");
+
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	start = now = now_ns();
+	nextpubat = nextchurn = nextrampat = now;
+	nextreport = now + interval * NS_PER_S;
+	deadline = (duration > 0) ? now + duration * NS_PER_S : UINT64_MAX;
+
+	printf("loading %s:%d with %d connections (%d publishers, "
+	    "%llu updates/s, churn %d/s)\n", inet_ntoa(target.sin_addr),
+	    port, nconns, npubs, (unsigned long long)rate, churnrate);
+
+	while (!stopping && now < deadline) {
+		/* ramp up - all at once unless asked otherwise,
+		 * which makes this a reconnect storm
+		 */
+		while (started < (uint64_t)nconns && now >= nextrampat) {
+			conn_start(started++);
+			if (ramp > 0) nextrampat += NS_PER_S / ramp;
+		}
+
+		if (rampdone == 0 && nup == nconns) {
+			rampdone = now;
+			printf("fleet up: %d connections in %.3fs "
+			    "(greeting p50 %lluus p99 %lluus max %lluus)\n",
+			    nconns, (double)(now - start) / NS_PER_S,
+			    (unsigned long long)hist_pct(&greet, 50),
+			    (unsigned long long)hist_pct(&greet, 99),
+			    (unsigned long long)greet.max);
+			fflush(stdout);
+			nextpubat = nextchurn = now;
+		} else if (rampdone == 0 && started == (uint64_t)nconns &&
+		    nup > npubs && now - nupchanged >= SETTLE_NS) {
+			rampdone = now;
+			printf("fleet settled: %d of %d connections up "
+			    "after %.3fs\n", nup, nconns,
+			    (double)(now - start) / NS_PER_S);
+			fflush(stdout);
+			nextpubat = nextchurn = now;
+		}
+
+		while ((i = retry_pop(now)) >= 0) conn_start(i);
+
+		/* a server restart - how long until everybody
+		 * has been greeted again?
+		 */
+		if (outage > 0 && nup == nconns) {
+			printf("fleet back: %d connections in %.3fs "
+			    "after the first drop\n", nconns,
+			    (double)(now - outage) / NS_PER_S);
+			fflush(stdout);
+			outage = 0;
+		}
+
+		/* only measure delivery once everybody is up */
+		if (rampdone > 0) {
+			while (rate > 0 && npubs > 0 && now >= nextpubat) {
+				publish(now);
+				nextpubat += NS_PER_S / rate;
+			}
+
+			if (churnrate > 0 && now >= nextchurn) {
+				churn(churnrate, now);
+				nextchurn += NS_PER_S;
+			}
+		}
+
+		if (now >= nextreport) {
+			report("ival", now - start, &ival, &ilat, &imlat);
+			bzero(&ival, sizeof(struct counters));
+			bzero(&ilat, sizeof(struct hist));
+			bzero(&imlat, sizeof(struct hist));
+			nextreport += interval * NS_PER_S;
+		}
+
+		timeout = 1;
+		if (rampdone > 0 && (rate == 0 || npubs == 0) &&
+		    churnrate == 0 && retrylen == 0)
+			timeout = 100;
+
+		if ((n = epoll_wait(epfd, events, MAX_EVENTS, timeout)) < 0) {
+			if (errno == EINTR) continue;
+			err(1, "epoll_wait");
+		}
+
+		now = now_ns();
+		for (i = 0; i < n; i++) {
+			int	idx = (int)events[i].data.u32;
+
+			if (conns[idx].state == CONN_CONNECTING) {
+				conn_writable(idx, now);
+				if (conns[idx].state == CONN_IDLE) continue;
+			}
+
+			if (events[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLERR))
+				conn_readable(idx, now);
+		}
+	}
+
+	for (i = 0; i < PUB_RING; i++) pub_retire(&pubs[i]);
+	report("total", now - start, &total, &lat, &mlat);
+
+	if (rampdone == 0)
+		printf("fleet never fully up: %d of %d connections\n",
+		    nup, nconns);
+
+	return 0;
+}
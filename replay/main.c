@@ -0,0 +1,531 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+/* keep these in sync with server/himd.h */
+#define CAPTURE_MAGIC		"HIMCAP01"
+#define CAPTURE_MAGICLEN	8
+
+#define CAPTURE_CONNECT		1
+#define CAPTURE_DISCONNECT	2
+#define CAPTURE_DATA		3
+
+#define DEFAULT_PORT		6969
+
+#define MAX_EVENTS		1024
+#define READ_CHUNK		4096
+#define DATA_MAX		1024
+
+/* when running flat out, go back to the event loop
+ * every so many records so we keep draining sockets
+ */
+#define BATCH_RECORDS		256
+#define DRAIN_MS		1000
+
+#define NS_PER_US		1000ULL
+#define NS_PER_S		1000000000ULL
+
+#define RCONN_IDLE		0
+#define RCONN_CONNECTING	1
+#define RCONN_UP		2
+
+struct rconn {
+	int		 fd;
+	int		 state;
+	int		 closing;
+	uint8_t		*pending;
+	size_t		 plen;
+	size_t		 pcap;
+};
+
+struct record {
+	int		 op;
+	uint64_t	 delta;
+	uint64_t	 id;
+	size_t		 len;
+	uint8_t		 data[DATA_MAX];
+};
+
+struct stats {
+	uint64_t	records;
+	uint64_t	connects;
+	uint64_t	connfails;
+	uint64_t	disconnects;
+	uint64_t	sent;
+	uint64_t	received;
+	uint64_t	drops;
+	uint64_t	maxlag;
+	uint64_t	peak;
+	uint64_t	open;
+};
+
+static struct rconn	*conns = NULL;
+static uint64_t		 nconns = 0;
+static int		 epfd = -1;
+static FILE		*capf = NULL;
+
+static struct sockaddr_in	target;
+static struct stats		stats;
+
+static volatile sig_atomic_t	stopping = 0;
+
+static uint64_t		now_ns(void);
+static void		usage(void);
+
+static int		read_varint(uint64_t *);
+static int		read_record(struct record *);
+
+static struct rconn	*rconn_get(uint64_t);
+static void		rconn_start(uint64_t);
+static void		rconn_close(uint64_t);
+static void		rconn_queue(uint64_t, const uint8_t *, size_t);
+static void		rconn_flush(uint64_t);
+static void		rconn_watch(uint64_t, int);
+static void		rconn_event(uint64_t, uint32_t);
+
+static void		apply(struct record *);
+static void		onsignal(int);
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "clock_gettime");
+	return (uint64_t)ts.tv_sec * NS_PER_S + (uint64_t)ts.tv_nsec;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-f | -x speed] capture host [port]\n",
+	    program_invocation_short_name);
+	exit(2);
+}
+
+static int
+read_varint(uint64_t *out)
+{
+	int	c, shift = 0;
+
+	*out = 0;
+	do {
+		if ((c = getc(capf)) == EOF || shift > 63) return -1;
+		*out |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+static int
+read_record(struct record *r)
+{
+	int	c;
+
+	if ((c = getc(capf)) == EOF) return 0;
+	r->op = c;
+
+	if (read_varint(&r->delta) < 0 || read_varint(&r->id) < 0)
+		goto truncated;
+
+	r->len = 0;
+	if (r->op == CAPTURE_DATA) {
+		uint64_t	len;
+
+		if (read_varint(&len) < 0) goto truncated;
+		if (len > DATA_MAX) errx(1, "data record of %llu bytes",
+		    (unsigned long long)len);
+
+		r->len = len;
+		if (fread(r->data, 1, r->len, capf) != r->len)
+			goto truncated;
+
+	} else if (r->op != CAPTURE_CONNECT && r->op != CAPTURE_DISCONNECT)
+		errx(1, "unknown record type %d", r->op);
+
+	return 1;
+
+truncated:
+	/* himd got killed mid-flush; replay what we have */
+	warnx("capture truncated after %llu records",
+	    (unsigned long long)stats.records);
+	return 0;
+}
+
+static struct rconn *
+rconn_get(uint64_t id)
+{
+	struct rconn	*grown;
+	uint64_t	 n, i;
+
+	if (id < nconns) return &conns[id];
+
+	for (n = (nconns > 0) ? nconns : 1024; n <= id; n *= 2);
+	if ((grown = reallocarray(conns, n, sizeof(struct rconn))) == NULL)
+		err(1, "rconn_get: reallocarray");
+
+	for (i = nconns; i < n; i++) {
+		bzero(&grown[i], sizeof(struct rconn));
+		grown[i].fd = -1;
+	}
+
+	conns = grown;
+	nconns = n;
+	return &conns[id];
+}
+
+static void
+rconn_watch(uint64_t id, int op)
+{
+	struct rconn		*c = rconn_get(id);
+	struct epoll_event	 ev;
+
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	if (c->state == RCONN_CONNECTING || c->plen > 0)
+		ev.events |= EPOLLOUT;
+	ev.data.u64 = id;
+
+	if (epoll_ctl(epfd, op, c->fd, &ev) < 0)
+		err(1, "rconn_watch: epoll_ctl");
+}
+
+static void
+rconn_start(uint64_t id)
+{
+	struct rconn	*c = rconn_get(id);
+
+	if (c->fd >= 0) {
+		warnx("connection %llu opened twice", (unsigned long long)id);
+		rconn_close(id);
+	}
+
+	c->fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (c->fd < 0) err(1, "rconn_start: socket");
+
+	if (connect(c->fd, (struct sockaddr *)&target,
+	    sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS) {
+		warn("rconn_start: connect");
+		stats.connfails++;
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+
+	c->state = RCONN_CONNECTING;
+	rconn_watch(id, EPOLL_CTL_ADD);
+
+	stats.connects++;
+	if (++stats.open > stats.peak) stats.peak = stats.open;
+}
+
+static void
+rconn_close(uint64_t id)
+{
+	struct rconn	*c = rconn_get(id);
+
+	if (c->fd < 0) return;
+
+	close(c->fd);
+	c->fd = -1;
+	c->state = RCONN_IDLE;
+	c->closing = 0;
+	c->plen = 0;
+	stats.open--;
+}
+
+static void
+rconn_queue(uint64_t id, const uint8_t *data, size_t len)
+{
+	struct rconn	*c = rconn_get(id);
+	uint8_t		*grown;
+	size_t		 n;
+
+	if (c->fd < 0) return;
+
+	if (c->plen + len > c->pcap) {
+		for (n = (c->pcap > 0) ? c->pcap : 64; n < c->plen + len;
+		    n *= 2);
+		if ((grown = realloc(c->pending, n)) == NULL)
+			err(1, "rconn_queue: realloc");
+		c->pending = grown;
+		c->pcap = n;
+	}
+
+	memcpy(c->pending + c->plen, data, len);
+	c->plen += len;
+
+	if (c->state == RCONN_UP) rconn_flush(id);
+}
+
+static void
+rconn_flush(uint64_t id)
+{
+	struct rconn	*c = rconn_get(id);
+	ssize_t		 n;
+	size_t		 had = c->plen;
+
+	while (c->plen > 0) {
+		n = write(c->fd, c->pending, c->plen);
+		if (n < 0) {
+			if (errno == EWOULDBLOCK) break;
+			if (errno == EPIPE || errno == ECONNRESET) {
+				stats.drops++;
+				rconn_close(id);
+				return;
+			}
+			err(1, "rconn_flush: write");
+		}
+
+		stats.sent += n;
+		c->plen -= n;
+		memmove(c->pending, c->pending + n, c->plen);
+	}
+
+	if (c->plen == 0 && c->closing) {
+		rconn_close(id);
+		return;
+	}
+
+	if ((had == 0) != (c->plen == 0)) rconn_watch(id, EPOLL_CTL_MOD);
+}
+
+static void
+rconn_event(uint64_t id, uint32_t events)
+{
+	struct rconn	*c = rconn_get(id);
+	uint8_t		 buf[READ_CHUNK];
+	socklen_t	 len = sizeof(int);
+	ssize_t		 n;
+	int		 error = 0;
+
+	if (c->fd < 0) return;
+
+	if (c->state == RCONN_CONNECTING) {
+		if (!(events & (EPOLLOUT|EPOLLERR|EPOLLHUP))) return;
+
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+			err(1, "rconn_event: getsockopt");
+		if (error != 0) {
+			stats.connfails++;
+			rconn_close(id);
+			return;
+		}
+
+		c->state = RCONN_UP;
+		rconn_watch(id, EPOLL_CTL_MOD);
+	}
+
+	if (events & EPOLLOUT) {
+		rconn_flush(id);
+		if (c->fd < 0) return;
+	}
+
+	if (!(events & (EPOLLIN|EPOLLRDHUP|EPOLLERR))) return;
+
+	for (;;) {
+		n = read(c->fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EWOULDBLOCK) return;
+			if (errno != ECONNRESET && errno != ETIMEDOUT)
+				err(1, "rconn_event: read");
+			n = 0;
+		}
+
+		if (n == 0) {
+			stats.drops++;
+			rconn_close(id);
+			return;
+		}
+
+		stats.received += n;
+	}
+}
+
+static void
+apply(struct record *r)
+{
+	struct rconn	*c;
+
+	switch (r->op) {
+	case CAPTURE_CONNECT:
+		rconn_start(r->id);
+		break;
+	case CAPTURE_DATA:
+		rconn_queue(r->id, r->data, r->len);
+		break;
+	case CAPTURE_DISCONNECT:
+		stats.disconnects++;
+		c = rconn_get(r->id);
+		if (c->fd >= 0 && c->plen > 0) c->closing = 1;
+		else rconn_close(r->id);
+		break;
+	}
+
+	stats.records++;
+}
+
+static void
+onsignal(int sig)
+{
+	stopping = 1;
+	(void)sig;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct epoll_event	 events[MAX_EVENTS];
+	struct addrinfo		 hints, *res;
+	struct rlimit		 rl;
+	struct record		 r;
+	char			 magic[CAPTURE_MAGICLEN];
+	char			*end;
+	double			 speed = 1.0;
+	uint64_t		 start, now, due, captured = 0, done = 0;
+	int			 ch, n, i, timeout, fast = 0, have = 0, batch;
+	int			 port = DEFAULT_PORT;
+
+	while ((ch = getopt(argc, argv, "fx:")) != -1) {
+		switch (ch) {
+		case 'f':
+			fast = 1;
+			break;
+		case 'x':
+			speed = strtod(optarg, &end);
+			if (*end != '\0' || speed <= 0)
+				errx(1, "speed must be a positive number");
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2 || argc > 3) usage();
+	if (argc == 3) {
+		port = atoi(argv[2]);
+		if (port <= 0 || port > UINT16_MAX) errx(1, "bad port");
+	}
+
+	if ((capf = fopen(argv[0], "r")) == NULL)
+		err(1, "fopen %s", argv[0]);
+
+	if (fread(magic, 1, CAPTURE_MAGICLEN, capf) != CAPTURE_MAGICLEN ||
+	    memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGICLEN) != 0)
+		errx(1, "%s is not a himd capture", argv[0]);
+
+	/* wall clock start - only interesting to humans */
+	if (fseek(capf, 8, SEEK_CUR) < 0) err(1, "fseek");
+
+	bzero(&hints, sizeof(struct addrinfo));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((n = getaddrinfo(argv[1], NULL, &hints, &res)) != 0)
+		errx(1, "getaddrinfo: %s", gai_strerror(n));
+
+	memcpy(&target, res->ai_addr, sizeof(struct sockaddr_in));
+	target.sin_port = htons(port);
+	freeaddrinfo(res);
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) err(1, "getrlimit");
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0) err(1, "setrlimit");
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		err(1, "epoll_create1");
+
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	start = now = now_ns();
+
+	while (!stopping) {
+		/* run every record that's due, or a batch of
+		 * them if we're going as fast as we can
+		 */
+		for (batch = 0; !done && batch < BATCH_RECORDS; batch++) {
+			if (!have) {
+				if (!read_record(&r)) {
+					done = now;
+					break;
+				}
+
+				captured += r.delta;
+				have = 1;
+			}
+
+			due = start + (uint64_t)((double)captured *
+			    NS_PER_US / speed);
+			if (!fast && due > now) break;
+
+			if (!fast && now - due > stats.maxlag)
+				stats.maxlag = now - due;
+
+			apply(&r);
+			have = 0;
+		}
+
+		if (done && (now - done) / 1000000 >= DRAIN_MS) break;
+
+		timeout = 0;
+		if (done) timeout = 10;
+		else if (!fast && have) {
+			due = start + (uint64_t)((double)captured *
+			    NS_PER_US / speed);
+			if (due > now) timeout = (due - now) / 1000000;
+		}
+
+		if ((n = epoll_wait(epfd, events, MAX_EVENTS, timeout)) < 0) {
+			if (errno == EINTR) continue;
+			err(1, "epoll_wait");
+		}
+
+		for (i = 0; i < n; i++)
+			rconn_event(events[i].data.u64, events[i].events);
+
+		now = now_ns();
+	}
+
+	printf("replayed %llu records (%.3fs captured) in %.3fs%s\n",
+	    (unsigned long long)stats.records,
+	    (double)captured / 1000000,
+	    (double)((done ? done : now) - start) / NS_PER_S,
+	    fast ? " flat out" : "");
+	printf("connects %llu (fail %llu, peak open %llu) disconnects %llu "
+	    "server drops %llu\n",
+	    (unsigned long long)stats.connects,
+	    (unsigned long long)stats.connfails,
+	    (unsigned long long)stats.peak,
+	    (unsigned long long)stats.disconnects,
+	    (unsigned long long)stats.drops);
+	printf("bytes sent %llu received %llu, max schedule lag %.3fms\n",
+	    (unsigned long long)stats.sent,
+	    (unsigned long long)stats.received,
+	    (double)stats.maxlag / 1000000);
+
+	return 0;
+}
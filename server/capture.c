@@ -0,0 +1,179 @@
+/* capture.c
+ * record every inbound client operation into a compact binary
+ * file, so that it can be replayed against a test himd later
+ *
+ * the file is CAPTURE_MAGIC followed by the wall clock start time
+ * (unix microseconds, 8 bytes little endian), then a stream of
+ * records:
+ *
+ *	u8	op		CAPTURE_CONNECT, _DISCONNECT or _DATA
+ *	varint	delta		microseconds since the previous record
+ *	varint	id		connection id, never reused
+ *	varint	len		CAPTURE_DATA only
+ *	u8[len]	data		CAPTURE_DATA only, bytes as read
+ *
+ * varints are unsigned LEB128. a quiet fleet mostly costs us three
+ * bytes per event, a color update four
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "himd.h"
+
+#define VARINT_MAX		10
+#define RECORD_MAX		(1 + VARINT_MAX * 3)
+#define DATA_CHUNK		1024
+
+static int		capfd = -1;
+static uint8_t		capbuf[CAPTURE_BUFSIZE];
+static size_t		caplen = 0;
+static uint64_t		lastus = 0;
+static struct event	flushev;
+
+static uint64_t		clock_us(clockid_t);
+static size_t		varint(uint8_t *, uint64_t);
+static void		capture_tick(int, short, void *);
+static void		capture_stop(void);
+
+static uint64_t
+clock_us(clockid_t clock)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(clock, &ts) < 0) err(1, "clock_us: clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static size_t
+varint(uint8_t *out, uint64_t v)
+{
+	size_t	n = 0;
+
+	do {
+		out[n] = v & 0x7f;
+		v >>= 7;
+		if (v != 0) out[n] |= 0x80;
+		n++;
+	} while (v != 0);
+
+	return n;
+}
+
+static void
+capture_tick(int fd, short event, void *arg)
+{
+	struct timeval	tv = { CAPTURE_FLUSH_SECS, 0 };
+
+	capture_flush();
+	if (capfd >= 0 && evtimer_add(&flushev, &tv) < 0)
+		err(1, "capture_tick: evtimer_add");
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+static void
+capture_stop(void)
+{
+	warnx("capture stopped, %zu buffered bytes lost", caplen);
+	close(capfd);
+	capfd = -1;
+	caplen = 0;
+}
+
+void
+capture_open(const char *path)
+{
+	uint64_t	start;
+	int		i;
+
+	/* we get opened before the chroot, and never
+	 * open anything again after it
+	 */
+	capfd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (capfd < 0) err(1, "capture_open: open %s", path);
+
+	memcpy(capbuf, CAPTURE_MAGIC, CAPTURE_MAGICLEN);
+	caplen = CAPTURE_MAGICLEN;
+
+	start = clock_us(CLOCK_REALTIME);
+	for (i = 0; i < 8; i++) capbuf[caplen++] = (start >> (i * 8)) & 0xff;
+
+	lastus = clock_us(CLOCK_MONOTONIC);
+
+	evtimer_set(&flushev, capture_tick, NULL);
+	capture_tick(-1, 0, NULL);
+
+	warnx("capturing client traffic to %s", path);
+}
+
+void
+capture_record(int op, uint32_t id, const void *data, size_t len)
+{
+	const uint8_t	*p = data;
+	uint64_t	 now;
+	size_t		 chunk;
+
+	if (capfd < 0) return;
+
+	do {
+		chunk = (len > DATA_CHUNK) ? DATA_CHUNK : len;
+		if (caplen + RECORD_MAX + chunk > CAPTURE_BUFSIZE)
+			capture_flush();
+		if (capfd < 0) return;
+
+		now = clock_us(CLOCK_MONOTONIC);
+
+		capbuf[caplen++] = (uint8_t)op;
+		caplen += varint(capbuf + caplen, now - lastus);
+		caplen += varint(capbuf + caplen, id);
+
+		if (op == CAPTURE_DATA) {
+			caplen += varint(capbuf + caplen, chunk);
+			memcpy(capbuf + caplen, p, chunk);
+			caplen += chunk;
+		}
+
+		lastus = now;
+		p += chunk;
+		len -= chunk;
+	} while (len > 0);
+}
+
+void
+capture_flush(void)
+{
+	size_t	off = 0;
+	ssize_t	n;
+
+	if (capfd < 0) return;
+
+	/* losing the capture is not worth taking down
+	 * the lamps over, so just give up on it
+	 */
+	while (off < caplen) {
+		n = write(capfd, capbuf + off, caplen - off);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			warn("capture_flush: write");
+			capture_stop();
+			return;
+		}
+
+		off += n;
+	}
+
+	caplen = 0;
+}
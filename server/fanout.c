@@ -0,0 +1,458 @@
+/* fanout.c
+ * optional kernel-side broadcast. every lamp socket goes into a
+ * BPF sockmap, and a color update becomes one byte per lamp
+ * sent to a loopback control socket, a thousand at a time with
+ * sendmmsg. an sk_msg program on that socket hands each byte to
+ * the next lamp in the map, so we stop doing a write() per
+ * connection.
+ *
+ * no libbpf or clang needed: the program is a couple dozen
+ * instructions and lives in here, and everything else is the
+ * bpf() syscall. if any of it fails we say so and himd carries
+ * on with the user space fan-out.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <linux/bpf.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "himd.h"
+
+#define INSN(CODE, DST, SRC, OFF, IMM)					\
+	((struct bpf_insn){ .code = (CODE), .dst_reg = (DST),		\
+	    .src_reg = (SRC), .off = (OFF), .imm = (IMM) })
+
+#define MOV_REG(DST, SRC)	INSN(BPF_ALU64|BPF_MOV|BPF_X, DST, SRC, 0, 0)
+#define MOV_IMM(DST, IMM)	INSN(BPF_ALU64|BPF_MOV|BPF_K, DST, 0, 0, IMM)
+#define ADD_IMM(DST, IMM)	INSN(BPF_ALU64|BPF_ADD|BPF_K, DST, 0, 0, IMM)
+#define LDX_W(DST, SRC, OFF)	INSN(BPF_LDX|BPF_MEM|BPF_W, DST, SRC, OFF, 0)
+#define STX_W(DST, SRC, OFF)	INSN(BPF_STX|BPF_MEM|BPF_W, DST, SRC, OFF, 0)
+#define ST_W(DST, OFF, IMM)	INSN(BPF_ST|BPF_MEM|BPF_W, DST, 0, OFF, IMM)
+#define JEQ_IMM(DST, IMM, OFF)	INSN(BPF_JMP|BPF_JEQ|BPF_K, DST, 0, OFF, IMM)
+#define CALL(FN)		INSN(BPF_JMP|BPF_CALL, 0, 0, 0, FN)
+#define EXIT()			INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP(DST, FD)							\
+	INSN(BPF_LD|BPF_DW|BPF_IMM, DST, BPF_PSEUDO_MAP_FD, 0, FD),	\
+	INSN(0, 0, 0, 0, 0)
+
+#define SK_DROP			0
+
+/* one byte per message: the kernel corks every redirect but the
+ * last one of a message, so a bigger write sits in the lamp
+ * sockets until something else pushes them
+ */
+#define PUSH_BATCH		1024
+
+static int		 progfd = -1;
+static int		 ctlmap = -1, lampmap = -1, cursormap = -1;
+static int		 ctlfd = -1, sinkfd = -1;
+
+static int		 active = 0;
+static int		 nslots = 0, maxslots = 0;
+static int		*slotfds = NULL;
+static int	       **slotowners = NULL;
+
+static char		*bcast = NULL;
+static size_t		 bcastoff = 0, bcastlen = 0;
+static struct event	 ctlev;
+static int		 pushing = 0;
+static char		 bcastcolor;
+static uint64_t		 bcastsince = 0;
+
+static struct mmsghdr	 pushmsgs[PUSH_BATCH];
+static struct iovec	 pushiov[PUSH_BATCH];
+
+static int		 sys_bpf(int, union bpf_attr *);
+static int		 map_create(int, uint32_t, uint32_t, uint32_t);
+static int		 map_set(int, uint32_t, uint32_t);
+static int		 map_unset(int, uint32_t);
+static int		 prog_load(void);
+static int		 ctl_pair(void);
+static void		 ctl_push(int, short, void *);
+static void		 fanout_fail(const char *);
+
+static int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(SYS_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+static int
+map_create(int type, uint32_t keysize, uint32_t valsize, uint32_t entries)
+{
+	union bpf_attr	attr;
+
+	bzero(&attr, sizeof(union bpf_attr));
+	attr.map_type = type;
+	attr.key_size = keysize;
+	attr.value_size = valsize;
+	attr.max_entries = entries;
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int
+map_set(int map, uint32_t key, uint32_t value)
+{
+	union bpf_attr	attr;
+
+	bzero(&attr, sizeof(union bpf_attr));
+	attr.map_fd = map;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&value;
+	attr.flags = BPF_ANY;
+
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int
+map_unset(int map, uint32_t key)
+{
+	union bpf_attr	attr;
+
+	bzero(&attr, sizeof(union bpf_attr));
+	attr.map_fd = map;
+	attr.key = (uintptr_t)&key;
+
+	return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static int
+prog_load(void)
+{
+	union bpf_attr	attr;
+	char		log[4096];
+
+	/* per message, we:
+	 * - bump cursor[0], remembering the old value as the slot
+	 * - apply our verdict to just the first byte, so we get
+	 *   run again for the rest of the write
+	 * - send that byte out of the lamp socket in lampmap[slot]
+	 */
+	struct bpf_insn	prog[] = {
+		MOV_REG(BPF_REG_6, BPF_REG_1),
+		ST_W(BPF_REG_10, -4, 0),
+		LD_MAP(BPF_REG_1, cursormap),
+		MOV_REG(BPF_REG_2, BPF_REG_10),
+		ADD_IMM(BPF_REG_2, -4),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQ_IMM(BPF_REG_0, 0, 14),
+		LDX_W(BPF_REG_7, BPF_REG_0, 0),
+		MOV_REG(BPF_REG_1, BPF_REG_7),
+		ADD_IMM(BPF_REG_1, 1),
+		STX_W(BPF_REG_0, BPF_REG_1, 0),
+		MOV_REG(BPF_REG_1, BPF_REG_6),
+		MOV_IMM(BPF_REG_2, 1),
+		CALL(BPF_FUNC_msg_apply_bytes),
+		MOV_REG(BPF_REG_1, BPF_REG_6),
+		LD_MAP(BPF_REG_2, lampmap),
+		MOV_REG(BPF_REG_3, BPF_REG_7),
+		MOV_IMM(BPF_REG_4, 0),
+		CALL(BPF_FUNC_msg_redirect_map),
+		EXIT(),
+		MOV_IMM(BPF_REG_0, SK_DROP),
+		EXIT(),
+	};
+
+	bzero(&attr, sizeof(union bpf_attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_MSG;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(struct bpf_insn);
+	attr.license = (uintptr_t)"Dual BSD/GPL";
+	attr.log_buf = (uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	log[0] = '\0';
+
+	if ((progfd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0 && log[0] != '\0')
+		warnx("fanout verifier says: %s", log);
+	return progfd;
+}
+
+static int
+ctl_pair(void)
+{
+	struct sockaddr_in	sa;
+	socklen_t		len = sizeof(struct sockaddr_in);
+	int			lfd, rv = -1;
+
+	/* sk_msg only runs on tcp, so the control socket
+	 * is one end of a loopback connection to ourselves
+	 */
+	lfd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (lfd < 0) return -1;
+
+	bzero(&sa, sizeof(struct sockaddr_in));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(lfd, (struct sockaddr *)&sa, len) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sa, &len) < 0)
+		goto end;
+
+	ctlfd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (ctlfd < 0) goto end;
+	if (connect(ctlfd, (struct sockaddr *)&sa, len) < 0) goto end;
+
+	sinkfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (sinkfd < 0) goto end;
+
+	rv = 0;
+end:
+	close(lfd);
+	return rv;
+}
+
+int
+fanout_init(int slots)
+{
+	union bpf_attr	attr;
+
+	maxslots = slots;
+
+	cursormap = map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+	    sizeof(uint32_t), 1);
+	ctlmap = map_create(BPF_MAP_TYPE_SOCKMAP, sizeof(uint32_t),
+	    sizeof(uint32_t), 1);
+	lampmap = map_create(BPF_MAP_TYPE_SOCKMAP, sizeof(uint32_t),
+	    sizeof(uint32_t), maxslots);
+
+	if (cursormap < 0 || ctlmap < 0 || lampmap < 0) {
+		fanout_fail("map_create");
+		return -1;
+	}
+
+	if (prog_load() < 0) {
+		fanout_fail("prog_load");
+		return -1;
+	}
+
+	bzero(&attr, sizeof(union bpf_attr));
+	attr.target_fd = ctlmap;
+	attr.attach_bpf_fd = progfd;
+	attr.attach_type = BPF_SK_MSG_VERDICT;
+
+	if (sys_bpf(BPF_PROG_ATTACH, &attr) < 0) {
+		fanout_fail("prog_attach");
+		return -1;
+	}
+
+	if (ctl_pair() < 0 || map_set(ctlmap, 0, ctlfd) < 0) {
+		fanout_fail("control socket");
+		return -1;
+	}
+
+	/* only go non-blocking once we're in the map */
+	if (fcntl(ctlfd, F_SETFL, O_NONBLOCK) < 0) {
+		fanout_fail("fcntl");
+		return -1;
+	}
+
+	slotfds = calloc(maxslots, sizeof(int));
+	slotowners = calloc(maxslots, sizeof(int *));
+	bcast = malloc(maxslots);
+	if (slotfds == NULL || slotowners == NULL || bcast == NULL)
+		err(1, "fanout_init: calloc");
+
+	event_set(&ctlev, ctlfd, EV_WRITE, ctl_push, NULL);
+
+	active = 1;
+	warnx("kernel fan-out enabled for up to %d connections", maxslots);
+	return 0;
+}
+
+int
+fanout_enabled(void)
+{
+	return active;
+}
+
+static void
+fanout_fail(const char *what)
+{
+	/* keep the error from the failing call for the warning,
+	 * and leave everything else for the kernel to clean up
+	 */
+	warn("kernel fan-out unavailable (%s), using user space", what);
+
+	if (pushing && event_del(&ctlev) < 0)
+		err(1, "fanout_fail: event_del");
+	pushing = 0;
+	active = 0;
+}
+
+/* fd gets its colors from the kernel from now on, and *slot
+ * follows it around the map. -1 if it doesn't: if fan-out's
+ * still enabled after that, it's up to the caller to send to it
+ */
+int
+fanout_add(int fd, int *slot)
+{
+	if (!active) return -1;
+
+	/* everybody has to be in the map, or nobody is */
+	if (nslots == maxslots) {
+		errno = ENOSPC;
+		fanout_fail("map full");
+		return -1;
+	}
+
+	/* sockmap only takes established sockets. one whose peer
+	 * has already hung up is most likely about to be torn
+	 * down, but until it is, it's the caller's to send to
+	 */
+	if (map_set(lampmap, nslots, fd) < 0) {
+		if (errno != EOPNOTSUPP) fanout_fail("map update");
+		return -1;
+	}
+
+	slotfds[nslots] = fd;
+	slotowners[nslots] = slot;
+	*slot = nslots++;
+	return 0;
+}
+
+void
+fanout_del(int *slot)
+{
+	int	hole = *slot, last;
+
+	if (!active || hole < 0) return;
+	last = --nslots;
+
+	/* keep the map dense, so the bytes we write
+	 * line up with slots 0..nslots-1
+	 */
+	while (hole != last) {
+		if (map_set(lampmap, hole, slotfds[last]) < 0) {
+			if (errno != EOPNOTSUPP) {
+				fanout_fail("map update");
+				return;
+			}
+
+			/* the tail went half-closed, so it's on its way
+			 * out too. drop it and try the next one down
+			 */
+			*slotowners[last] = -1;
+			if (map_unset(lampmap, last) < 0 && errno != ENOENT) {
+				fanout_fail("map delete");
+				return;
+			}
+
+			last = --nslots;
+			continue;
+		}
+
+		slotfds[hole] = slotfds[last];
+		slotowners[hole] = slotowners[last];
+		*slotowners[hole] = hole;
+		break;
+	}
+
+	if (map_unset(lampmap, last) < 0 && errno != ENOENT)
+		fanout_fail("map delete");
+	*slot = -1;
+
+	/* what's left of a push is addressed by the old slots:
+	 * the lamp moved into the hole may be behind the cursor,
+	 * and the last byte has nobody to go to. start it over,
+	 * and whoever already has the color gets it again
+	 */
+	if (pushing) fanout_broadcast(bcastcolor, bcastsince);
+}
+
+static void
+ctl_push(int fd, short event, void *arg)
+{
+	size_t	i, batch;
+	int	n;
+
+	(void)event;
+	(void)arg;
+
+	pushing = 0;
+	while (bcastoff < bcastlen) {
+		batch = bcastlen - bcastoff;
+		if (batch > PUSH_BATCH) batch = PUSH_BATCH;
+
+		for (i = 0; i < batch; i++) {
+			pushiov[i].iov_base = bcast + bcastoff + i;
+			pushiov[i].iov_len = 1;
+			pushmsgs[i].msg_hdr.msg_iov = &pushiov[i];
+			pushmsgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = sendmmsg(fd, pushmsgs, batch, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EWOULDBLOCK) {
+				if (event_add(&ctlev, NULL) < 0)
+					err(1, "ctl_push: event_add");
+				pushing = 1;
+				return;
+			}
+
+			/* a lamp that's hung up and not torn down yet
+			 * takes its slot with it: the cursor's already
+			 * past it, so skip its byte and carry on
+			 */
+			if (errno == ECONNRESET || errno == EPIPE) {
+				bcastoff++;
+				continue;
+			}
+
+			/* the lamps that already got theirs keep it,
+			 * and the rest will hear about the next color
+			 * from the user space path
+			 */
+			fanout_fail("sendmmsg");
+			return;
+		}
+
+		bcastoff += n;
+	}
+
+	/* all of it is with the kernel now */
+	stats_latency(STATS_TIER_LAMP, bcastsince, bcastlen);
+}
+
+int
+fanout_broadcast(char color, uint64_t since)
+{
+	if (!active) return -1;
+
+	/* a newer color supersedes whatever's still queued */
+	if (pushing && event_del(&ctlev) < 0)
+		err(1, "fanout_broadcast: event_del");
+
+	if (map_set(cursormap, 0, 0) < 0) {
+		fanout_fail("cursor reset");
+		return -1;
+	}
+
+	memset(bcast, color, nslots);
+	bcastcolor = color;
+	bcastoff = 0;
+	bcastlen = nslots;
+	bcastsince = since;
+
+	ctl_push(ctlfd, EV_WRITE, NULL);
+	return active ? 0 : -1;
+}
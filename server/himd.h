@@ -0,0 +1,125 @@
+/* himd.h
+ * functions shared between the pieces of himd
+ */
+
+#ifndef HIMD_H
+#define HIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* capture.c */
+#define CAPTURE_MAGIC		"HIMCAP01"
+#define CAPTURE_MAGICLEN	8
+#define CAPTURE_BUFSIZE		65536
+#define CAPTURE_FLUSH_SECS	1
+
+#define CAPTURE_CONNECT		1
+#define CAPTURE_DISCONNECT	2
+#define CAPTURE_DATA		3
+
+void		capture_open(const char *);
+void		capture_record(int, uint32_t, const void *, size_t);
+void		capture_flush(void);
+
+/* fanout.c */
+int		fanout_init(int);
+int		fanout_enabled(void);
+int		fanout_add(int, int *);
+void		fanout_del(int *);
+int		fanout_broadcast(char, uint64_t);
+
+/* history.c */
+#define HISTORY_MAGIC		"HIMHIST1"
+#define HISTORY_MAGICLEN	8
+#define HISTORY_RECORDS		65536
+
+struct history_record {
+	uint64_t	when;		/* unix microseconds */
+	uint32_t	conn;		/* connection id, as in captures */
+	uint8_t		old;
+	uint8_t		new;
+	uint8_t		pad[2];
+};
+
+void				 history_open(const char *);
+void				 history_append(uint32_t, char, char);
+uint64_t			 history_first(void);
+uint64_t			 history_end(void);
+uint64_t			 history_search(uint64_t);
+const struct history_record	*history_get(uint64_t);
+
+/* main.c */
+struct himd_load {
+	int		maxconns;
+	int		monitorcap;
+	int		conns;
+	int		monitors;
+	uint64_t	refusedmonitors;
+	uint64_t	refusedlamps;
+	uint64_t	shed;
+	uint64_t	acceptpauses;
+};
+
+const struct himd_load		*himd_load(void);
+
+/* presence.c */
+#define PRESENCE_PAGE_SHIFT	12
+#define PRESENCE_PAGE_IDS	(1 << PRESENCE_PAGE_SHIFT)
+
+#define PRESENCE_UNKNOWN	0
+#define PRESENCE_OFFLINE	1
+#define PRESENCE_ONLINE		2
+
+void		presence_open(uint64_t);
+int		presence_join(uint32_t);
+void		presence_leave(uint32_t);
+int		presence_lookup(uint32_t, uint32_t *);
+int64_t		presence_next(uint64_t);
+uint64_t	presence_online(void);
+uint64_t	presence_known(void);
+uint64_t	presence_size(void);
+
+/* profile.c */
+#define PROFILE_SLOTS		4096
+#define PROFILE_HZ		99
+#define PROFILE_HZ_MAX		1000
+#define PROFILE_LINEMAX		2048
+
+struct profile_stats {
+	int		hz;
+	uint64_t	samples;	/* taken and counted */
+	uint64_t	dropped;	/* taken, but the table was full */
+	uint64_t	missed;		/* not taken while we read the table */
+	uint64_t	stacks;		/* distinct stacks in the table */
+};
+
+void				 profile_open(void);
+int				 profile_enabled(void);
+int				 profile_start(int);
+void				 profile_stop(void);
+void				 profile_reset(void);
+void				 profile_hold(int);
+int				 profile_fold(size_t, char *, size_t);
+const struct profile_stats	*profile_stats(void);
+
+/* state.c */
+struct himstate_fields;
+
+void				 state_open(const char *);
+void				 state_publish(char, uint32_t, int, uint64_t);
+const struct himstate_fields	*state_get(void);
+
+/* stats.c */
+#define STATS_TIER_LAMP		0
+#define STATS_TIER_MONITOR	1
+#define STATS_TIERS		2
+
+struct stats_client;
+
+void		stats_open(int);
+int		stats_printf(struct stats_client *, const char *, ...)
+		    __attribute__((format(printf, 2, 3)));
+void		stats_latency(int, uint64_t, uint64_t);
+
+#endif /* HIMD_H */
@@ -0,0 +1,65 @@
+/* himstate.h
+ * layout of the read-only state page himd publishes with -m,
+ * for local consumers that just want to know the current color
+ * without joining the broadcast
+ *
+ * map it with shm_open(name, O_RDONLY) and mmap(PROT_READ), then
+ * call himstate_read as often as you like - no syscalls, and himd
+ * never waits on readers. the page is guarded by a seqlock: seq is
+ * odd while himd is writing, and changes whenever anything does
+ */
+
+#ifndef HIMSTATE_H
+#define HIMSTATE_H
+
+#include <stdint.h>
+
+#define HIMSTATE_NAME		"/himd"
+#define HIMSTATE_MAGIC		0x68696d64
+#define HIMSTATE_ABI		1
+#define HIMSTATE_SIZE		4096
+
+struct himstate_fields {
+	uint32_t	color;
+	uint32_t	version;
+	uint32_t	conns;
+	uint32_t	pid;
+	uint64_t	started;	/* unix microseconds */
+	uint64_t	changed;	/* unix microseconds */
+	uint64_t	accepted;
+};
+
+struct himstate {
+	uint32_t		magic;
+	uint32_t		abi;
+	uint32_t		seq;
+	uint32_t		pad;
+	struct himstate_fields	f;
+};
+
+/* copy out a consistent snapshot. returns 0, or -1 if
+ * this isn't a page we understand
+ */
+static inline int
+himstate_read(const struct himstate *page, struct himstate_fields *out)
+{
+	uint32_t	before, after;
+
+	if (page->magic != HIMSTATE_MAGIC || page->abi != HIMSTATE_ABI)
+		return -1;
+
+	do {
+		while ((before = __atomic_load_n(&page->seq,
+		    __ATOMIC_ACQUIRE)) & 1);
+
+		__builtin_memcpy(out, (const void *)&page->f,
+		    sizeof(struct himstate_fields));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+	} while (before != after);
+
+	return 0;
+}
+
+#endif /* HIMSTATE_H */
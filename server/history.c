@@ -0,0 +1,166 @@
+/* history.c
+ * remember every color change: when it happened, which
+ * connection did it, and what the color was before and after
+ *
+ * the history is a fixed ring of HISTORY_RECORDS records behind
+ * a small header, set up once at startup, so appending is a
+ * store and a counter bump. with -H the ring lives in a shared
+ * mapping of a file instead of anonymous memory, which means it
+ * survives restarts and can be read by anything that maps it:
+ *
+ *	char[8]	magic		HISTORY_MAGIC
+ *	u32	capacity	HISTORY_RECORDS
+ *	u32	pad
+ *	u64	count		records ever appended
+ *	...			up to HISTORY_HDRSIZE
+ *	record[capacity]	record n lives at n % capacity
+ *
+ * timestamps never go backwards, even if the wall clock does, so
+ * a time range can be found with a binary search over the ring
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "himd.h"
+
+#define HISTORY_HDRSIZE		64
+#define HISTORY_MAPSIZE		(HISTORY_HDRSIZE + \
+				 HISTORY_RECORDS * sizeof(struct history_record))
+
+struct history_header {
+	char		magic[HISTORY_MAGICLEN];
+	uint32_t	capacity;
+	uint32_t	pad;
+	uint64_t	count;
+};
+
+static struct history_header	*hdr = NULL;
+static struct history_record	*ring = NULL;
+
+static uint64_t		realtime_us(void);
+
+static uint64_t
+realtime_us(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		err(1, "realtime_us: clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void
+history_open(const char *path)
+{
+	struct stat	 sb;
+	void		*map;
+	int		 fd = -1, keep = 0;
+
+	if (path == NULL) {
+		map = mmap(NULL, HISTORY_MAPSIZE, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) err(1, "history_open: mmap");
+	} else {
+		/* before the chroot, like everything else we open */
+		fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+		if (fd < 0) err(1, "history_open: open %s", path);
+		if (fstat(fd, &sb) < 0) err(1, "history_open: fstat");
+
+		keep = (sb.st_size == (off_t)HISTORY_MAPSIZE);
+		if (!keep && ftruncate(fd, 0) < 0)
+			err(1, "history_open: ftruncate");
+		if (ftruncate(fd, HISTORY_MAPSIZE) < 0)
+			err(1, "history_open: ftruncate");
+
+		map = mmap(NULL, HISTORY_MAPSIZE, PROT_READ|PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) err(1, "history_open: mmap");
+		close(fd);
+	}
+
+	hdr = map;
+	ring = (struct history_record *)((char *)map + HISTORY_HDRSIZE);
+
+	if (keep && memcmp(hdr->magic, HISTORY_MAGIC, HISTORY_MAGICLEN) == 0 &&
+	    hdr->capacity == HISTORY_RECORDS) {
+		warnx("history: picked up %llu records from %s",
+		    (unsigned long long)hdr->count, path);
+		return;
+	}
+
+	memset(hdr, 0, HISTORY_HDRSIZE);
+	memcpy(hdr->magic, HISTORY_MAGIC, HISTORY_MAGICLEN);
+	hdr->capacity = HISTORY_RECORDS;
+
+	if (path != NULL) warnx("history: keeping color changes in %s", path);
+}
+
+void
+history_append(uint32_t conn, char old, char new)
+{
+	struct history_record	*r;
+	uint64_t		 now;
+
+	if (hdr == NULL) return;
+
+	now = realtime_us();
+	if (hdr->count > 0) {
+		r = &ring[(hdr->count - 1) % HISTORY_RECORDS];
+		if (now < r->when) now = r->when;
+	}
+
+	r = &ring[hdr->count % HISTORY_RECORDS];
+	r->when = now;
+	r->conn = conn;
+	r->old = (uint8_t)old;
+	r->new = (uint8_t)new;
+	r->pad[0] = r->pad[1] = 0;
+
+	hdr->count++;
+}
+
+uint64_t
+history_first(void)
+{
+	if (hdr == NULL || hdr->count < HISTORY_RECORDS) return 0;
+	return hdr->count - HISTORY_RECORDS;
+}
+
+uint64_t
+history_end(void)
+{
+	return (hdr == NULL) ? 0 : hdr->count;
+}
+
+const struct history_record *
+history_get(uint64_t n)
+{
+	if (n < history_first() || n >= history_end()) return NULL;
+	return &ring[n % HISTORY_RECORDS];
+}
+
+uint64_t
+history_search(uint64_t when)
+{
+	uint64_t	lo = history_first(), hi = history_end(), mid;
+
+	/* first record at or after when, or history_end() */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ring[mid % HISTORY_RECORDS].when < when) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
@@ -3,25 +3,149 @@
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <err.h>
 #include <errno.h>
 #include <event.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <pwd.h>
 #include <seccomp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "frame.h"
+#include "himd.h"
+
 #define SERVER_PORT		6969
 #define SERVER_USER		"him"
 #define SERVER_CHROOT		"/var/empty"
-#define SERVER_BACKLOG		128
+#define SERVER_BACKLOG		4096
+
+/* accept this many connections per wakeup of the
+ * listening socket before going back to serve lamps
+ */
+#define SERVER_ACCEPT_BATCH	1024
+
+/* how many lamps per second we're happy to take back
+ * after a restart - sizes the backoff window we hand out
+ */
+#define SERVER_RECONNECT_RATE	2000
+
+/* most connections the kernel fan-out (-k) will carry */
+#define SERVER_FANOUT_SLOTS	262144
+
+/* fds we keep for ourselves out of RLIMIT_NOFILE: stdio, the
+ * listeners, epoll, the capture, bpf maps, the reserve fd...
+ */
+#define SERVER_FD_RESERVE	32
+
+/* roughly what an idle connection costs us, counting the
+ * kernel's socket and epoll state, for turning -B into a cap
+ */
+#define SERVER_CONN_COST	(sizeof(struct him) + 3072)
+
+/* new monitors are turned away once we're this full, in
+ * percent of the connection cap, to leave room for lamps
+ */
+#define SERVER_MONITOR_SHARE	90
+
+/* at the cap, whoever we've heard from least recently, lamp
+ * or monitor, makes room for a new connection, as long as
+ * it's been quiet for at least this long
+ */
+#define SERVER_SHED_IDLE_MS	30000
+
+/* what the presence index may hold, in percent of -B, which
+ * connections don't get, or in bytes without -B
+ */
+#define SERVER_PRESENCE_SHARE	10
+#define SERVER_PRESENCE_BYTES	(64 * 1024 * 1024)
+
+/* how long to stop accepting when the system as a whole,
+ * rather than us, is out of fds or memory
+ */
+#define SERVER_ACCEPT_PAUSE_MS	100
+
+/* monitors get the latest color in one batch this often,
+ * when lamps aren't being sent to, but never fall further
+ * behind busy lamps than SERVER_MONITOR_MAX_MS
+ */
+#define SERVER_MONITOR_TICK_MS	100
+#define SERVER_MONITOR_MAX_MS	1000
+
+/* control bytes have the top bit set, so they never look
+ * like a color. a backoff hint carries a window in seconds
+ * in the low bits: lamps should wait a random time inside it
+ * before reconnecting
+ */
+#define HIM_CTL_BACKOFF		0x80
+#define HIM_BACKOFF_MAX		0x7f
+
+/* ops from clients use the top bit the same way. a monitor
+ * only watches, and says so, so we know who to turn away first
+ */
+#define HIM_OP_MONITOR		0x81
+
+/* relative changes, applied here in the order they arrive so
+ * that presses on two lamps at once both count. advance steps
+ * to the color after the current one. compare-and-set is
+ * followed by a big endian u32 version and a color, and sets
+ * the color only if nothing has changed since that version;
+ * a color of 0 never sets, which makes it a read
+ */
+#define HIM_OP_ADVANCE		0x82
+#define HIM_OP_CAS		0x83
+#define HIM_CAS_ARGS		5
+
+/* a lamp says who it is, as a big endian u32, so we can
+ * tell which lamps are online. ids handed out densely from
+ * 0 keep the presence index small. once per connection: any
+ * other id after that is ignored
+ */
+#define HIM_OP_IDENT		0x84
+#define HIM_IDENT_ARGS		4
+
+#define HIM_OP_ARGSMAX		HIM_CAS_ARGS
+
+/* a lamp that can run effects (see embed/main/vm.c) says so,
+ * and hears the current one, if there is one, right away and
+ * every new one after that. anybody can set the effect with a
+ * length up to VM_CODEMAX and that much program; a length of 0
+ * takes it away, and the lamps go back to their own
+ */
+#define HIM_OP_EFFECTS		0x85
+#define HIM_OP_EFFECT		0x86
+
+/* effects go out as 0x7e, the length and the program. 0x7e is
+ * no color, and only lamps that asked for effects ever see it
+ */
+#define HIM_CTL_EFFECT		0x7e
+
+/* only whoever sent the compare-and-set hears how it went:
+ * 0x00, ok (0 or 1), the u32 version and the color after it.
+ * 0 is neither a color nor a control byte, so the frame can't
+ * be mistaken for either
+ */
+#define HIM_CTL_RESULT		0x00
+#define HIM_RESULT_LEN		7
+
+/* the most we'll hold for somebody who isn't taking what we
+ * write: the rest of an effect, and a few results behind it
+ */
+#define HIM_TAIL_MAX		(2 + VM_CODEMAX + 8 * HIM_RESULT_LEN)
 
 #define HIM_STATE_RECV		0
 #define HIM_STATE_SEND		1
@@ -42,44 +166,144 @@ struct him {
 	struct event		ev;
 	int			sockfd;
 	int			sent;
+	uint32_t		id;
+	int			slot;
+	int			straggler;
+	int			monitor;
+	uint32_t		seen;
+	uint8_t			op;
+	uint8_t			args[HIM_OP_ARGSMAX];
+	int			nargs, wantargs;
+	int			identified;
+	uint32_t		lamp;
+	int			effects;
+	uint8_t			*program;
+	struct event		tailev;
+	uint8_t			*tail;
+	size_t			tailoff, taillen;
+	int			stale;
+	uint64_t		heard;
 	SLIST_ENTRY(him)	entries;
+	TAILQ_ENTRY(him)	monentries;
+	TAILQ_ENTRY(him)	idleentries;
 };
 
+/* lamps, and anybody who hasn't said they're a monitor */
 SLIST_HEAD(devlist, him) devlist = SLIST_HEAD_INITIALIZER(devlist);
 
+/* monitors live here instead, and never hold up sending
+ * to lamps
+ */
+TAILQ_HEAD(monlist, him) monlist = TAILQ_HEAD_INITIALIZER(monlist);
+
+/* everybody, least recently heard from first */
+TAILQ_HEAD(idlelist, him) idlelist = TAILQ_HEAD_INITIALIZER(idlelist);
+
 static int		listenfd = -1;
 static struct event	listenev;
 static int		sending = 0;
 static char		color = LED_COLOR_RED;
+static uint32_t		version = 0;
+static uint64_t		changedat = 0;
+static uint64_t		accepted = 0;
+static uint32_t		nextid = 0;
+static int		nconns = 0;
+static int		nmonitors = 0;
+static uint64_t		presencebudget = SERVER_PRESENCE_BYTES;
+
+/* lamps the kernel fan-out couldn't take, which still need
+ * colors written to them from here
+ */
+static int		nstragglers = 0;
+static struct event	termev, intev;
+
+static int		reservefd = -1;
+static struct event	pauseev;
+static struct event	monitorev;
+static uint64_t		monitorsserved = 0;
+static struct himd_load	load;
+static uint8_t		effect[VM_CODEMAX];
+static size_t		effectlen = 0;
 
 static void		him_new(int);
 static void		him_recv(int, short, void *);
 static void		him_send(int, short, void *);
+static void		him_greet(int, short, void *);
+static void		him_set(struct him *, char);
+static int		him_cas(struct him *);
+static void		him_ident(struct him *);
+static int		him_effect_byte(struct him *, unsigned char);
+static int		him_effect_set(struct him *);
+static int		him_effect_send(struct him *);
+static int		him_write(struct him *, const void *, size_t);
+static int		him_finish(struct him *);
+static void		him_flush(int, short, void *);
 static void		him_teardown(struct him *);
+static int		him_kernel(struct him *);
 static void		him_change_state(int);
 static int		him_done_sending(void);
 static void		him_accept(int, short, void *);
-
+static void		him_accept_pause(void);
+static void		him_accept_resume(int, short, void *);
+static void		him_hint(int);
+static void		him_refuse(int);
+static int		him_shed(void);
+static int		him_monitor(struct him *);
+static void		him_monitor_tick(int, short, void *);
+static uint64_t		him_now(void);
+static int		him_backoff_window(void);
+static void		him_publish(void);
+static void		him_shutdown(int, short, void *);
+
+static void		limits(long, long);
 static void		privdrop(void);
+static void		usage(void);
 
 static void
 him_new(int sockfd)
 {
 	struct him	*out;
 
-	if ((out = malloc(sizeof(struct him))) == NULL)
-		err(1, "him_new: malloc");
+	if ((out = malloc(sizeof(struct him))) == NULL) {
+		warn("him_new: malloc");
+		load.refusedlamps++;
+		him_refuse(sockfd);
+		return;
+	}
 
 	out->sockfd = sockfd;
 	out->sent = 0;
-
-	if (!sending) event_set(&out->ev, sockfd, EV_READ, him_recv, out);
+	out->id = ++nextid;
+	out->slot = -1;
+	out->straggler = 0;
+	out->monitor = 0;
+	out->op = 0;
+	out->identified = 0;
+	out->effects = 0;
+	out->program = NULL;
+	out->tail = NULL;
+	out->stale = 0;
+
+	/* a new lamp just needs the current color - there's
+	 * no reason to make everybody else listen to it again
+	 */
+	if (!sending) event_set(&out->ev, sockfd, EV_WRITE, him_greet, out);
 	else event_set(&out->ev, sockfd, EV_WRITE, him_send, out);
 
 	if (event_add(&out->ev, NULL) < 0)
 		err(1, "him_new: event_add");
 
 	SLIST_INSERT_HEAD(&devlist, out, entries);
+	out->heard = him_now();
+	TAILQ_INSERT_TAIL(&idlelist, out, idleentries);
+	if (fanout_add(sockfd, &out->slot) < 0 && fanout_enabled()) {
+		out->straggler = 1;
+		nstragglers++;
+	}
+	nconns++;
+	accepted++;
+	him_publish();
+	capture_record(CAPTURE_CONNECT, out->id, NULL, 0);
 }
 
 static void
@@ -87,19 +311,23 @@ him_recv(int fd, short event, void *arg)
 {
 	struct him	*h = (struct him *)arg;
 	ssize_t		 bytesread;
-	char		 newcolor;
+	unsigned char	 byte;
+	int		 heard = 0;
 
 	for (;;) {
-		bytesread = read(fd, &newcolor, sizeof(char));
+		bytesread = read(fd, &byte, sizeof(char));
 		if (bytesread == -1) {
 			if (errno == EWOULDBLOCK) {
-				if (!sending && event_add(&h->ev, NULL) < 0)
+				if ((!sending || h->monitor || him_kernel(h)) &&
+				    event_add(&h->ev, NULL) < 0)
 					err(1, "him_recv: event_add");
 				return;
-			} else if (errno == ECONNRESET || errno == ETIMEDOUT) {
-				him_teardown(h);
-				return;
-			} else err(1, "him_recv: read");
+			}
+
+			if (errno != ECONNRESET && errno != ETIMEDOUT)
+				warn("him_recv: read");
+			him_teardown(h);
+			return;
 		}
 
 		if (bytesread == 0) {
@@ -107,18 +335,348 @@ him_recv(int fd, short event, void *arg)
 			return;
 		}
 
-		if (newcolor >= LED_COLOR_MAX || newcolor == 0) {
-			warnx("illegal color %d received", newcolor);
+		capture_record(CAPTURE_DATA, h->id, (char *)&byte, sizeof(char));
+
+		/* anything we hear keeps h off the front of the
+		 * line for shedding
+		 */
+		if (!heard) {
+			heard = 1;
+			h->heard = him_now();
+			TAILQ_REMOVE(&idlelist, h, idleentries);
+			TAILQ_INSERT_TAIL(&idlelist, h, idleentries);
+		}
+
+		/* the rest of an op that didn't fit in one byte */
+		if (h->op == HIM_OP_EFFECT) {
+			if (him_effect_byte(h, byte) < 0) return;
+			continue;
+		} else if (h->op != 0) {
+			h->args[h->nargs++] = byte;
+			if (h->nargs < h->wantargs) continue;
+
+			if (h->op == HIM_OP_IDENT) him_ident(h);
+			else if (him_cas(h) < 0) return;
+			h->op = 0;
+			continue;
+		}
+
+		if (byte == HIM_OP_MONITOR) {
+			if (him_monitor(h) < 0) return;
+			continue;
+		}
+
+		if (byte == HIM_OP_CAS || byte == HIM_OP_IDENT) {
+			h->op = byte;
+			h->nargs = 0;
+			h->wantargs = (byte == HIM_OP_CAS) ?
+			    HIM_CAS_ARGS : HIM_IDENT_ARGS;
+			continue;
+		}
+
+		if (byte == HIM_OP_ADVANCE) {
+			him_set(h, color % (LED_COLOR_MAX - 1) + 1);
+			continue;
+		}
+
+		if (byte == HIM_OP_EFFECTS) {
+			h->effects = 1;
+			if (effectlen > 0 && him_effect_send(h) < 0) return;
+			continue;
+		}
+
+		/* programs are too long for args, so they go in a
+		 * buffer of their own for as long as they take
+		 */
+		if (byte == HIM_OP_EFFECT) {
+			if (h->program == NULL &&
+			    (h->program = malloc(VM_CODEMAX)) == NULL) {
+				warn("him_recv: malloc");
+				him_teardown(h);
+				return;
+			}
+
+			h->op = byte;
+			h->nargs = 0;
+			h->wantargs = -1;
+			continue;
+		}
+
+		if (byte >= LED_COLOR_MAX || byte == 0) {
+			warnx("illegal color %d received", byte);
 			him_teardown(h);
 			return;
 		}
 
-		color = newcolor;
-		warnx("received new color %d from fd %d", color, fd);
+		him_set(h, byte);
+	}
+
+	(void)event;
+}
+
+static void
+him_set(struct him *h, char newcolor)
+{
+	history_append(h->id, color, newcolor);
+	color = newcolor;
+	version++;
+	changedat = him_now();
+	him_publish();
+	warnx("received new color %d from fd %d", color, h->sockfd);
+
+	if (fanout_broadcast(color, changedat) < 0 || nstragglers > 0)
 		him_change_state(HIM_STATE_SEND);
+}
+
+/* returns -1 if h couldn't take the result, and is gone */
+static int
+him_cas(struct him *h)
+{
+	unsigned char	result[HIM_RESULT_LEN];
+	uint32_t	want;
+	int		ok;
+
+	want = (uint32_t)h->args[0] << 24 | (uint32_t)h->args[1] << 16 |
+	    (uint32_t)h->args[2] << 8 | h->args[3];
+
+	ok = (want == version && h->args[4] != 0 &&
+	    h->args[4] < LED_COLOR_MAX);
+	if (ok) him_set(h, h->args[4]);
+
+	result[0] = HIM_CTL_RESULT;
+	result[1] = ok;
+	result[2] = version >> 24;
+	result[3] = version >> 16;
+	result[4] = version >> 8;
+	result[5] = version;
+	result[6] = color;
+
+	/* behind whatever of an effect hasn't gone out yet */
+	return him_write(h, result, sizeof(result));
+}
+
+static void
+him_ident(struct him *h)
+{
+	uint32_t	lamp;
+
+	lamp = (uint32_t)h->args[0] << 24 | (uint32_t)h->args[1] << 16 |
+	    (uint32_t)h->args[2] << 8 | h->args[3];
+
+	/* otherwise one connection could have us make room for
+	 * as many ids as it cares to send
+	 */
+	if (h->identified) {
+		if (h->lamp != lamp)
+			warnx("fd %d is lamp %u, not %u", h->sockfd,
+			    h->lamp, lamp);
+		return;
+	}
+
+	if (presence_join(lamp) < 0) {
+		warnx("can't track lamp %u on fd %d", lamp, h->sockfd);
+		return;
+	}
+
+	h->identified = 1;
+	h->lamp = lamp;
+}
+
+/* the length of an effect, then the program, a byte at a time.
+ * -1 if h is gone
+ */
+static int
+him_effect_byte(struct him *h, unsigned char byte)
+{
+	if (h->wantargs < 0) {
+		if (byte > VM_CODEMAX) {
+			warnx("effect of %d bytes received", byte);
+			him_teardown(h);
+			return -1;
+		}
+
+		h->wantargs = byte;
+	} else h->program[h->nargs++] = byte;
+
+	if (h->nargs < h->wantargs) return 0;
+
+	h->op = 0;
+	return him_effect_set(h);
+}
+
+/* checked here, once, so no lamp is ever sent anything it
+ * would turn away. -1 if h is gone
+ */
+static int
+him_effect_set(struct him *h)
+{
+	struct him	*l, *next;
+	const char	*why;
+	int		 gone = 0, self;
+
+	if (h->nargs > 0 && vm_check(h->program, h->nargs, &why) < 0) {
+		warnx("illegal effect received: %s", why);
+		him_teardown(h);
+		return -1;
+	}
+
+	memcpy(effect, h->program, h->nargs);
+	effectlen = h->nargs;
+	free(h->program);
+	h->program = NULL;
+	warnx("received %zu byte effect from fd %d", effectlen, h->sockfd);
+
+	/* lamps that can't take it get torn down as we go, so
+	 * whether it's h has to be known before it might be freed
+	 */
+	for (l = SLIST_FIRST(&devlist); l != NULL; l = next) {
+		next = SLIST_NEXT(l, entries);
+		if (!l->effects) continue;
+		self = (l == h);
+		if (him_effect_send(l) < 0 && self) gone = 1;
+	}
+
+	return gone ? -1 : 0;
+}
+
+/* straight out, like a compare-and-set result: it's rare, and
+ * small. -1 if h is gone
+ */
+static int
+him_effect_send(struct him *h)
+{
+	unsigned char	frame[2 + VM_CODEMAX];
+
+	/* half a frame's already out. this one follows it */
+	if (h->tail != NULL) {
+		h->stale = 1;
+		return 0;
+	}
+
+	frame[0] = HIM_CTL_EFFECT;
+	frame[1] = effectlen;
+	memcpy(frame + 2, effect, effectlen);
+	return him_write(h, frame, 2 + effectlen);
+}
+
+/* buf goes out after anything still waiting for h. whatever the
+ * socket won't take yet waits on h too, and goes out from tailev
+ * before any color does. -1 if h is gone
+ */
+static int
+him_write(struct him *h, const void *buf, size_t len)
+{
+	ssize_t	n = 0;
+
+	if (h->tail == NULL) {
+		n = write(h->sockfd, buf, len);
+		if (n < 0 && errno == EWOULDBLOCK) n = 0;
+		else if (n < 0) {
+			if (errno != EPIPE && errno != ECONNRESET)
+				warn("him_write: write");
+			him_teardown(h);
+			return -1;
+		}
+
+		if ((size_t)n == len) return 0;
+
+		if ((h->tail = malloc(HIM_TAIL_MAX)) == NULL) {
+			warn("him_write: malloc");
+			him_teardown(h);
+			return -1;
+		}
+
+		h->tailoff = h->taillen = 0;
+
+		/* the kernel would put colors in the middle of it, so
+		 * h's are written from here until it's all gone
+		 */
+		if (him_kernel(h)) {
+			fanout_del(&h->slot);
+			h->straggler = 1;
+			nstragglers++;
+		}
+
+		event_set(&h->tailev, h->sockfd, EV_WRITE, him_flush, h);
+		if (event_add(&h->tailev, NULL) < 0)
+			err(1, "him_write: event_add");
+	} else if (h->taillen - h->tailoff + len > HIM_TAIL_MAX) {
+		/* it isn't reading, and it's going to miss colors
+		 * anyway
+		 */
+		warnx("fd %d isn't reading what we send", h->sockfd);
+		him_teardown(h);
+		return -1;
+	}
+
+	if (h->taillen + len - n > HIM_TAIL_MAX) {
+		memmove(h->tail, h->tail + h->tailoff,
+		    h->taillen - h->tailoff);
+		h->taillen -= h->tailoff;
+		h->tailoff = 0;
+	}
+
+	memcpy(h->tail + h->taillen, (const unsigned char *)buf + n, len - n);
+	h->taillen += len - n;
+	return 0;
+}
+
+/* writes as much of h's tail as the socket takes: 1 if some
+ * is still left, 0 once it's all out, -1 if h is gone
+ */
+static int
+him_finish(struct him *h)
+{
+	ssize_t	n;
+
+	if (h->tail == NULL) return 0;
+
+	n = write(h->sockfd, h->tail + h->tailoff, h->taillen - h->tailoff);
+	if (n < 0) {
+		if (errno == EWOULDBLOCK) return 1;
+		if (errno != EPIPE && errno != ECONNRESET)
+			warn("him_finish: write");
+		him_teardown(h);
+		return -1;
 	}
 
+	h->tailoff += n;
+	if (h->tailoff < h->taillen) return 1;
+
+	if (event_del(&h->tailev) < 0)
+		err(1, "him_finish: event_del");
+	free(h->tail);
+	h->tail = NULL;
+
+	/* the kernel can have it back. one it turned away to
+	 * begin with just gets asked again
+	 */
+	if (h->straggler && !h->monitor &&
+	    fanout_add(h->sockfd, &h->slot) == 0) {
+		h->straggler = 0;
+		nstragglers--;
+	}
+
+	/* the effect changed while this one was going out */
+	if (h->stale) {
+		h->stale = 0;
+		if (him_effect_send(h) < 0) return -1;
+		if (h->tail != NULL) return 1;
+	}
+
+	return 0;
+}
+
+static void
+him_flush(int fd, short event, void *arg)
+{
+	struct him	*h = (struct him *)arg;
+
+	(void)fd;
 	(void)event;
+
+	if (him_finish(h) > 0 && event_add(&h->tailev, NULL) < 0)
+		err(1, "him_flush: event_add");
 }
 
 static void
@@ -129,28 +687,90 @@ him_send(int fd, short event, void *arg)
 
 	(void)event;
 
+	/* the color can't go in the middle of what's waiting */
+	switch (him_finish(h)) {
+	case -1:
+		return;
+	case 1:
+		if (event_add(&h->ev, NULL) < 0)
+			err(1, "him_send: event_add");
+		return;
+	}
+
 	byteswritten = write(fd, &color, sizeof(char));
 	if (byteswritten == -1) {
 		if (errno == EWOULDBLOCK) {
 			if (event_add(&h->ev, NULL) < 0)
 				err(1, "him_send: event_add");
 			return;
-		} else err(1, "him_send: write");
+		}
+
+		if (errno != EPIPE && errno != ECONNRESET)
+			warn("him_send: write");
+		him_teardown(h);
+		return;
 	}
 
-	if (byteswritten == 0) him_teardown(h);
+	if (byteswritten == 0) {
+		him_teardown(h);
+		return;
+	}
 
+	stats_latency(STATS_TIER_LAMP, changedat, 1);
 	warnx("sent new color %d to fd %d", color, fd);
 	h->sent = 1;
 	if (him_done_sending()) him_change_state(HIM_STATE_RECV);
 }
 
+static void
+him_greet(int fd, short event, void *arg)
+{
+	struct him	*h = (struct him *)arg;
+	ssize_t		 byteswritten;
+
+	(void)event;
+
+	byteswritten = write(fd, &color, sizeof(char));
+	if (byteswritten == -1) {
+		if (errno == EWOULDBLOCK) {
+			if (event_add(&h->ev, NULL) < 0)
+				err(1, "him_greet: event_add");
+			return;
+		}
+
+		if (errno != EPIPE && errno != ECONNRESET)
+			warn("him_greet: write");
+		him_teardown(h);
+		return;
+	}
+
+	warnx("greeted fd %d with color %d", fd, color);
+	event_set(&h->ev, fd, EV_READ, him_recv, h);
+	if (event_add(&h->ev, NULL) < 0)
+		err(1, "him_greet: event_add");
+}
+
 static void
 him_teardown(struct him *h)
 {
 	if (event_del(&h->ev) < 0) err(1, "him_teardown: event_del");
-	SLIST_REMOVE(&devlist, h, him, entries);
+	if (h->tail != NULL && event_del(&h->tailev) < 0)
+		err(1, "him_teardown: event_del");
+	if (h->monitor) {
+		TAILQ_REMOVE(&monlist, h, monentries);
+		nmonitors--;
+	} else SLIST_REMOVE(&devlist, h, him, entries);
+	TAILQ_REMOVE(&idlelist, h, idleentries);
+
+	fanout_del(&h->slot);
+	if (h->straggler) nstragglers--;
+	if (h->identified) presence_leave(h->lamp);
+	free(h->program);
+	free(h->tail);
+	nconns--;
+	him_publish();
 	close(h->sockfd);
+	capture_record(CAPTURE_DISCONNECT, h->id, NULL, 0);
 
 	warnx("tearing down connection (fd %d)", h->sockfd);
 	free(h);
@@ -158,6 +778,13 @@ him_teardown(struct him *h)
 	if (him_done_sending()) him_change_state(HIM_STATE_RECV);
 }
 
+/* whether the kernel fan-out sends h its colors */
+static int
+him_kernel(struct him *h)
+{
+	return fanout_enabled() && h->slot >= 0;
+}
+
 static void
 him_change_state(int newstate)
 {
@@ -175,6 +802,14 @@ him_change_state(int newstate)
 	SLIST_FOREACH(p, &devlist, entries) {
 		p->sent = 0;
 
+		/* the kernel already has its color, so it just
+		 * carries on reading
+		 */
+		if (sending && him_kernel(p)) {
+			p->sent = 1;
+			continue;
+		}
+
 		if (event_del(&p->ev) < 0)
 			err(1, "him_change_state: event_del");
 
@@ -197,20 +832,303 @@ him_done_sending(void)
 static void
 him_accept(int fd, short event, void *arg)
 {
-	int	sockfd;
+	int	sockfd, i;
+
+	(void)event;
+	(void)arg;
+
+	for (i = 0; i < SERVER_ACCEPT_BATCH; i++) {
+		sockfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if (sockfd == -1) {
+			if (errno == EWOULDBLOCK) break;
+			else if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+
+			/* out of our own fds: spend the reserve one on
+			 * telling the next client to come back later
+			 */
+			if (errno == EMFILE && reservefd >= 0) {
+				close(reservefd);
+				sockfd = accept4(fd, NULL, NULL,
+				    SOCK_NONBLOCK|SOCK_CLOEXEC);
+				if (sockfd >= 0) {
+					load.refusedlamps++;
+					him_refuse(sockfd);
+				}
+
+				reservefd = dup(fd);
+				if (sockfd >= 0) continue;
+				else if (reservefd >= 0) break;
+			}
+
+			warn("him_accept: accept");
+			him_accept_pause();
+			break;
+		}
+
+		/* new monitors were already turned away short of
+		 * the cap. at it, somebody who's gone quiet makes
+		 * room, or the newcomer doesn't get in
+		 */
+		if (nconns >= load.maxconns && !him_shed()) {
+			load.refusedlamps++;
+			him_refuse(sockfd);
+			continue;
+		}
+
+		him_new(sockfd);
+	}
+
+	if (i > 0) warnx("accepted %d new connections (%d total)", i, nconns);
+}
+
+static void
+him_accept_pause(void)
+{
+	struct timeval	tv = { 0, SERVER_ACCEPT_PAUSE_MS * 1000 };
+
+	if (event_del(&listenev) < 0) err(1, "him_accept_pause: event_del");
+	if (evtimer_add(&pauseev, &tv) < 0)
+		err(1, "him_accept_pause: evtimer_add");
+	load.acceptpauses++;
+}
 
+static void
+him_accept_resume(int fd, short event, void *arg)
+{
+	(void)fd;
 	(void)event;
 	(void)arg;
 
-	sockfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
-	if (sockfd == -1) {
-		if (errno == EWOULDBLOCK) return;
-		else err(1, "him_accept: accept");
+	if (event_add(&listenev, NULL) < 0)
+		err(1, "him_accept_resume: event_add");
+}
+
+/* a connection we won't serve still gets told when to come
+ * back, so it doesn't hammer us like we weren't there
+ */
+static void
+him_hint(int sockfd)
+{
+	unsigned char	hint;
+
+	hint = HIM_CTL_BACKOFF | him_backoff_window();
+	if (write(sockfd, &hint, sizeof(char)) < 0 &&
+	    errno != EWOULDBLOCK && errno != EPIPE && errno != ECONNRESET)
+		warn("him_hint: write");
+}
+
+static void
+him_refuse(int sockfd)
+{
+	him_hint(sockfd);
+	close(sockfd);
+}
+
+/* make room for one more by letting whoever we've heard from
+ * least recently go, if that was SERVER_SHED_IDLE_MS ago or
+ * more. returns 0 if nobody's been quiet that long
+ */
+static int
+him_shed(void)
+{
+	struct him	*victim;
+	uint64_t	 idle;
+
+	if ((victim = TAILQ_FIRST(&idlelist)) == NULL) return 0;
+	idle = him_now() - victim->heard;
+	if (idle < (uint64_t)SERVER_SHED_IDLE_MS * 1000) return 0;
+
+	warnx("shedding %s fd %d, quiet for %" PRIu64 "s",
+	    victim->monitor ? "monitor" : "lamp", victim->sockfd,
+	    idle / 1000000);
+	him_hint(victim->sockfd);
+	him_teardown(victim);
+	load.shed++;
+	return 1;
+}
+
+/* returns -1 if we turned it away, and h is gone */
+static int
+him_monitor(struct him *h)
+{
+	if (h->monitor) return 0;
+
+	if (nconns > load.monitorcap) {
+		warnx("refusing monitor fd %d, %d connections",
+		    h->sockfd, nconns);
+		load.refusedmonitors++;
+		him_hint(h->sockfd);
+		him_teardown(h);
+		return -1;
 	}
 
-	warnx("accepting new connection -> fd %d", sockfd);
-	him_change_state(HIM_STATE_SEND);
-	him_new(sockfd);
+	/* off the lamp tier. if we were halfway through sending
+	 * to it, the next tick catches it up instead
+	 */
+	SLIST_REMOVE(&devlist, h, him, entries);
+	fanout_del(&h->slot);
+	if (h->straggler) nstragglers--;
+	h->straggler = 0;
+	h->seen = (sending && !h->sent) ? version - 1 : version;
+	h->monitor = 1;
+	TAILQ_INSERT_TAIL(&monlist, h, monentries);
+	nmonitors++;
+
+	/* him_recv puts us back on the read side */
+	if (event_del(&h->ev) < 0) err(1, "him_monitor: event_del");
+	event_set(&h->ev, h->sockfd, EV_READ, him_recv, h);
+
+	if (sending && him_done_sending()) him_change_state(HIM_STATE_RECV);
+	return 0;
+}
+
+static void
+him_monitor_tick(int fd, short event, void *arg)
+{
+	struct timeval	 tv = { 0, SERVER_MONITOR_TICK_MS * 1000 };
+	struct him	*p, *next;
+	uint64_t	 now = him_now();
+	ssize_t		 n;
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+
+	/* lamps first */
+	if (sending && now - monitorsserved < SERVER_MONITOR_MAX_MS * 1000)
+		goto again;
+	monitorsserved = now;
+
+	for (p = TAILQ_FIRST(&monlist); p != NULL; p = next) {
+		next = TAILQ_NEXT(p, monentries);
+		if (p->seen == version || p->tail != NULL) continue;
+
+		/* a monitor that can't keep up just gets
+		 * whatever is newest next time around
+		 */
+		n = write(p->sockfd, &color, sizeof(char));
+		if (n == 1) {
+			p->seen = version;
+			stats_latency(STATS_TIER_MONITOR, changedat, 1);
+			continue;
+		} else if (n < 0 && errno == EWOULDBLOCK) continue;
+
+		if (n < 0 && errno != EPIPE && errno != ECONNRESET)
+			warn("him_monitor_tick: write");
+		him_teardown(p);
+	}
+
+again:
+	if (evtimer_add(&monitorev, &tv) < 0)
+		err(1, "him_monitor_tick: evtimer_add");
+}
+
+static uint64_t
+him_now(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "him_now: clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+const struct himd_load *
+himd_load(void)
+{
+	load.conns = nconns;
+	load.monitors = nmonitors;
+	return &load;
+}
+
+static void
+him_publish(void)
+{
+	state_publish(color, version, nconns, accepted);
+}
+
+static int
+him_backoff_window(void)
+{
+	int	window;
+
+	window = nconns / SERVER_RECONNECT_RATE + 1;
+	return (window > HIM_BACKOFF_MAX) ? HIM_BACKOFF_MAX : window;
+}
+
+static void
+him_shutdown(int sig, short event, void *arg)
+{
+	struct him	*p;
+	unsigned char	 hint;
+
+	(void)event;
+	(void)arg;
+
+	/* tell everybody to come back at different times,
+	 * rather than all at once when we're back up
+	 */
+	hint = HIM_CTL_BACKOFF | him_backoff_window();
+	warnx("caught signal %d, closing %d connections with %ds backoff",
+	    sig, nconns, hint & HIM_BACKOFF_MAX);
+
+	SLIST_FOREACH(p, &devlist, entries) {
+		if (write(p->sockfd, &hint, sizeof(char)) < 0 &&
+		    errno != EWOULDBLOCK && errno != EPIPE &&
+		    errno != ECONNRESET)
+			warn("him_shutdown: write");
+		close(p->sockfd);
+	}
+
+	TAILQ_FOREACH(p, &monlist, monentries) {
+		him_hint(p->sockfd);
+		close(p->sockfd);
+	}
+
+	capture_flush();
+	exit(0);
+}
+
+static void
+limits(long maxconns, long budget)
+{
+	struct rlimit	rl;
+	long		fdcap;
+
+	/* take all the fds we're allowed */
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) err(1, "limits: getrlimit");
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			warn("limits: setrlimit");
+		else if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+			err(1, "limits: getrlimit");
+	}
+
+	fdcap = (rl.rlim_cur > INT_MAX) ? INT_MAX : (long)rl.rlim_cur;
+	fdcap -= SERVER_FD_RESERVE;
+	if (fdcap < 1) errx(1, "only %ld fds to work with", (long)rl.rlim_cur);
+
+	if (maxconns == 0) maxconns = fdcap;
+	else if (maxconns > fdcap) {
+		warnx("only have fds for %ld connections", fdcap);
+		maxconns = fdcap;
+	}
+
+	if (budget > 0) {
+		presencebudget = budget / 100 * SERVER_PRESENCE_SHARE;
+		budget -= presencebudget;
+	}
+
+	if (budget > 0 && budget / (long)SERVER_CONN_COST < maxconns)
+		maxconns = budget / (long)SERVER_CONN_COST;
+	if (maxconns < 1) errx(1, "memory budget too small for anybody");
+
+	load.maxconns = (int)maxconns;
+	load.monitorcap = (int)(maxconns * SERVER_MONITOR_SHARE / 100);
+	warnx("serving at most %d connections, monitors while under %d",
+	    load.maxconns, load.monitorcap);
 }
 
 #define SECCOMP_ALLOW(CTX, SYS) do {						\
@@ -252,14 +1170,102 @@ privdrop(void)
 	SECCOMP_ALLOW(scctx, epoll_ctl);
 	SECCOMP_ALLOW(scctx, epoll_pwait);
 
+	/* libevent signal delivery, and clean exit */
+	SECCOMP_ALLOW(scctx, rt_sigreturn);
+	SECCOMP_ALLOW(scctx, sendto);
+	SECCOMP_ALLOW(scctx, recvfrom);
+	SECCOMP_ALLOW(scctx, exit_group);
+
+	/* malloc growing and shrinking the heap */
+	SECCOMP_ALLOW(scctx, brk);
+	SECCOMP_ALLOW(scctx, mmap);
+	SECCOMP_ALLOW(scctx, munmap);
+	SECCOMP_ALLOW(scctx, mremap);
+	SECCOMP_ALLOW(scctx, madvise);
+
+	/* the reserve fd for when we run out */
+	SECCOMP_ALLOW(scctx, dup);
+
+	/* turning the profiler on and off from stats */
+	if (profile_enabled()) SECCOMP_ALLOW(scctx, setitimer);
+
+	/* sockmap updates as lamps come and go */
+	if (fanout_enabled()) {
+		SECCOMP_ALLOW(scctx, bpf);
+		SECCOMP_ALLOW(scctx, sendmmsg);
+	}
+
 	if (seccomp_load(scctx) < 0) err(1, "privdrop: seccomp_load");
 }
 
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: himd [-kp] [-B budget] [-b backlog] "
+	    "[-c maxconns] [-H history] [-m shmname] [-s port] "
+	    "[-w capture]\n");
+	exit(2);
+}
+
 int
-main()
+main(int argc, char *argv[])
 {
-	struct sockaddr_in	sa;
-	int			enable = 1;
+	struct sockaddr_in	 sa;
+	int			 enable = 1, ch, backlog = SERVER_BACKLOG;
+	int			 kernelfanout = 0, statsport = 0;
+	int			 profiling = 0;
+	long			 maxconns = 0, budget = 0, arg;
+	char			*capture = NULL, *shmname = NULL, *end;
+	char			*history = NULL;
+
+	while ((ch = getopt(argc, argv, "B:b:c:H:km:ps:w:")) != -1) {
+		switch (ch) {
+		case 'B':
+			budget = strtol(optarg, &end, 10);
+			if (*end != '\0' || budget <= 0 ||
+			    budget > LONG_MAX / (1024 * 1024))
+				errx(1, "budget must be a positive "
+				    "number of megabytes");
+			budget *= 1024 * 1024;
+			break;
+		case 'c':
+			maxconns = strtol(optarg, &end, 10);
+			if (*end != '\0' || maxconns <= 0 ||
+			    maxconns > INT_MAX)
+				errx(1, "maxconns must be a positive number");
+			break;
+		case 'b':
+			arg = strtol(optarg, &end, 10);
+			if (*end != '\0' || arg <= 0 || arg > INT_MAX)
+				errx(1, "backlog must be a positive number");
+			backlog = (int)arg;
+			break;
+		case 'H':
+			history = optarg;
+			break;
+		case 'k':
+			kernelfanout = 1;
+			break;
+		case 'm':
+			shmname = optarg;
+			break;
+		case 'p':
+			profiling = 1;
+			break;
+		case 's':
+			statsport = strtol(optarg, &end, 10);
+			if (*end != '\0' || statsport <= 0 || statsport > 65535)
+				errx(1, "stats port must be between 1 and 65535");
+			break;
+		case 'w':
+			capture = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (argc != optind) usage();
 
 	if (getuid() != 0)
 		errx(1, "this program must be run as root");
@@ -269,6 +1275,7 @@ main()
 	system("iptables -P FORWARD ACCEPT");
 	system("iptables -F");
 
+	limits(maxconns, budget);
 	event_init();
 
 	listenfd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
@@ -287,7 +1294,15 @@ main()
 	    sizeof(struct sockaddr_in)) < 0)
 		err(1, "main: bind");
 
-	if (listen(listenfd, SERVER_BACKLOG) < 0)
+	/* lamps never send anything with their SYN, but
+	 * updaters can. the queue is bounded like the backlog
+	 */
+	if (setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN,
+	    &backlog, sizeof(int)) < 0)
+		warn("main: setsockopt TCP_FASTOPEN");
+
+	/* the kernel quietly clamps this to net.core.somaxconn */
+	if (listen(listenfd, backlog) < 0)
 		err(1, "main: listen");
 
 	warnx("listening on port %d", SERVER_PORT);
@@ -295,6 +1310,27 @@ main()
 	if (event_add(&listenev, NULL) < 0)
 		err(1, "main: event_add");
 
+	evtimer_set(&pauseev, him_accept_resume, NULL);
+	if ((reservefd = dup(listenfd)) < 0) err(1, "main: dup");
+
+	evtimer_set(&monitorev, him_monitor_tick, NULL);
+	him_monitor_tick(-1, 0, NULL);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal_set(&termev, SIGTERM, him_shutdown, NULL);
+	signal_set(&intev, SIGINT, him_shutdown, NULL);
+	if (signal_add(&termev, NULL) < 0 || signal_add(&intev, NULL) < 0)
+		err(1, "main: signal_add");
+
+	if (capture != NULL) capture_open(capture);
+	if (kernelfanout) fanout_init(SERVER_FANOUT_SLOTS);
+	if (shmname != NULL) state_open(shmname);
+	if (statsport != 0) stats_open(statsport);
+	history_open(history);
+	presence_open(presencebudget);
+	if (profiling) profile_open();
+	him_publish();
+
 	privdrop();
 	event_dispatch();
 	/* never reached */
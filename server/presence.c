@@ -0,0 +1,280 @@
+/* presence.c
+ * which lamps are online right now. lamps say who they are with
+ * a u32 id once they connect, and we keep a bit per id, set
+ * while at least one connection holds it, along with when it
+ * last came or went
+ *
+ * ids are split into pages of PRESENCE_PAGE_IDS, found through
+ * a directory with a slot for every page there could be. the
+ * directory is reserved up front and the kernel only backs the
+ * parts we touch, and a page is allocated the first time one of
+ * its ids shows up, so a fleet numbered from 0 up costs a few
+ * bytes per lamp however far the numbering goes:
+ *
+ *	page	bits[]		online bitmap
+ *		since[]		unix seconds it came online, or went
+ *				offline, or 0 if never seen
+ *		conns[]		connections holding the id
+ *		online		bits set in this page
+ *		known		since[]s that aren't 0
+ *
+ * ids are whatever anybody says they are, so pages only stay
+ * while somebody in them is online, taking the offline times on
+ * them along when they go, and no more are allocated than fit
+ * in the budget presence_open was given.
+ *
+ * membership is a directory load and a bit test, and the counts
+ * are kept as we go, so neither depends on how many lamps we know.
+ * walking the online ids goes by live[], a bit per page with
+ * anybody online in it, and livesum[], a bit per word of live[]
+ * that isn't 0, so a sparse fleet doesn't mean reading the
+ * whole directory
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "himd.h"
+
+#define PRESENCE_PAGES		((uint64_t)1 << (32 - PRESENCE_PAGE_SHIFT))
+#define PRESENCE_WORDS		(PRESENCE_PAGE_IDS / 64)
+#define PRESENCE_CONNS_MAX	UINT16_MAX
+#define PRESENCE_LIVE_WORDS	(PRESENCE_PAGES / 64)
+#define PRESENCE_SUM_WORDS	(PRESENCE_LIVE_WORDS / 64)
+
+struct presence_page {
+	uint64_t	bits[PRESENCE_WORDS];
+	uint32_t	since[PRESENCE_PAGE_IDS];
+	uint16_t	conns[PRESENCE_PAGE_IDS];
+	uint32_t	online;
+	uint32_t	known;
+};
+
+static struct presence_page	**dir = NULL;
+static uint64_t			  online = 0;
+static uint64_t			  known = 0;
+static uint64_t			  pages = 0;
+static uint64_t			  maxpages = 0;
+static uint64_t			  live[PRESENCE_LIVE_WORDS];
+static uint64_t			  livesum[PRESENCE_SUM_WORDS];
+
+static struct presence_page	*presence_page(uint32_t, int);
+static void			 presence_live(uint64_t, int);
+static int64_t			 presence_nextpage(uint64_t);
+static uint32_t			 presence_now(void);
+
+/* budget is the most bytes of pages we'll hold */
+void
+presence_open(uint64_t budget)
+{
+	maxpages = budget / sizeof(struct presence_page);
+
+	/* anonymous memory comes zeroed, and only costs
+	 * anything once written
+	 */
+	dir = mmap(NULL, PRESENCE_PAGES * sizeof(struct presence_page *),
+	    PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+	    -1, 0);
+	if (dir == MAP_FAILED) err(1, "presence_open: mmap");
+}
+
+static struct presence_page *
+presence_page(uint32_t id, int create)
+{
+	struct presence_page	**slot = &dir[id >> PRESENCE_PAGE_SHIFT];
+
+	if (*slot == NULL && create) {
+		if (pages == maxpages) return NULL;
+		if ((*slot = calloc(1, sizeof(struct presence_page))) == NULL) {
+			warn("presence_page: calloc");
+			return NULL;
+		}
+
+		pages++;
+	}
+
+	return *slot;
+}
+
+/* page has somebody online in it, or no longer does */
+static void
+presence_live(uint64_t page, int on)
+{
+	uint64_t	w = page / 64;
+
+	if (on) {
+		live[w] |= (uint64_t)1 << (page % 64);
+		livesum[w / 64] |= (uint64_t)1 << (w % 64);
+		return;
+	}
+
+	live[w] &= ~((uint64_t)1 << (page % 64));
+	if (live[w] == 0)
+		livesum[w / 64] &= ~((uint64_t)1 << (w % 64));
+}
+
+/* the first page at or after page with anybody online in it,
+ * or -1 if there isn't one
+ */
+static int64_t
+presence_nextpage(uint64_t page)
+{
+	uint64_t	w = page / 64, s, bits;
+
+	if (page >= PRESENCE_PAGES) return -1;
+
+	bits = live[w] & (~(uint64_t)0 << (page % 64));
+	if (bits != 0) return (int64_t)(w * 64 + __builtin_ctzll(bits));
+
+	/* the rest of the way a word of live[] per bit */
+	if (++w == PRESENCE_LIVE_WORDS) return -1;
+	s = w / 64;
+	bits = livesum[s] & (~(uint64_t)0 << (w % 64));
+	while (bits == 0) {
+		if (++s == PRESENCE_SUM_WORDS) return -1;
+		bits = livesum[s];
+	}
+
+	w = s * 64 + __builtin_ctzll(bits);
+	return (int64_t)(w * 64 + __builtin_ctzll(live[w]));
+}
+
+static uint32_t
+presence_now(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		err(1, "presence_now: clock_gettime");
+	return (uint32_t)ts.tv_sec;
+}
+
+/* one more connection is lamp id. -1 if we can't keep track
+ * of it, and it stays as it was
+ */
+int
+presence_join(uint32_t id)
+{
+	struct presence_page	*p;
+	uint32_t		 i = id & (PRESENCE_PAGE_IDS - 1);
+
+	if (dir == NULL || (p = presence_page(id, 1)) == NULL) return -1;
+	if (p->conns[i] == PRESENCE_CONNS_MAX) return -1;
+
+	if (p->conns[i]++ > 0) return 0;
+
+	if (p->since[i] == 0) {
+		p->known++;
+		known++;
+	}
+	p->since[i] = presence_now();
+	p->bits[i / 64] |= (uint64_t)1 << (i % 64);
+	if (p->online++ == 0) presence_live(id >> PRESENCE_PAGE_SHIFT, 1);
+	online++;
+	return 0;
+}
+
+/* undoes a presence_join that worked */
+void
+presence_leave(uint32_t id)
+{
+	struct presence_page	*p;
+	uint32_t		 i = id & (PRESENCE_PAGE_IDS - 1);
+
+	if (dir == NULL || (p = presence_page(id, 0)) == NULL) return;
+	if (p->conns[i] == 0 || --p->conns[i] > 0) return;
+
+	p->since[i] = presence_now();
+	p->bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+	online--;
+	if (--p->online > 0) return;
+
+	presence_live(id >> PRESENCE_PAGE_SHIFT, 0);
+	dir[id >> PRESENCE_PAGE_SHIFT] = NULL;
+	known -= p->known;
+	pages--;
+	free(p);
+}
+
+/* PRESENCE_ONLINE, PRESENCE_OFFLINE or PRESENCE_UNKNOWN, with
+ * the time it last came or went in since for the first two
+ */
+int
+presence_lookup(uint32_t id, uint32_t *since)
+{
+	struct presence_page	*p;
+	uint32_t		 i = id & (PRESENCE_PAGE_IDS - 1);
+
+	if (dir == NULL || (p = presence_page(id, 0)) == NULL ||
+	    p->since[i] == 0)
+		return PRESENCE_UNKNOWN;
+
+	*since = p->since[i];
+	return (p->bits[i / 64] & ((uint64_t)1 << (i % 64))) ?
+	    PRESENCE_ONLINE : PRESENCE_OFFLINE;
+}
+
+/* the first online id at or after from, or -1 if there isn't
+ * one. empty pages are passed over by live[] and livesum[], and
+ * full words of the bitmap at a time
+ */
+int64_t
+presence_next(uint64_t from)
+{
+	struct presence_page	*p;
+	uint64_t		 page, word, bits;
+	int64_t			 next;
+	uint32_t		 i;
+
+	if (dir == NULL) return -1;
+
+	for (page = from >> PRESENCE_PAGE_SHIFT;
+	    (next = presence_nextpage(page)) >= 0;
+	    page++, from = page << PRESENCE_PAGE_SHIFT) {
+		if ((uint64_t)next != page) {
+			page = next;
+			from = page << PRESENCE_PAGE_SHIFT;
+		}
+
+		p = dir[page];
+		i = from & (PRESENCE_PAGE_IDS - 1);
+		word = i / 64;
+		bits = p->bits[word] & (~(uint64_t)0 << (i % 64));
+
+		for (;;) {
+			if (bits != 0)
+				return (int64_t)((page << PRESENCE_PAGE_SHIFT) +
+				    word * 64 + __builtin_ctzll(bits));
+			if (++word == PRESENCE_WORDS) break;
+			bits = p->bits[word];
+		}
+	}
+
+	return -1;
+}
+
+uint64_t
+presence_online(void)
+{
+	return online;
+}
+
+uint64_t
+presence_known(void)
+{
+	return known;
+}
+
+/* bytes of pages we've allocated */
+uint64_t
+presence_size(void)
+{
+	return pages * sizeof(struct presence_page);
+}
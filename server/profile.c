@@ -0,0 +1,430 @@
+/* profile.c
+ * a sampling cpu profiler we can turn on from the stats socket,
+ * for when himd is slow somewhere we can't attach anything to
+ *
+ * with -p, an ITIMER_PROF timer sends us SIGPROF hz times per
+ * second of cpu we burn. the handler walks the frame pointers
+ * from wherever it interrupted and counts the stack in a fixed
+ * table, so a sample is a few dozen loads and never a syscall,
+ * an allocation or a lock. stacks that don't fit are counted as
+ * dropped rather than pushing anything out
+ *
+ * the walk needs frame pointers, so himd is built with them.
+ * libraries that aren't end the walk early, at the first frame
+ * that doesn't look like one. we find our own functions in the
+ * symbol table of our binary, read before the chroot, and other
+ * people's with dladdr, and print stacks folded, root first, for
+ * flamegraph.pl and friends:
+ *
+ *	main;event_base_loop;him_recv;him_set 42
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <err.h>
+#include <fcntl.h>
+#include <link.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "himd.h"
+
+#define PROFILE_DEPTH		32
+#define PROFILE_PROBES		8
+
+#if defined(__x86_64__)
+#define UC_PC(uc)	((uintptr_t)(uc)->uc_mcontext.gregs[REG_RIP])
+#define UC_SP(uc)	((uintptr_t)(uc)->uc_mcontext.gregs[REG_RSP])
+#define UC_FP(uc)	((uintptr_t)(uc)->uc_mcontext.gregs[REG_RBP])
+#elif defined(__aarch64__)
+#define UC_PC(uc)	((uintptr_t)(uc)->uc_mcontext.pc)
+#define UC_SP(uc)	((uintptr_t)(uc)->uc_mcontext.sp)
+#define UC_FP(uc)	((uintptr_t)(uc)->uc_mcontext.regs[29])
+#else
+#error "profile.c doesn't know how to walk stacks here"
+#endif
+
+struct profile_stack {
+	uint64_t	count;
+	uint32_t	hash;
+	uint32_t	depth;
+	uintptr_t	pcs[PROFILE_DEPTH];	/* leaf first */
+};
+
+struct profile_sym {
+	uintptr_t	 addr;
+	size_t		 size;
+	const char	*name;
+};
+
+static int			enabled = 0;
+static volatile sig_atomic_t	running = 0, held = 0;
+static struct profile_stack	table[PROFILE_SLOTS];
+static struct profile_stats	stats;
+
+/* the top of the main thread's stack, which is the only
+ * one we have. everything between the interrupted stack
+ * pointer and here is mapped
+ */
+static uintptr_t		stackhi;
+
+/* our own functions, sorted by address */
+static struct profile_sym	*syms = NULL;
+static size_t			 nsyms = 0;
+
+static void		profile_sample(int, siginfo_t *, void *);
+static int		profile_timer(int);
+static void		profile_stack(void);
+static void		profile_symbols(void);
+static int		profile_symcmp(const void *, const void *);
+static int		profile_name(uintptr_t, char *, size_t);
+
+void
+profile_open(void)
+{
+	struct sigaction	sa;
+
+	/* all of this before the chroot */
+	profile_stack();
+	profile_symbols();
+
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_sigaction = profile_sample;
+	sa.sa_flags = SA_SIGINFO|SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) < 0)
+		err(1, "profile_open: sigaction");
+
+	enabled = 1;
+	warnx("profiling available, %zu symbols", nsyms);
+}
+
+int
+profile_enabled(void)
+{
+	return enabled;
+}
+
+int
+profile_start(int hz)
+{
+	if (!enabled || hz <= 0 || hz > PROFILE_HZ_MAX) return -1;
+	if (profile_timer(hz) < 0) return -1;
+
+	stats.hz = hz;
+	running = 1;
+	return 0;
+}
+
+void
+profile_stop(void)
+{
+	if (!running) return;
+
+	running = 0;
+	profile_timer(0);
+}
+
+void
+profile_reset(void)
+{
+	held = 1;
+	memset(table, 0, sizeof(table));
+	stats.samples = stats.dropped = stats.missed = 0;
+	stats.stacks = 0;
+	held = 0;
+}
+
+const struct profile_stats *
+profile_stats(void)
+{
+	return &stats;
+}
+
+/* while held, samples are only counted as missed, so the table
+ * holds still for whoever is reading it
+ */
+void
+profile_hold(int hold)
+{
+	held = hold;
+}
+
+/* slot as "root;...;leaf count" into buf. -1 if there's
+ * nothing in it, or it doesn't fit
+ */
+int
+profile_fold(size_t slot, char *buf, size_t len)
+{
+	struct profile_stack	*s;
+	size_t			 off = 0;
+	int			 depth, i, n;
+
+	if (slot >= PROFILE_SLOTS || (s = &table[slot])->count == 0)
+		return -1;
+
+	/* a library without frame pointers can hand the walk
+	 * something that looks like a frame but isn't. where a
+	 * return address lands outside everything we have mapped,
+	 * the rest of the stack is noise
+	 */
+	for (depth = 1; depth < (int)s->depth; depth++)
+		if (profile_name(s->pcs[depth] - 1, NULL, 0) < 0) break;
+
+	for (i = depth - 1; i >= 0; i--) {
+		/* return addresses point past the call, which can
+		 * be the start of the next function
+		 */
+		n = profile_name(s->pcs[i] - (i > 0), buf + off, len - off);
+		if (n < 0) n = snprintf(buf + off, len - off, "0x%lx",
+		    (unsigned long)s->pcs[i]);
+		if (n < 0 || (size_t)n + 1 >= len - off) return -1;
+		off += n;
+		buf[off++] = (i > 0) ? ';' : ' ';
+	}
+
+	n = snprintf(buf + off, len - off, "%llu",
+	    (unsigned long long)s->count);
+	if (n < 0 || (size_t)n >= len - off) return -1;
+	return off + n;
+}
+
+static void
+profile_sample(int sig, siginfo_t *si, void *arg)
+{
+	ucontext_t		*uc = (ucontext_t *)arg;
+	struct profile_stack	*s;
+	uintptr_t		 pcs[PROFILE_DEPTH], fp, next, sp;
+	uint32_t		 hash = 2166136261u, depth = 0;
+	int			 i;
+
+	(void)sig;
+	(void)si;
+
+	if (!running) return;
+	if (held) {
+		stats.missed++;
+		return;
+	}
+
+	pcs[depth++] = UC_PC(uc);
+	sp = UC_SP(uc);
+	fp = UC_FP(uc);
+
+	/* each frame holds the caller's frame pointer and then
+	 * the return address, further up the stack than the last.
+	 * anything else means we've walked off the end of the
+	 * frames we can trust
+	 */
+	while (depth < PROFILE_DEPTH && fp >= sp &&
+	    fp + 2 * sizeof(uintptr_t) <= stackhi &&
+	    (fp & (sizeof(uintptr_t) - 1)) == 0) {
+		next = ((uintptr_t *)fp)[0];
+		if (((uintptr_t *)fp)[1] == 0) break;
+		pcs[depth++] = ((uintptr_t *)fp)[1];
+		if (next <= fp) break;
+		fp = next;
+	}
+
+	for (i = 0; i < (int)depth; i++) {
+		hash ^= (uint32_t)(pcs[i] ^ (pcs[i] >> 32));
+		hash *= 16777619u;
+	}
+
+	stats.samples++;
+
+	for (i = 0; i < PROFILE_PROBES; i++) {
+		s = &table[(hash + i) & (PROFILE_SLOTS - 1)];
+
+		if (s->count == 0) {
+			s->hash = hash;
+			s->depth = depth;
+			memcpy(s->pcs, pcs, depth * sizeof(uintptr_t));
+			s->count = 1;
+			stats.stacks++;
+			return;
+		}
+
+		if (s->hash == hash && s->depth == depth &&
+		    memcmp(s->pcs, pcs, depth * sizeof(uintptr_t)) == 0) {
+			s->count++;
+			return;
+		}
+	}
+
+	stats.dropped++;
+}
+
+static int
+profile_timer(int hz)
+{
+	struct itimerval	it;
+
+	memset(&it, 0, sizeof(struct itimerval));
+	if (hz > 0) {
+		it.it_interval.tv_usec = 1000000 / hz;
+		it.it_value = it.it_interval;
+	}
+
+	if (setitimer(ITIMER_PROF, &it, NULL) < 0) {
+		warn("profile_timer: setitimer");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+profile_stack(void)
+{
+	FILE		*f;
+	char		 line[256];
+	unsigned long	 lo, hi;
+
+	if ((f = fopen("/proc/self/maps", "r")) == NULL)
+		err(1, "profile_stack: fopen");
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strstr(line, "[stack]") == NULL) continue;
+		if (sscanf(line, "%lx-%lx", &lo, &hi) == 2) stackhi = hi;
+	}
+
+	fclose(f);
+	if (stackhi == 0) errx(1, "profile_stack: can't find our stack");
+}
+
+/* the functions in our own symbol table, stripped or not.
+ * the file stays mapped, and the names point into it
+ */
+static void
+profile_symbols(void)
+{
+	ElfW(Ehdr)	*eh;
+	ElfW(Shdr)	*sh, *tab = NULL, *str;
+	ElfW(Sym)	*sym;
+	Dl_info		 info;
+	struct stat	 sb;
+	uintptr_t	 bias = 0;
+	char		*map;
+	size_t		 i, n;
+	int		 fd;
+
+	if ((fd = open("/proc/self/exe", O_RDONLY|O_CLOEXEC)) < 0 ||
+	    fstat(fd, &sb) < 0) {
+		warn("profile_symbols: /proc/self/exe");
+		goto fail;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("profile_symbols: mmap");
+		goto fail;
+	}
+
+	eh = (ElfW(Ehdr) *)map;
+	if ((size_t)sb.st_size < sizeof(ElfW(Ehdr)) ||
+	    memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(ElfW(Shdr)) >
+	    (uint64_t)sb.st_size)
+		goto bad;
+
+	sh = (ElfW(Shdr) *)(map + eh->e_shoff);
+	for (i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type == SHT_SYMTAB) tab = &sh[i];
+		else if (sh[i].sh_type == SHT_DYNSYM && tab == NULL)
+			tab = &sh[i];
+	}
+
+	if (tab == NULL || tab->sh_link >= eh->e_shnum ||
+	    tab->sh_offset + tab->sh_size > (uint64_t)sb.st_size)
+		goto bad;
+	str = &sh[tab->sh_link];
+	if (str->sh_offset + str->sh_size > (uint64_t)sb.st_size) goto bad;
+
+	/* position independent, so symbols are relative
+	 * to wherever we were loaded
+	 */
+	if (eh->e_type == ET_DYN) {
+		if (dladdr((void *)&enabled, &info) == 0) goto bad;
+		bias = (uintptr_t)info.dli_fbase;
+	}
+
+	sym = (ElfW(Sym) *)(map + tab->sh_offset);
+	n = tab->sh_size / sizeof(ElfW(Sym));
+	if ((syms = calloc(n, sizeof(struct profile_sym))) == NULL)
+		err(1, "profile_symbols: calloc");
+
+	for (i = 0; i < n; i++) {
+		if (ELF64_ST_TYPE(sym[i].st_info) != STT_FUNC ||
+		    sym[i].st_shndx == SHN_UNDEF || sym[i].st_value == 0 ||
+		    sym[i].st_name >= str->sh_size)
+			continue;
+
+		syms[nsyms].addr = bias + sym[i].st_value;
+		syms[nsyms].size = sym[i].st_size;
+		syms[nsyms].name = map + str->sh_offset + sym[i].st_name;
+		nsyms++;
+	}
+
+	qsort(syms, nsyms, sizeof(struct profile_sym), profile_symcmp);
+	return;
+
+bad:
+	warnx("profile_symbols: can't read our symbols");
+	munmap(map, sb.st_size);
+fail:
+	warnx("profiling with library symbols only");
+}
+
+static int
+profile_symcmp(const void *a, const void *b)
+{
+	const struct profile_sym	*x = a, *y = b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* -1 if pc isn't in anything we know about. buf can be
+ * NULL to just ask
+ */
+static int
+profile_name(uintptr_t pc, char *buf, size_t len)
+{
+	const char	*base;
+	Dl_info		 info;
+	size_t		 lo = 0, hi = nsyms, mid;
+
+	/* last symbol at or before pc */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (syms[mid].addr <= pc) lo = mid + 1;
+		else hi = mid;
+	}
+
+	if (lo > 0 && pc < syms[lo - 1].addr + syms[lo - 1].size)
+		return snprintf(buf, len, "%s", syms[lo - 1].name);
+
+	if (dladdr((void *)pc, &info) == 0 || info.dli_fname == NULL)
+		return -1;
+
+	if (info.dli_sname != NULL)
+		return snprintf(buf, len, "%s", info.dli_sname);
+
+	base = strrchr(info.dli_fname, '/');
+	return snprintf(buf, len, "%s+0x%lx",
+	    (base != NULL) ? base + 1 : info.dli_fname,
+	    (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+}
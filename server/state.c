@@ -0,0 +1,102 @@
+/* state.c
+ * keep the current color and some counters together, and
+ * optionally publish them into a shared memory page, so local
+ * readers never have to talk to us. see himstate.h for the
+ * reader side
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "himd.h"
+#include "himstate.h"
+
+static struct himstate		*page = NULL;
+static struct himstate_fields	 current;
+
+static uint64_t		realtime_us(void);
+
+static uint64_t
+realtime_us(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		err(1, "realtime_us: clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void
+state_open(const char *name)
+{
+	int	fd;
+
+	/* like the capture file, this has to happen
+	 * before we lose /dev/shm to the chroot
+	 */
+	fd = shm_open(name, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (fd < 0) err(1, "state_open: shm_open %s", name);
+
+	if (ftruncate(fd, HIMSTATE_SIZE) < 0)
+		err(1, "state_open: ftruncate");
+
+	page = mmap(NULL, HIMSTATE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	if (page == MAP_FAILED) err(1, "state_open: mmap");
+	close(fd);
+
+	/* readers ignore the page until the magic is right */
+	__atomic_store_n(&page->magic, 0, __ATOMIC_RELAXED);
+	memset(&page->f, 0, sizeof(struct himstate_fields));
+	page->abi = HIMSTATE_ABI;
+	page->seq = 0;
+	__atomic_store_n(&page->magic, HIMSTATE_MAGIC, __ATOMIC_RELEASE);
+
+	warnx("publishing state to shared memory %s", name);
+}
+
+void
+state_publish(char color, uint32_t version, int conns, uint64_t accepted)
+{
+	uint32_t	seq;
+
+	/* the first publish happens before privdrop,
+	 * while we're still allowed to ask for our pid
+	 */
+	if (current.started == 0) {
+		current.pid = getpid();
+		current.started = current.changed = realtime_us();
+	} else if ((uint32_t)color != current.color)
+		current.changed = realtime_us();
+
+	current.color = (uint32_t)color;
+	current.version = version;
+	current.conns = (uint32_t)conns;
+	current.accepted = accepted;
+
+	if (page == NULL) return;
+
+	seq = page->seq;
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&page->f, &current, sizeof(struct himstate_fields));
+
+	__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+const struct himstate_fields *
+state_get(void)
+{
+	return &current;
+}
@@ -0,0 +1,728 @@
+/* stats.c
+ * a line based text socket on localhost for asking himd how
+ * it's doing. each line is a command and its arguments, and the
+ * answer is zero or more lines followed by a line holding a
+ * single "." (or "error: ..." and then the "."), so you can
+ * drive it with nc or a few lines of script:
+ *
+ *	$ echo history | nc -q1 127.0.0.1 6970
+ *
+ * a handful of clients are served out of fixed buffers, so
+ * nothing here allocates once we're up. long answers are
+ * generated a buffer at a time as the client reads them
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "himd.h"
+#include "himstate.h"
+
+#define STATS_CLIENTS		8
+#define STATS_LINEMAX		256
+#define STATS_BUFSIZE		16384
+#define STATS_ARGMAX		8
+
+/* log-linear latency histograms in microseconds, as in himload:
+ * 16 linear steps per power of two is within ~6%
+ */
+#define HIST_SUB_BITS		4
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS) * HIST_SUB)
+
+struct stats_client {
+	int		 fd;
+	struct event	 ev;
+
+	char		 in[STATS_LINEMAX];
+	size_t		 inlen;
+
+	char		 out[STATS_BUFSIZE];
+	size_t		 outoff, outlen;
+
+	/* set while an answer is too big for out: called again
+	 * every time out drains, until it returns nonzero
+	 */
+	int		(*more)(struct stats_client *);
+	uint64_t	 cursor, limit;
+};
+
+struct hist {
+	uint64_t	buckets[HIST_BUCKETS];
+	uint64_t	count;
+	uint64_t	max;
+};
+
+struct stats_cmd {
+	const char	 *name;
+	const char	 *usage;
+	void		(*fn)(struct stats_client *, int, char **);
+};
+
+static int			listenfd = -1;
+static struct event		listenev;
+static struct stats_client	clients[STATS_CLIENTS];
+
+/* from a color change to the write() that hands it to a
+ * client, one histogram per tier
+ */
+static struct hist		latency[STATS_TIERS];
+static const char		*tiers[STATS_TIERS] = { "lamp", "monitor" };
+
+static void		stats_accept(int, short, void *);
+static void		stats_read(int, short, void *);
+static void		stats_write(int, short, void *);
+static void		stats_close(struct stats_client *);
+static void		stats_wait(struct stats_client *, short);
+static void		stats_next(struct stats_client *);
+static void		stats_lines(struct stats_client *);
+static void		stats_run(struct stats_client *, char *);
+static int		stats_number(const char *, uint64_t *);
+static uint64_t		stats_now(void);
+
+static int		hist_index(uint64_t);
+static uint64_t		hist_value(int);
+static uint64_t		hist_pct(struct hist *, double);
+
+static void		cmd_help(struct stats_client *, int, char **);
+static void		cmd_state(struct stats_client *, int, char **);
+static void		cmd_load(struct stats_client *, int, char **);
+static void		cmd_latency(struct stats_client *, int, char **);
+static void		cmd_history(struct stats_client *, int, char **);
+static int		more_history(struct stats_client *);
+static void		cmd_presence(struct stats_client *, int, char **);
+static void		cmd_lamp(struct stats_client *, int, char **);
+static void		cmd_online(struct stats_client *, int, char **);
+static int		more_online(struct stats_client *);
+static void		cmd_profile(struct stats_client *, int, char **);
+static int		more_profile(struct stats_client *);
+static void		cmd_quit(struct stats_client *, int, char **);
+
+static const struct stats_cmd	cmds[] = {
+	{ "help",	"help",			cmd_help },
+	{ "state",	"state",		cmd_state },
+	{ "load",	"load",			cmd_load },
+	{ "latency",	"latency [reset]",	cmd_latency },
+	{ "history",	"history [from [to]]",	cmd_history },
+	{ "presence",	"presence",		cmd_presence },
+	{ "lamp",	"lamp id [id ...]",	cmd_lamp },
+	{ "online",	"online [from]",	cmd_online },
+	{ "profile",	"profile [start [hz] | stop | reset | dump]",
+							cmd_profile },
+	{ "quit",	"quit",			cmd_quit },
+};
+
+#define NCMDS	(sizeof(cmds) / sizeof(struct stats_cmd))
+
+void
+stats_open(int port)
+{
+	struct sockaddr_in	sa;
+	int			enable = 1, i;
+
+	for (i = 0; i < STATS_CLIENTS; i++) clients[i].fd = -1;
+
+	listenfd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (listenfd < 0) err(1, "stats_open: socket");
+
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+	    &enable, sizeof(int)) < 0)
+		err(1, "stats_open: setsockopt SO_REUSEADDR");
+
+	/* not for the outside world */
+	bzero(&sa, sizeof(struct sockaddr_in));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(listenfd, (struct sockaddr *)&sa,
+	    sizeof(struct sockaddr_in)) < 0)
+		err(1, "stats_open: bind");
+	if (listen(listenfd, STATS_CLIENTS) < 0)
+		err(1, "stats_open: listen");
+
+	event_set(&listenev, listenfd, EV_READ|EV_PERSIST, stats_accept, NULL);
+	if (event_add(&listenev, NULL) < 0)
+		err(1, "stats_open: event_add");
+
+	warnx("stats on 127.0.0.1:%d", port);
+}
+
+int
+stats_printf(struct stats_client *c, const char *fmt, ...)
+{
+	va_list	ap;
+	size_t	room;
+	int	n;
+
+	/* always leave space for the terminating ".\n" */
+	room = STATS_BUFSIZE - c->outlen - 2;
+
+	va_start(ap, fmt);
+	n = vsnprintf(c->out + c->outlen, room, fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || (size_t)n >= room) return -1;
+	c->outlen += n;
+	return 0;
+}
+
+/* n deliveries of the change made at since, on CLOCK_MONOTONIC */
+void
+stats_latency(int tier, uint64_t since, uint64_t n)
+{
+	struct hist	*h = &latency[tier];
+	uint64_t	 us;
+
+	if (n == 0) return;
+
+	us = stats_now() - since;
+	h->buckets[hist_index(us)] += n;
+	h->count += n;
+	if (us > h->max) h->max = us;
+}
+
+static void
+stats_accept(int fd, short event, void *arg)
+{
+	struct stats_client	*c = NULL;
+	int			 sockfd, i;
+
+	(void)event;
+	(void)arg;
+
+	sockfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	if (sockfd == -1) {
+		if (errno != EWOULDBLOCK && errno != ECONNABORTED)
+			warn("stats_accept: accept");
+		return;
+	}
+
+	for (i = 0; i < STATS_CLIENTS; i++) {
+		if (clients[i].fd == -1) {
+			c = &clients[i];
+			break;
+		}
+	}
+
+	if (c == NULL) {
+		warnx("stats: too many clients, dropping one");
+		close(sockfd);
+		return;
+	}
+
+	c->fd = sockfd;
+	c->inlen = c->outoff = c->outlen = 0;
+	c->more = NULL;
+	stats_wait(c, EV_READ);
+}
+
+static void
+stats_read(int fd, short event, void *arg)
+{
+	struct stats_client	*c = (struct stats_client *)arg;
+	ssize_t			 n;
+
+	(void)event;
+
+	n = read(fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+	if (n == -1) {
+		if (errno == EWOULDBLOCK) {
+			stats_wait(c, EV_READ);
+			return;
+		}
+
+		stats_close(c);
+		return;
+	} else if (n == 0) {
+		stats_close(c);
+		return;
+	}
+
+	c->inlen += n;
+	stats_lines(c);
+
+	if (c->fd < 0) return;
+	stats_next(c);
+}
+
+static void
+stats_write(int fd, short event, void *arg)
+{
+	struct stats_client	*c = (struct stats_client *)arg;
+	ssize_t			 n;
+
+	(void)event;
+
+	while (c->outoff < c->outlen) {
+		n = write(fd, c->out + c->outoff, c->outlen - c->outoff);
+		if (n == -1) {
+			if (errno == EWOULDBLOCK) {
+				stats_wait(c, EV_WRITE);
+				return;
+			}
+
+			stats_close(c);
+			return;
+		}
+
+		c->outoff += n;
+	}
+
+	c->outoff = c->outlen = 0;
+
+	if (c->more != NULL) {
+		if (c->more(c)) {
+			c->more = NULL;
+			memcpy(c->out + c->outlen, ".\n", 2);
+			c->outlen += 2;
+		}
+
+		stats_wait(c, EV_WRITE);
+		return;
+	}
+
+	/* done with that answer, so look at anything
+	 * else they sent while we were busy
+	 */
+	stats_lines(c);
+	if (c->fd < 0) return;
+	stats_next(c);
+}
+
+static void
+stats_close(struct stats_client *c)
+{
+	if (event_del(&c->ev) < 0) err(1, "stats_close: event_del");
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void
+stats_wait(struct stats_client *c, short what)
+{
+	event_set(&c->ev, c->fd, what,
+	    (what == EV_READ) ? stats_read : stats_write, c);
+	if (event_add(&c->ev, NULL) < 0)
+		err(1, "stats_wait: event_add");
+}
+
+/* an answer on its way out comes first, and reading waits for
+ * it: with in[] full, read() would have no room and return 0,
+ * which looks just like the client going away
+ */
+static void
+stats_next(struct stats_client *c)
+{
+	if (c->outlen > 0 || c->more != NULL) stats_wait(c, EV_WRITE);
+	else if (c->inlen < sizeof(c->in)) stats_wait(c, EV_READ);
+	else {
+		warnx("stats: line too long, dropping client");
+		stats_close(c);
+	}
+}
+
+static void
+stats_lines(struct stats_client *c)
+{
+	char	*nl;
+	size_t	 len;
+
+	/* one answer at a time */
+	while (c->fd >= 0 && c->outlen == 0 && c->more == NULL &&
+	    (nl = memchr(c->in, '\n', c->inlen)) != NULL) {
+		*nl = '\0';
+		if (nl > c->in && nl[-1] == '\r') nl[-1] = '\0';
+
+		stats_run(c, c->in);
+
+		len = nl + 1 - c->in;
+		memmove(c->in, nl + 1, c->inlen - len);
+		c->inlen -= len;
+	}
+}
+
+static void
+stats_run(struct stats_client *c, char *line)
+{
+	char	*argv[STATS_ARGMAX], *last, *word;
+	int	 argc = 0;
+	size_t	 i;
+
+	for (word = strtok_r(line, " \t", &last); word != NULL;
+	    word = strtok_r(NULL, " \t", &last)) {
+		if (argc == STATS_ARGMAX) {
+			stats_printf(c, "error: too many arguments\n");
+			goto done;
+		}
+
+		argv[argc++] = word;
+	}
+
+	if (argc == 0) return;
+
+	for (i = 0; i < NCMDS; i++) {
+		if (strcmp(argv[0], cmds[i].name) == 0) {
+			cmds[i].fn(c, argc, argv);
+			if (c->fd < 0 || c->more != NULL) return;
+			goto done;
+		}
+	}
+
+	stats_printf(c, "error: unknown command %s, try help\n", argv[0]);
+done:
+	memcpy(c->out + c->outlen, ".\n", 2);
+	c->outlen += 2;
+}
+
+static int
+stats_number(const char *s, uint64_t *out)
+{
+	char	*end;
+
+	errno = 0;
+	*out = strtoull(s, &end, 10);
+	return (*s == '\0' || *end != '\0' || errno != 0) ? -1 : 0;
+}
+
+static uint64_t
+stats_now(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "stats_now: clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int
+hist_index(uint64_t v)
+{
+	int	msb;
+
+	if (v < HIST_SUB) return (int)v;
+
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	    (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t
+hist_value(int idx)
+{
+	int	msb;
+
+	if (idx < HIST_SUB) return (uint64_t)idx;
+
+	msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	return ((uint64_t)(HIST_SUB | (idx % HIST_SUB))) <<
+	    (msb - HIST_SUB_BITS);
+}
+
+static uint64_t
+hist_pct(struct hist *h, double pct)
+{
+	uint64_t	want, seen = 0;
+	int		i;
+
+	if (h->count == 0) return 0;
+
+	want = (uint64_t)((double)h->count * pct / 100.0);
+	if (want == 0) want = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want) return hist_value(i);
+	}
+
+	return h->max;
+}
+
+static void
+cmd_help(struct stats_client *c, int argc, char **argv)
+{
+	size_t	i;
+
+	(void)argc;
+	(void)argv;
+
+	for (i = 0; i < NCMDS; i++) stats_printf(c, "%s\n", cmds[i].usage);
+}
+
+static void
+cmd_state(struct stats_client *c, int argc, char **argv)
+{
+	const struct himstate_fields	*f = state_get();
+
+	(void)argc;
+	(void)argv;
+
+	stats_printf(c, "color %" PRIu32 "\n", f->color);
+	stats_printf(c, "version %" PRIu32 "\n", f->version);
+	stats_printf(c, "conns %" PRIu32 "\n", f->conns);
+	stats_printf(c, "accepted %" PRIu64 "\n", f->accepted);
+	stats_printf(c, "started %" PRIu64 "\n", f->started);
+	stats_printf(c, "changed %" PRIu64 "\n", f->changed);
+	stats_printf(c, "history %" PRIu64 " of %" PRIu64 "\n",
+	    history_end() - history_first(), history_end());
+}
+
+static void
+cmd_load(struct stats_client *c, int argc, char **argv)
+{
+	const struct himd_load	*l = himd_load();
+
+	(void)argc;
+	(void)argv;
+
+	stats_printf(c, "conns %d of %d\n", l->conns, l->maxconns);
+	stats_printf(c, "monitors %d, new ones while under %d\n",
+	    l->monitors, l->monitorcap);
+	stats_printf(c, "refused monitors %" PRIu64 "\n", l->refusedmonitors);
+	stats_printf(c, "refused lamps %" PRIu64 "\n", l->refusedlamps);
+	stats_printf(c, "shed %" PRIu64 "\n", l->shed);
+	stats_printf(c, "accept pauses %" PRIu64 "\n", l->acceptpauses);
+}
+
+/* latency [reset]
+ * per tier: deliveries, then p50 p90 p99 p999 max in
+ * microseconds. lamps on the kernel fan-out (-k) count when
+ * the whole broadcast has been handed over
+ */
+static void
+cmd_latency(struct stats_client *c, int argc, char **argv)
+{
+	struct hist	*h;
+	int		 i;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset") != 0)) {
+		stats_printf(c, "error: usage: latency [reset]\n");
+		return;
+	}
+
+	for (i = 0; i < STATS_TIERS; i++) {
+		h = &latency[i];
+		stats_printf(c, "%s %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64
+		    " p99 %" PRIu64 " p999 %" PRIu64 " max %" PRIu64 "\n",
+		    tiers[i], h->count, hist_pct(h, 50), hist_pct(h, 90),
+		    hist_pct(h, 99), hist_pct(h, 99.9), h->max);
+	}
+
+	if (argc == 2) bzero(latency, sizeof(latency));
+}
+
+/* history [from [to]]
+ * every color change with from <= time < to, oldest first, as
+ * "time conn old new". times are unix microseconds, and the
+ * conn is the id captures (-w) use for that connection
+ */
+static void
+cmd_history(struct stats_client *c, int argc, char **argv)
+{
+	uint64_t	from = 0, to = UINT64_MAX;
+
+	if (argc > 3 || (argc > 1 && stats_number(argv[1], &from) < 0) ||
+	    (argc > 2 && stats_number(argv[2], &to) < 0)) {
+		stats_printf(c, "error: usage: history [from [to]]\n");
+		return;
+	}
+
+	c->cursor = history_search(from);
+	c->limit = (to == UINT64_MAX) ? history_end() : history_search(to);
+
+	if (more_history(c)) return;
+	c->more = more_history;
+}
+
+static int
+more_history(struct stats_client *c)
+{
+	const struct history_record	*r;
+
+	/* a busy fleet can lap a slow reader */
+	if (c->cursor < history_first()) c->cursor = history_first();
+
+	for (; c->cursor < c->limit; c->cursor++) {
+		if ((r = history_get(c->cursor)) == NULL) break;
+		if (stats_printf(c, "%" PRIu64 " %" PRIu32 " %u %u\n",
+		    r->when, r->conn, r->old, r->new) < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+cmd_presence(struct stats_client *c, int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	stats_printf(c, "online %" PRIu64 "\n", presence_online());
+	stats_printf(c, "known %" PRIu64 "\n", presence_known());
+	stats_printf(c, "bytes %" PRIu64 "\n", presence_size());
+}
+
+/* lamp id [id ...]
+ * "id online since", "id offline since" or "id unknown" for
+ * each, since being when it last came or went in unix seconds
+ */
+static void
+cmd_lamp(struct stats_client *c, int argc, char **argv)
+{
+	uint64_t	id;
+	uint32_t	since;
+	int		i;
+
+	if (argc < 2) {
+		stats_printf(c, "error: usage: lamp id [id ...]\n");
+		return;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (stats_number(argv[i], &id) < 0 || id > UINT32_MAX) {
+			stats_printf(c, "error: bad lamp id %s\n", argv[i]);
+			return;
+		}
+
+		switch (presence_lookup(id, &since)) {
+		case PRESENCE_ONLINE:
+			stats_printf(c, "%" PRIu64 " online %" PRIu32 "\n",
+			    id, since);
+			break;
+		case PRESENCE_OFFLINE:
+			stats_printf(c, "%" PRIu64 " offline %" PRIu32 "\n",
+			    id, since);
+			break;
+		default:
+			stats_printf(c, "%" PRIu64 " unknown\n", id);
+		}
+	}
+}
+
+/* online [from]
+ * every online lamp id at or after from, in order, as "id since"
+ */
+static void
+cmd_online(struct stats_client *c, int argc, char **argv)
+{
+	uint64_t	from = 0;
+
+	if (argc > 2 || (argc == 2 && (stats_number(argv[1], &from) < 0 ||
+	    from > UINT32_MAX))) {
+		stats_printf(c, "error: usage: online [from]\n");
+		return;
+	}
+
+	c->cursor = from;
+	if (more_online(c)) return;
+	c->more = more_online;
+}
+
+static int
+more_online(struct stats_client *c)
+{
+	int64_t		id;
+	uint32_t	since;
+
+	while ((id = presence_next(c->cursor)) >= 0) {
+		presence_lookup(id, &since);
+		if (stats_printf(c, "%" PRId64 " %" PRIu32 "\n",
+		    id, since) < 0)
+			return 0;
+		c->cursor = id + 1;
+	}
+
+	return 1;
+}
+
+/* profile [start [hz] | stop | reset | dump]
+ * without arguments, how the profiler is doing. dump prints
+ * every stack it has seen, folded for flame graphs
+ */
+static void
+cmd_profile(struct stats_client *c, int argc, char **argv)
+{
+	const struct profile_stats	*p = profile_stats();
+	uint64_t			 hz = PROFILE_HZ;
+
+	if (!profile_enabled()) {
+		stats_printf(c, "error: himd wasn't started with -p\n");
+		return;
+	}
+
+	if (argc == 1) {
+		stats_printf(c, "hz %d\n", p->hz);
+		stats_printf(c, "samples %" PRIu64 "\n", p->samples);
+		stats_printf(c, "stacks %" PRIu64 " of %d\n", p->stacks,
+		    PROFILE_SLOTS);
+		stats_printf(c, "dropped %" PRIu64 "\n", p->dropped);
+		stats_printf(c, "missed %" PRIu64 "\n", p->missed);
+	} else if (strcmp(argv[1], "start") == 0 && argc <= 3) {
+		if ((argc == 3 && (stats_number(argv[2], &hz) < 0 ||
+		    hz == 0 || hz > PROFILE_HZ_MAX)) ||
+		    profile_start(hz) < 0)
+			stats_printf(c, "error: can't profile at %s hz\n",
+			    (argc == 3) ? argv[2] : "default");
+	} else if (strcmp(argv[1], "stop") == 0 && argc == 2) {
+		profile_stop();
+	} else if (strcmp(argv[1], "reset") == 0 && argc == 2) {
+		profile_reset();
+	} else if (strcmp(argv[1], "dump") == 0 && argc == 2) {
+		c->cursor = 0;
+		if (more_profile(c)) return;
+		c->more = more_profile;
+	} else {
+		stats_printf(c, "error: usage: profile "
+		    "[start [hz] | stop | reset | dump]\n");
+	}
+}
+
+static int
+more_profile(struct stats_client *c)
+{
+	char	line[PROFILE_LINEMAX];
+	int	done = 1;
+
+	/* the table can't change under us while we copy it,
+	 * but it can between buffers
+	 */
+	profile_hold(1);
+	for (; c->cursor < PROFILE_SLOTS; c->cursor++) {
+		if (profile_fold(c->cursor, line, sizeof(line)) < 0) continue;
+		if (stats_printf(c, "%s\n", line) < 0) {
+			done = 0;
+			break;
+		}
+	}
+
+	profile_hold(0);
+	return done;
+}
+
+static void
+cmd_quit(struct stats_client *c, int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	stats_close(c);
+}
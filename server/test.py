@@ -30,6 +30,10 @@ if sys.argv[1] == "update":
 	s.close()
 	sys.exit(0)
 
+# tell the server we only watch, so it turns us away
+# before any lamps when it's full
+s.sendall(bytes([0x81]))
+
 while True:
 	# read whenever we can
 	rawdata = s.recv(1)